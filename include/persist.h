@@ -13,9 +13,89 @@
 #include <memory>
 #include <cassert>
 #include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <future>
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
 
 namespace persist
 {
+    class thread_cache;
+    struct slab;
+    struct large_block;
+
+    // Cells
+    //
+    // Small blocks are rounded up to one of cell_count sizes: 8, 16, 24, 32, then
+    // four sizes for each power of two, 40, 48, 56, 64, 80 ... up to max_cell_size.
+    // Larger blocks are not rounded.
+
+    const int cell_count = 28;
+    const std::size_t max_cell_size = 2048;
+
+    // highest_bit
+    // Returns the position of the highest set bit of @x, which is not 0.
+    // Compilers without __builtin_clzll use a binary search.
+    constexpr int highest_bit(std::uint64_t x)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return 63 - __builtin_clzll(x);
+#else
+        int bit = 0;
+        for(int shift = 32; shift; shift >>= 1)
+            if(x >> shift) { x >>= shift; bit += shift; }
+        return bit;
+#endif
+    }
+
+    // lowest_bit
+    // Returns the position of the lowest set bit of @x, which is not 0.
+    constexpr int lowest_bit(std::uint64_t x)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(x);
+#else
+        return highest_bit(x & (~x + 1));
+#endif
+    }
+
+    // object_cell
+    // Returns the cell for @size, which is between 1 and max_cell_size.
+    // Uses the top bits of size-1, so there are no loops or branches.
+    constexpr int object_cell(std::size_t size)
+    {
+        std::size_t s = size - 1;
+        int bits = highest_bit(s | 16);
+        return size <= 32 ? int(s >> 3) : 4*(bits-4) + int((s >> (bits-2)) & 3);
+    }
+
+    struct cell_table
+    {
+        std::uint16_t size[cell_count];
+
+        constexpr cell_table() : size()
+        {
+            for(int cell=0; cell<cell_count; ++cell)
+                size[cell] = cell < 4 ? 8*(cell+1) : (5 + cell%4) << (cell/4 + 2);
+        }
+
+        constexpr bool valid() const
+        {
+            for(int cell=0; cell<cell_count; ++cell)
+                if(object_cell(size[cell]) != cell || (cell+1 < cell_count && object_cell(size[cell]+1) != cell+1))
+                    return false;
+            return size[cell_count-1] == max_cell_size;
+        }
+    };
+
+    inline constexpr cell_table cell_sizes;
+    static_assert(cell_sizes.valid(), "object_cell does not match cell_sizes");
+
+    constexpr std::size_t cell_size(int cell) { return cell_sizes.size[cell]; }
+
     // Exception thrown when an invalid datafile is opened,
     // or the datafile is the wrong version.
     class InvalidVersion : public std::runtime_error
@@ -24,6 +104,45 @@ namespace persist
         InvalidVersion();
     };
 
+    // Arenas
+    //
+    // The heap is divided into arena_count arenas, each with its own free lists and
+    // lock, so that threads and processes using different arenas do not contend.
+    // Each thread is given an arena round-robin, unless an allocator names one.
+    // A block is always freed into the arena that allocated it.
+
+    const int arena_count = 4;
+
+    struct arena
+    {
+        process_mutex mutex;
+
+        // Small blocks live in slabs, see persist.cpp.
+        // These are the offsets of the slabs with free blocks for each cell, and of the unused slabs.
+        size_t partial_slabs[cell_count], empty_slabs;
+
+        // Larger blocks are kept in free lists segregated by size, see persist.cpp.
+        // The lists hold blocks of up to 2^large_lists bytes.
+        enum { large_lists = 40, large_sublists = 8 };
+        std::uint64_t large_bitmap;
+        std::uint8_t large_subbitmap[large_lists];
+        size_t large_free_lists[large_lists][large_sublists];
+        size_t large_end;      // Offset of the end marker of the last chunk of large blocks
+
+        void lock() { mutex.lock(); }
+        void unlock() { mutex.unlock(); }
+    };
+
+    // How the heap grows when it is full: by a percentage of its size, by a fixed
+    // number of bytes, or only as much as is needed.
+    enum growth_policy { grow_geometric, grow_fixed, grow_exact };
+
+    // How shared_memory::warmup() brings the heap into memory.
+    // warm_willneed: asks the kernel to read the pages ahead, and returns without waiting.
+    // warm_prefault: touches every page, using several threads.
+    // warm_lock: locks the pages in memory, so they are never paged out.
+    enum { warm_willneed=1, warm_prefault=2, warm_lock=4 };
+
     class shared_memory
     {
     public:
@@ -41,8 +160,14 @@ namespace persist
         void *root();     // The root object
         const void *root() const;     // The root object
         
-        void *malloc(size_t);
+        // Allocates from arena @arena_id, or from the current thread's arena if it is -1.
+        // free() returns the block to whichever arena it came from.
+        void *malloc(size_t, int arena_id=-1);
         void free(void*, size_t);
+
+        // As malloc() and free(), for a block of size cell_size(cell)
+        void *malloc_cell(int cell, int arena_id=-1);
+        void free_cell(void*, int cell);
         
         void clear();
         
@@ -51,27 +176,93 @@ namespace persist
         size_type limit() const;
         void limit(size_type);
 
-        void *fast_malloc(size_t size)
-        {
-            auto r = size&7;
-            if(r)
-                size += (8-r);
-            assert((size&7)==0);
-            auto result = top += size;
-            if(result > end)
-            {
-                lockMem();
-                bool failed = !extend_to(result);
-                if(failed) top -= size;
-                unlockMem();
-                if(failed) return nullptr;
-            }
-            // top is a std::atmoic, so we need to do it like this:
-            return result - size;
-        }
+        // Sets how the heap grows.  @amount is a percentage for grow_geometric, and a number
+        // of bytes for grow_fixed.  New heaps grow by 50%.
+        void growth(growth_policy policy, size_type amount);
+
+        // Maps pages added to the heap by other processes.  This happens automatically
+        // when they are accessed, but can be done in advance.  Returns true if the heap has grown.
+        bool refresh();
+
+        // Allocates memory that is never freed.  Each thread bump-allocates
+        // from its own chunk of the heap, see persist.cpp.
+        void *fast_malloc(size_t size);
+
+        // Brings the first @length bytes of the heap into memory, or all of the used heap if
+        // @length is 0, so that a restarted process does not fault on each page.  @how is a
+        // combination of warm_willneed, warm_prefault and warm_lock.  warm_prefault uses
+        // @threads threads, or one per CPU if it is 0.
+        // Returns the time taken in seconds, or -1 if the pages could not be locked.
+        double warmup(int how=warm_prefault, int threads=0, size_type length=0);
+
+        // The number of bytes of the heap that are in memory
+        size_type resident() const;
+
+        // Writes the heap to disk, and returns false if it could not be written.
+        // With the track_changes flag, only the parts changed since the last checkpoint are
+        // written, so the cost depends on how much has changed and not on the size of the heap.
+        bool checkpoint();
+
+        // As checkpoint(), but the heap is written by another thread.  The future is ready when the
+        // data is on disk.  Changes made after checkpoint_async() returns are not included.
+        std::future<bool> checkpoint_async();
+
+        // Transactions
+        //
+        // With the transactions flag, changes to the heap between begin() and commit() are
+        // rolled back by abort(), or if the process dies first.  commit() returns once the
+        // changes are in the log, and the commits of several threads share the same sync.
+        // Transactions run one at a time in each process, and while one runs, another thread that
+        // begins a transaction, or calls malloc() or free(), waits for it.  Another thread that
+        // writes to a page that the transaction has not written waits for it too, and a write to
+        // a page that it has written becomes part of it, so a thread must not write to the heap
+        // outside a transaction while holding a lock that a transaction needs, such as lock().
+        // While no transaction is running, any thread may write to the heap without one, and
+        // those writes are saved by the next commit, by checkpoint(), or when the heap is closed.
+        // Each process sees the transactions committed by other processes when it begins one.
+        // Writes made outside a transaction while another process uses the heap may be lost.
+        // begin() returns false if the heap does not have transactions, or if this thread is
+        // already running one, and commit() returns false if the changes could not be written,
+        // in which case they are written with the next commit.
+        // A process that dies holding one of the heap's mutexes, for example in malloc(), leaves
+        // it locked until the heap is next opened by a process while no other process has it open,
+        // unless the heap has transactions, when each process has its own mutexes, and lock()
+        // only excludes the threads of the same process.
+        bool begin();
+        bool commit();
+        void abort();
+
+        // Writes a copy of the heap as it is now to the file @path, which can be opened as a
+        // heap.  The copy is written by another thread, and writers only pay for copying the
+        // pages they write before it does.  The future is ready when the copy is on disk.
+        std::future<bool> snapshot(const char *path);
+
+        // Backups
+        //
+        // backup() writes the pages of the heap that have changed since the last backup to the
+        // file @path, in the same way as snapshot().  Each backup is numbered, and restore()
+        // applies backups to the file @filename in order, starting from a copy of the heap or
+        // a full backup.  With the track_changes flag, only the first backup after the heap is
+        // opened is full.  Without it, every backup is full.  If restore() fails, @filename
+        // may be partly updated, so restore a copy.
+        std::future<bool> backup(const char *path);
+        static bool restore(const char *filename, const char *backup);
+
+        // Replication
+        //
+        // ship() writes the pages that have changed since it was last called to the pipe or
+        // socket @fd, as a numbered batch.  apply() reads a batch from @fd into this heap, which
+        // is a replica.  The replica must be mapped at the same address as the heap it follows,
+        // and is only read, holding lock() to see whole batches.  With the track_changes flag,
+        // only the first batch, the next after a failure, or one with @full, holds the whole
+        // heap.  apply() returns false at the end of the stream, or if a batch is missing, when
+        // the replica needs a full batch.
+        bool ship(int fd, bool full=false);
+        bool apply(int fd);
 
     private:
         friend class map_file;
+        friend class thread_cache;
         shared_memory(const shared_memory&) = delete;
         
         // Magic bytes to check we have loaded the correct version
@@ -85,23 +276,98 @@ namespace persist
 
         size_t current_size;          // The size of the allocation
         size_t max_size;
+        growth_policy growth_mode;
+        size_t growth_amount;
 
         void *condition;
 
-        std::atomic<char *> top, end;
+        // Offsets from the start of the heap, so that the heap can be mapped anywhere
+        std::atomic<size_t> top, end;
+        std::atomic<unsigned> generation;   // Incremented whenever the heap grows
 
-        void *free_space[64];   // An embarrassingly simple memory manager
+        arena arenas[arena_count];
+        std::atomic<unsigned> next_arena;   // For round-robin assignment
+
+        // With the lock_free flag, small free blocks are kept in these stacks instead, see persist.cpp.
+        int heap_flags;
+        std::atomic<std::uint64_t> free_stacks[cell_count];
         
+        std::uint64_t backup_epoch;     // The number of the last backup
+
         shared_base extra;
         
         bool extend_to(void *newTop);
+        bool grow_to(char *new_top);
+        void *allocate_top(size_t size);
+        void *allocate_root(size_t size);
+        arena &arena_for(int arena_id);
+        arena &owner(int cell, void *block);
+
+        // These allocation functions are called with the arena's mutex held
+        void *allocate_block(arena &a, int cell);
+        int allocate_blocks(arena &a, int cell, void **blocks, int count);
+        void free_block(arena &a, int cell, void *block);
+        slab *new_slab(arena &a, int cell);
+        void *slab_allocate(arena &a, int cell);
+        void slab_free(arena &a, int cell, void *block);
+        void *stack_pop(int cell);
+        void stack_push(int cell, void *block);
+        void *large_allocate(arena &a, size_t size, bool grow);
+        void large_free(arena &a, large_block *block, bool trim);
+        bool large_grow(arena &a, size_t bytes);
+        void large_donate(arena &a, void *p, size_t bytes);
+        large_block *large_find(arena &a, size_t size);
+        void large_insert(arena &a, large_block *block);
+        void large_remove(arena &a, large_block *block);
+        void clear_free_lists();
+
+        void drain_caches(bool keep_blocks);
+        void discard_thread_caches();
+        void reset_locks();
+        std::future<bool> copy_to(const char *path, bool backup);
+        void copy_header(const char *from, size_t length, size_t offset=0);
+        void clean_locks(char *copy, size_t offset, size_t length) const;
+
+        // Held by malloc() and free() on a heap with transactions, see enter_allocator
+        struct allocating;
+        void enter_allocator();
+        void leave_allocator();
         void unmap();
         void lockMem();
         void unlockMem();
     };
 
 
-    enum { shared_heap=1, private_map=2, temp_heap=8, create_new=16, read_only=32 };
+    // lock_free: small blocks use lock-free free lists, so that processes never wait
+    // for each other's allocations.  It is fixed when the heap is created.
+    // preallocate: disk space is allocated whenever the file is extended, so that a full
+    // disk makes allocation fail instead of raising SIGBUS later.  It is also kept in the heap.
+    // huge_pages: the heap is backed by 2MB pages where the system allows it, to reduce TLB
+    // misses on large heaps.  The heap grows in 2MB steps.  It is also kept in the heap.
+    // populate: the heap is read into memory when it is mapped or grows (MAP_POPULATE).
+    // working_set: the pages in memory when the heap is closed are recorded in the file
+    // filename.pages, and are read ahead in the background when it is next opened.
+    // track_changes: this process's writes to the heap are tracked for checkpoint(), by write-protecting
+    // it.  A system call such as read() that writes into a protected page fails with EFAULT.
+    // transactions: the heap supports transactions, using a redo log in the file filename.log.
+    // The heap is mapped privately, and write-protected as for track_changes.  It is also kept in the heap.
+    // relocatable: the heap is mapped at @base, or anywhere if it is 0, instead of at the address
+    // it was created at.  Its objects must only point into the heap using offset_ptr, as the
+    // allocators do.  It is fixed when the heap is created.
+    enum { shared_heap=1, private_map=2, temp_heap=8, create_new=16, read_only=32, lock_free=64, preallocate=128, huge_pages=256,
+        populate=512, working_set=1024, track_changes=2048, transactions=4096, relocatable=8192 };
+
+    // Faults
+    //
+    // On Unix, the first map_file to be opened installs a handler for SIGSEGV, which the
+    // library then owns.  It maps the pages of a heap that another process has grown, and
+    // catches the first write to a protected page for track_changes, transactions, snapshot()
+    // and backup().  Faults anywhere else are passed to the handler that was installed before
+    // it, or crash as they would have without it.  A SIGSEGV handler installed afterwards must
+    // likewise pass on every fault that it does not handle itself, by calling the handler that
+    // sigaction() returned when it was installed, otherwise heaps stop following each other's
+    // growth, and those features stop working.  The handler only makes system calls that are
+    // safe in a signal handler.
 
     // map_file
     // A wrapper around a block of shared memory.
@@ -143,20 +409,125 @@ namespace persist
         shared_memory &data() const;
     };
 
+    // scan_guard
+    // Bounds the memory used by a scan over a large heap, so that it does not evict the
+    // pages that this and other processes are using.  Call visit() with each object as it is
+    // scanned.  The heap is tracked in chunks: the pages after the current chunk are read
+    // ahead sequentially, and once more than @budget bytes of chunks have been visited, the
+    // oldest is released from memory.  Any chunks still held are released by the destructor.
+    class scan_guard
+    {
+    public:
+        enum { chunk_size = 1<<20 };
+
+        scan_guard(shared_memory &mem, size_t budget = 64<<20);
+        ~scan_guard();
+
+        void visit(const void *p)
+        {
+            if(p < current || p >= current + chunk_size) enter((const char*)p);
+        }
+
+    private:
+        scan_guard(const scan_guard&) = delete;
+        void enter(const char *p);
+        void release(const char *chunk);
+
+        shared_memory &mem;
+        const char *current;
+        std::vector<const char*> chunks;   // The chunks in memory, oldest first
+        bool keep_private;                  // Private pages cannot be dropped
+    };
+
+    // transaction
+    // Runs a transaction for the lifetime of the object.  It is aborted unless it is committed.
+    class transaction
+    {
+    public:
+        transaction(shared_memory &mem) : mem(mem), running(mem.begin()) { }
+        ~transaction() { if(running) mem.abort(); }
+
+        bool commit() { running = false; return mem.commit(); }
+        void abort() { running = false; mem.abort(); }
+
+    private:
+        transaction(const transaction&) = delete;
+        shared_memory &mem;
+        bool running;
+    };
+
+    // offset_ptr
+    // A pointer stored as its distance from itself, so that it is still valid when the heap
+    // it is in is mapped at another address.  Copying it points the copy at the same object.
+    // It converts to and from T*, so it can be used as a T* except when it is stored.
+    template<class T>
+    class offset_ptr
+    {
+    public:
+        typedef T element_type;
+        typedef typename std::remove_cv<T>::type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef T *pointer;
+        typedef typename std::add_lvalue_reference<T>::type reference;
+        typedef std::random_access_iterator_tag iterator_category;
+
+        offset_ptr() : offset(null) { }
+        offset_ptr(std::nullptr_t) : offset(null) { }
+        offset_ptr(T *p) { set(p); }
+        offset_ptr(const offset_ptr &p) { set(p.get()); }
+
+        template<class U, class = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+        offset_ptr(const offset_ptr<U> &p) { set(p.get()); }
+
+        // As static_cast, for example from offset_ptr<void>
+        template<class U, class = typename std::enable_if<!std::is_convertible<U*, T*>::value>::type, class = void>
+        explicit offset_ptr(const offset_ptr<U> &p) { set(static_cast<T*>(p.get())); }
+
+        offset_ptr &operator=(const offset_ptr &p) { set(p.get()); return *this; }
+        offset_ptr &operator=(T *p) { set(p); return *this; }
+
+        T *get() const { return offset == null ? nullptr : (T*)(std::uintptr_t(this) + offset); }
+        operator T*() const { return get(); }
+        T *operator->() const { return get(); }
+        reference operator*() const { return *get(); }
+
+        offset_ptr &operator+=(difference_type n) { set(get() + n); return *this; }
+        offset_ptr &operator-=(difference_type n) { set(get() - n); return *this; }
+        offset_ptr &operator++() { return *this += 1; }
+        offset_ptr &operator--() { return *this -= 1; }
+        offset_ptr operator++(int) { offset_ptr p(*this); ++*this; return p; }
+        offset_ptr operator--(int) { offset_ptr p(*this); --*this; return p; }
+        offset_ptr operator+(difference_type n) const { return offset_ptr(get() + n); }
+        offset_ptr operator-(difference_type n) const { return offset_ptr(get() - n); }
+        difference_type operator-(const offset_ptr &p) const { return get() - p.get(); }
+
+        template<class U = T>
+        static offset_ptr pointer_to(typename std::enable_if<!std::is_void<U>::value, U>::type &r) { return offset_ptr(std::addressof(r)); }
+
+    private:
+        // Objects are aligned, so nothing is one byte after the pointer
+        static const std::uintptr_t null = 1;
+        std::uintptr_t offset;
+
+        // The arithmetic is on integers, because the compiler may assume that
+        // pointers into different objects are never subtracted
+        void set(const T *p) { offset = p ? std::uintptr_t(p) - std::uintptr_t(this) : null; }
+    };
+
     template<class T>
     class fast_allocator : public std::allocator<T>
     {
     public:
-        fast_allocator(map_file & map) : map(map.data()) { }
-        fast_allocator(shared_memory & mem) : map(mem) { }
+        fast_allocator(map_file & map) : map(&map.data()) { }
+        fast_allocator(shared_memory & mem) : map(&mem) { }
 
         // Construct from another allocator
         template<class O>
         fast_allocator(const fast_allocator<O>&o) : map(o.map) { }
 
         typedef T value_type;
-        typedef const T *const_pointer;
-        typedef T *pointer;
+        typedef offset_ptr<const T> const_pointer;
+        typedef offset_ptr<T> pointer;
         typedef const T &const_reference;
         typedef T &reference;
         typedef typename std::allocator<T>::difference_type difference_type;
@@ -164,7 +535,7 @@ namespace persist
 
         pointer allocate(size_type n)
         {
-            pointer p = static_cast<pointer>(map.fast_malloc(n * sizeof(T)));
+            T *p = static_cast<T*>(map->fast_malloc(n * sizeof(T)));
             if(!p) throw std::bad_alloc();
 
             return p;
@@ -176,7 +547,7 @@ namespace persist
 
         size_type max_size() const
         {
-            return map.capacity()/sizeof(T);
+            return map->capacity()/sizeof(T);
         }
 
         template<class Other>
@@ -185,7 +556,7 @@ namespace persist
             typedef fast_allocator<Other> other;
         };
         
-        shared_memory & map;
+        offset_ptr<shared_memory> map;
     };
 
 
@@ -193,24 +564,26 @@ namespace persist
     class allocator : public std::allocator<T>
     {
     public:
-        allocator(map_file & map) : map(map.data()) { }
-        allocator(shared_memory & mem) : map(mem) { }
+        allocator(map_file & map, int arena_id=-1) : map(&map.data()), arena_id(arena_id) { }
+        allocator(shared_memory & mem, int arena_id=-1) : map(&mem), arena_id(arena_id) { }
 
         // Construct from another allocator
         template<class O>
-        allocator(const allocator<O>&o) : map(o.map) { }
+        allocator(const allocator<O>&o) : map(o.map), arena_id(o.arena_id) { }
 
         typedef T value_type;
-        typedef const T *const_pointer;
-        typedef T *pointer;
+        typedef offset_ptr<const T> const_pointer;
+        typedef offset_ptr<T> pointer;
         typedef const T &const_reference;
         typedef T &reference;
         typedef typename std::allocator<T>::difference_type difference_type;
         typedef typename std::allocator<T>::size_type size_type;
 
+        // Single objects, such as container nodes, have their cell worked out at compile time
         pointer allocate(size_type n)
         {
-            pointer p = static_cast<pointer>(map.malloc(n * sizeof(T)));
+            constexpr int cell = sizeof(T) <= max_cell_size ? object_cell(sizeof(T)) : -1;
+            T *p = static_cast<T*>(n==1 && cell>=0 ? map->malloc_cell(cell, arena_id) : map->malloc(n * sizeof(T), arena_id));
             if(!p) throw std::bad_alloc();
 
             return p;
@@ -218,12 +591,16 @@ namespace persist
 
         void deallocate(pointer p, size_type count)
         {
-            map.free(p, count * sizeof(T));
+            constexpr int cell = sizeof(T) <= max_cell_size ? object_cell(sizeof(T)) : -1;
+            if(count==1 && cell>=0)
+                map->free_cell(p, cell);
+            else
+                map->free(p, count * sizeof(T));
         }
 
         size_type max_size() const
         {
-            return map.capacity()/sizeof(T);
+            return map->capacity()/sizeof(T);
         }
 
 	    template<class Other>
@@ -232,7 +609,78 @@ namespace persist
             typedef allocator<Other> other;
 		};
     
-        shared_memory & map;
+        offset_ptr<shared_memory> map;
+        int arena_id;   // -1 for the current thread's arena
+    };
+
+    // heap_tag
+    // Names a heap at compile time, for use with static_allocator.
+    // Bind it to the heap before allocating, for example heap_tag<struct orders>::bind(file).
+    template<class Tag>
+    struct heap_tag
+    {
+        static void bind(shared_memory & mem) { memory = &mem; }
+        static void bind(map_file & map) { memory = &map.data(); }
+        static shared_memory &heap() { return *memory; }
+
+        static inline shared_memory *memory = nullptr;
+    };
+
+    // static_allocator
+    // An allocator for the heap named by Heap, which is a heap_tag or any class with a static heap().
+    // It is empty and all instances are equal, so containers do not store it.
+    template<class T, class Heap>
+    class static_allocator : public std::allocator<T>
+    {
+    public:
+        static_allocator() { }
+
+        template<class O>
+        static_allocator(const static_allocator<O, Heap>&) { }
+
+        typedef T value_type;
+        typedef offset_ptr<const T> const_pointer;
+        typedef offset_ptr<T> pointer;
+        typedef const T &const_reference;
+        typedef T &reference;
+        typedef typename std::allocator<T>::difference_type difference_type;
+        typedef typename std::allocator<T>::size_type size_type;
+        typedef std::true_type is_always_equal;
+
+        pointer allocate(size_type n)
+        {
+            constexpr int cell = sizeof(T) <= max_cell_size ? object_cell(sizeof(T)) : -1;
+            T *p = static_cast<T*>(n==1 && cell>=0 ? Heap::heap().malloc_cell(cell) : Heap::heap().malloc(n * sizeof(T)));
+            if(!p) throw std::bad_alloc();
+
+            return p;
+        }
+
+        void deallocate(pointer p, size_type count)
+        {
+            constexpr int cell = sizeof(T) <= max_cell_size ? object_cell(sizeof(T)) : -1;
+            if(count==1 && cell>=0)
+                Heap::heap().free_cell(p, cell);
+            else
+                Heap::heap().free(p, count * sizeof(T));
+        }
+
+        size_type max_size() const
+        {
+            return Heap::heap().capacity()/sizeof(T);
+        }
+
+        template<class Other>
+        struct rebind
+        {
+            typedef static_allocator<Other, Heap> other;
+        };
+
+        template<class O>
+        bool operator==(const static_allocator<O, Heap>&) const { return true; }
+
+        template<class O>
+        bool operator!=(const static_allocator<O, Heap>&) const { return false; }
     };
 
     template<class T>
@@ -0,0 +1,516 @@
+// Copyright (C) Calum Grant 2003-2021
+// Copying permitted under the terms of the GNU Public Licence (GPL)
+//
+// A persistent B+tree
+
+#ifndef PERSIST_BTREE_H
+#define PERSIST_BTREE_H
+#include "persist.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace persist
+{
+    // btree_map
+    // A map with the interface of std::map, stored in a B+tree of nodes of about NodeSize bytes.
+    // The values are in the leaves, which are linked in order, and the inner nodes hold only keys,
+    // so a lookup touches a few nodes instead of a node per level of a binary tree.
+    // Insertion and erasure move values within and between leaves, which invalidates iterators.
+    template<class K, class V, class C = std::less<K>, int NodeSize = 1024>
+    class btree_map
+    {
+    public:
+        typedef K key_type;
+        typedef V mapped_type;
+        typedef std::pair<const K, V> value_type;
+        typedef C key_compare;
+        typedef std::size_t size_type;
+
+        static constexpr int leaf_capacity = std::max<int>(4, (NodeSize - 24) / sizeof(value_type));
+        static constexpr int inner_capacity = std::max<int>(4, (NodeSize - 16) / (sizeof(K) + 8));
+
+    private:
+        struct node
+        {
+            std::uint16_t count;    // Values in a leaf, or keys in an inner node
+            bool leaf;
+        };
+
+        struct leaf_node : node
+        {
+            offset_ptr<leaf_node> prev, next;
+            alignas(value_type) unsigned char data[leaf_capacity * sizeof(value_type)];
+
+            value_type *slots() { return (value_type*)data; }
+        };
+
+        // Child i holds the keys from keys[i-1] up to, but not including, keys[i]
+        struct inner_node : node
+        {
+            offset_ptr<node> children[inner_capacity + 1];
+            alignas(K) unsigned char data[inner_capacity * sizeof(K)];
+
+            K *keys() { return (K*)data; }
+        };
+
+    public:
+        template<class T>
+        class basic_iterator
+        {
+        public:
+            typedef std::bidirectional_iterator_tag iterator_category;
+            typedef std::pair<const K, V> value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef T *pointer;
+            typedef T &reference;
+
+            basic_iterator() : tree(nullptr), leaf(nullptr), index(0) { }
+            basic_iterator(const btree_map *tree, leaf_node *leaf, int index) : tree(tree), leaf(leaf), index(index) { }
+            template<class U> basic_iterator(const basic_iterator<U> &i) : tree(i.tree), leaf(i.leaf), index(i.index) { }
+
+            reference operator*() const { return leaf->slots()[index]; }
+            pointer operator->() const { return leaf->slots() + index; }
+
+            basic_iterator &operator++()
+            {
+                if(++index == leaf->count) leaf = leaf->next, index = 0;
+                return *this;
+            }
+
+            basic_iterator &operator--()
+            {
+                if(!leaf) leaf = tree->last, index = leaf->count;
+                else if(index == 0) leaf = leaf->prev, index = leaf->count;
+                --index;
+                return *this;
+            }
+
+            basic_iterator operator++(int) { auto i = *this; ++*this; return i; }
+            basic_iterator operator--(int) { auto i = *this; --*this; return i; }
+
+            template<class U> bool operator==(const basic_iterator<U> &i) const { return leaf == i.leaf && index == i.index; }
+            template<class U> bool operator!=(const basic_iterator<U> &i) const { return !(*this == i); }
+
+        private:
+            friend class btree_map;
+            template<class U> friend class basic_iterator;
+            const btree_map *tree;
+            leaf_node *leaf;    // nullptr at the end
+            int index;
+        };
+
+        typedef basic_iterator<value_type> iterator;
+        typedef basic_iterator<const value_type> const_iterator;
+        typedef std::reverse_iterator<iterator> reverse_iterator;
+        typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+        btree_map(shared_memory &mem, const C &less = C()) : mem(&mem), root(nullptr), first(nullptr), last(nullptr), items(0), less(less) { }
+        ~btree_map() { clear(); }
+        btree_map(const btree_map&) = delete;
+        btree_map &operator=(const btree_map&) = delete;
+
+        iterator begin() { return iterator(this, first, 0); }
+        iterator end() { return iterator(this, nullptr, 0); }
+        const_iterator begin() const { return const_iterator(this, first, 0); }
+        const_iterator end() const { return const_iterator(this, nullptr, 0); }
+        reverse_iterator rbegin() { return reverse_iterator(end()); }
+        reverse_iterator rend() { return reverse_iterator(begin()); }
+        const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+        const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+        size_type size() const { return items; }
+        bool empty() const { return items == 0; }
+        key_compare key_comp() const { return less; }
+
+        iterator find(const K &key)
+        {
+            leaf_node *leaf = find_leaf(key);
+            int i = leaf ? lower_index(leaf, key) : 0;
+            return leaf && i < leaf->count && !less(key, leaf->slots()[i].first) ? iterator(this, leaf, i) : end();
+        }
+
+        const_iterator find(const K &key) const { return const_cast<btree_map*>(this)->find(key); }
+        size_type count(const K &key) const { return find(key) != end(); }
+
+        iterator lower_bound(const K &key)
+        {
+            leaf_node *leaf = find_leaf(key);
+            return leaf ? position(leaf, lower_index(leaf, key)) : end();
+        }
+
+        iterator upper_bound(const K &key)
+        {
+            leaf_node *leaf = find_leaf(key);
+            return leaf ? position(leaf, upper_index(leaf, key)) : end();
+        }
+
+        const_iterator lower_bound(const K &key) const { return const_cast<btree_map*>(this)->lower_bound(key); }
+        const_iterator upper_bound(const K &key) const { return const_cast<btree_map*>(this)->upper_bound(key); }
+
+        std::pair<iterator, iterator> equal_range(const K &key) { return { lower_bound(key), upper_bound(key) }; }
+
+        V &operator[](const K &key) { return try_emplace(key).first->second; }
+
+        std::pair<iterator, bool> insert(const value_type &value) { return try_emplace(value.first, value.second); }
+
+        // When the leaf is full, it is reached again splitting full nodes on the way down,
+        // so there is always room for a separator in the parent.  A full leaf gives values
+        // to a neighbour that has room instead of splitting, which keeps the leaves fuller.
+        template<class... Args>
+        std::pair<iterator, bool> try_emplace(const K &key, Args&&... args)
+        {
+            if(!root)
+            {
+                leaf_node *leaf = new_leaf();
+                root = leaf;
+                first = last = leaf;
+            }
+
+            leaf_node *leaf = find_leaf(key);
+            int i = lower_index(leaf, key);
+            if(i < leaf->count && !less(key, leaf->slots()[i].first))
+                return { iterator(this, leaf, i), false };
+            if(!full(leaf))
+                return { emplace_at(leaf, i, key, std::forward<Args>(args)...), true };
+
+            if(full(root))
+            {
+                inner_node *new_root = new_inner();
+                new_root->children[0] = root.get();
+                root = new_root;
+                split_child(new_root, 0, key);
+            }
+
+            node *n = root;
+            while(!n->leaf)
+            {
+                auto inner = (inner_node*)n;
+                int i = child_index(inner, key);
+                if(full(inner->children[i]))
+                {
+                    if(!inner->children[i]->leaf || !share_leaf(inner, i))
+                        split_child(inner, i, key);
+                    i = child_index(inner, key);
+                }
+                n = inner->children[i];
+            }
+
+            leaf = (leaf_node*)n;
+            return { emplace_at(leaf, lower_index(leaf, key), key, std::forward<Args>(args)...), true };
+        }
+
+        size_type erase(const K &key)
+        {
+            path p;
+            leaf_node *leaf = find_leaf(key, &p);
+            int i = leaf ? lower_index(leaf, key) : 0;
+            if(!leaf || i == leaf->count || less(key, leaf->slots()[i].first)) return 0;
+            erase_at(p, leaf, i);
+            return 1;
+        }
+
+        iterator erase(const_iterator pos)
+        {
+            path p;
+            find_leaf(pos->first, &p);
+            return erase_at(p, pos.leaf, pos.index);
+        }
+
+        void clear()
+        {
+            if(root) destroy(root);
+            root = nullptr;
+            first = last = nullptr;
+            items = 0;
+        }
+
+    private:
+        offset_ptr<shared_memory> mem;
+        offset_ptr<node> root;
+        offset_ptr<leaf_node> first, last;
+        size_type items;
+        C less;
+
+        // The inner nodes visited on the way to a leaf, and the child taken from each
+        struct path
+        {
+            int depth = 0;
+            std::pair<inner_node*, int> steps[32];
+        };
+
+        bool full(const node *n) const { return n->count == (n->leaf ? leaf_capacity : inner_capacity); }
+
+        static void move(value_type &from, value_type *to)
+        {
+            new(to) value_type(std::move(from));
+            from.~value_type();
+        }
+
+        static void move(K &from, K *to)
+        {
+            new(to) K(std::move(from));
+            from.~K();
+        }
+
+        leaf_node *new_leaf()
+        {
+            leaf_node *leaf = allocator<leaf_node>(*mem).allocate(1);
+            leaf->count = 0;
+            leaf->leaf = true;
+            new(&leaf->prev) offset_ptr<leaf_node>(nullptr);
+            new(&leaf->next) offset_ptr<leaf_node>(nullptr);
+            return leaf;
+        }
+
+        inner_node *new_inner()
+        {
+            inner_node *inner = allocator<inner_node>(*mem).allocate(1);
+            inner->count = 0;
+            inner->leaf = false;
+            for(auto &child : inner->children) new(&child) offset_ptr<node>(nullptr);
+            return inner;
+        }
+
+        void destroy(node *n)
+        {
+            if(n->leaf)
+            {
+                auto leaf = (leaf_node*)n;
+                for(int i=0; i<leaf->count; ++i) leaf->slots()[i].~value_type();
+                allocator<leaf_node>(*mem).deallocate(leaf, 1);
+            }
+            else
+            {
+                auto inner = (inner_node*)n;
+                for(int i=0; i<=inner->count; ++i) destroy(inner->children[i]);
+                for(int i=0; i<inner->count; ++i) inner->keys()[i].~K();
+                allocator<inner_node>(*mem).deallocate(inner, 1);
+            }
+        }
+
+        // The child of @inner that holds @key, which is the number of keys not greater than it.
+        // Arithmetic keys are counted without branches, which the compiler vectorizes.
+        int child_index(inner_node *inner, const K &key) const
+        {
+            const K *keys = inner->keys();
+            if constexpr(std::is_arithmetic<K>::value && std::is_same<C, std::less<K>>::value)
+            {
+                int n = 0;
+                for(int i=0; i<inner->count; ++i) n += keys[i] <= key;
+                return n;
+            }
+            else
+                return std::upper_bound(keys, keys + inner->count, key, less) - keys;
+        }
+
+        int lower_index(leaf_node *leaf, const K &key) const
+        {
+            value_type *slots = leaf->slots();
+            return std::partition_point(slots, slots + leaf->count, [&](const value_type &v) { return less(v.first, key); }) - slots;
+        }
+
+        int upper_index(leaf_node *leaf, const K &key) const
+        {
+            value_type *slots = leaf->slots();
+            return std::partition_point(slots, slots + leaf->count, [&](const value_type &v) { return !less(key, v.first); }) - slots;
+        }
+
+        // Fetches all of a node's cache lines at once, so that searching it waits for memory
+        // about once, instead of once for each step of the search
+        static void prefetch(const node *n)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            for(std::size_t i = 0; i < std::max(sizeof(leaf_node), sizeof(inner_node)); i += 64)
+                __builtin_prefetch((const char*)n + i);
+#endif
+        }
+
+        // The leaf that would hold @key
+        leaf_node *find_leaf(const K &key, path *p = nullptr) const
+        {
+            node *n = root;
+            if(!n) return nullptr;
+            prefetch(n);
+            while(!n->leaf)
+            {
+                auto inner = (inner_node*)n;
+                int i = child_index(inner, key);
+                if(p) p->steps[p->depth++] = { inner, i };
+                n = inner->children[i];
+                prefetch(n);
+            }
+            return (leaf_node*)n;
+        }
+
+        // An iterator to slot @i of @leaf, or to the start of the next leaf if @i is past the end
+        iterator position(leaf_node *leaf, int i)
+        {
+            return i < leaf->count ? iterator(this, leaf, i) : iterator(this, leaf->next, 0);
+        }
+
+        // Splits the full child @i of @parent in two, and adds the key between them to @parent.
+        // A leaf is split in half, unless @key, which is about to be inserted, goes after all
+        // of its values.  Then the values stay, and @key starts the new leaf, so that keys
+        // inserted in order fill their leaves.
+        void split_child(inner_node *parent, int i, const K &key)
+        {
+            node *child = parent->children[i], *right;
+            int keep = child->count / 2;
+            if(child->leaf && less(((leaf_node*)child)->slots()[child->count - 1].first, key))
+                keep = child->count;
+            K *parent_keys = parent->keys();
+
+            for(int j = parent->count; j > i; --j)
+            {
+                move(parent_keys[j-1], parent_keys + j);
+                parent->children[j+1] = parent->children[j];
+            }
+
+            if(child->leaf)
+            {
+                auto left = (leaf_node*)child, new_leaf = this->new_leaf();
+                for(int j = keep; j < left->count; ++j)
+                    move(left->slots()[j], new_leaf->slots() + j - keep);
+                new_leaf->count = left->count - keep;
+                left->count = keep;
+
+                new_leaf->prev = left;
+                new_leaf->next = left->next;
+                (left->next ? left->next->prev : last) = new_leaf;
+                left->next = new_leaf;
+
+                new(parent_keys + i) K(new_leaf->count ? new_leaf->slots()[0].first : key);
+                right = new_leaf;
+            }
+            else
+            {
+                // The middle key moves up to the parent
+                auto left = (inner_node*)child, new_inner = this->new_inner();
+                for(int j = keep + 1; j < left->count; ++j)
+                    move(left->keys()[j], new_inner->keys() + j - keep - 1);
+                for(int j = keep + 1; j <= left->count; ++j)
+                    new_inner->children[j - keep - 1] = left->children[j];
+                new_inner->count = left->count - keep - 1;
+                left->count = keep;
+
+                move(left->keys()[keep], parent_keys + i);
+                right = new_inner;
+            }
+
+            parent->children[i+1] = right;
+            ++parent->count;
+        }
+
+        // Moves values from the full leaf @i of @parent into the leaf on either side of it, if
+        // one has room for at least two, so that both then have room for the value being
+        // inserted, and updates the key between them.  Returns false if neither has room.
+        bool share_leaf(inner_node *parent, int i)
+        {
+            auto leaf = (leaf_node*)parent->children[i].get();
+            value_type *slots = leaf->slots();
+
+            if(i < parent->count && parent->children[i+1]->count < leaf_capacity - 1)
+            {
+                auto right = (leaf_node*)parent->children[i+1].get();
+                int moved = (leaf_capacity - right->count) / 2;
+                for(int j = right->count; j-- > 0; )
+                    move(right->slots()[j], right->slots() + j + moved);
+                for(int j = 0; j < moved; ++j)
+                    move(slots[leaf->count - moved + j], right->slots() + j);
+                leaf->count -= moved;
+                right->count += moved;
+                parent->keys()[i] = right->slots()[0].first;
+                return true;
+            }
+
+            if(i > 0 && parent->children[i-1]->count < leaf_capacity - 1)
+            {
+                auto left = (leaf_node*)parent->children[i-1].get();
+                int moved = (leaf_capacity - left->count) / 2;
+                for(int j = 0; j < moved; ++j)
+                    move(slots[j], left->slots() + left->count + j);
+                for(int j = moved; j < leaf->count; ++j)
+                    move(slots[j], slots + j - moved);
+                leaf->count -= moved;
+                left->count += moved;
+                parent->keys()[i-1] = slots[0].first;
+                return true;
+            }
+
+            return false;
+        }
+
+        template<class... Args>
+        iterator emplace_at(leaf_node *leaf, int i, const K &key, Args&&... args)
+        {
+            value_type *slots = leaf->slots();
+            for(int j = leaf->count; j > i; --j)
+                move(slots[j-1], slots + j);
+            new(slots + i) value_type(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+            ++leaf->count;
+            ++items;
+            return iterator(this, leaf, i);
+        }
+
+        // Leaves are not merged when they shrink, but are removed when they become empty.
+        // An inner node with no keys has one child, and is removed with it.
+        iterator erase_at(path &p, leaf_node *leaf, int i)
+        {
+            value_type *slots = leaf->slots();
+            slots[i].~value_type();
+            for(int j = i + 1; j < leaf->count; ++j)
+                move(slots[j], slots + j - 1);
+            --leaf->count;
+            --items;
+            if(leaf->count) return position(leaf, i);
+
+            leaf_node *next = leaf->next;
+            (leaf->prev ? leaf->prev->next : first) = leaf->next;
+            (leaf->next ? leaf->next->prev : last) = leaf->prev;
+            allocator<leaf_node>(*mem).deallocate(leaf, 1);
+
+            node *removed = leaf;
+            while(p.depth > 0)
+            {
+                auto step = p.steps[--p.depth];
+                inner_node *parent = step.first;
+                if(parent->count == 0)
+                {
+                    allocator<inner_node>(*mem).deallocate(parent, 1);
+                    removed = parent;
+                    continue;
+                }
+
+                // Remove the child, and the key on one side of it
+                K *keys = parent->keys();
+                int k = step.second > 0 ? step.second - 1 : 0;
+                keys[k].~K();
+                for(int j = k + 1; j < parent->count; ++j)
+                    move(keys[j], keys + j - 1);
+                for(int j = step.second + 1; j <= parent->count; ++j)
+                    parent->children[j-1] = parent->children[j];
+                --parent->count;
+                removed = nullptr;
+                break;
+            }
+
+            if(removed) root = nullptr;
+
+            while(root && !root->leaf && root->count == 0)
+            {
+                auto old_root = (inner_node*)root.get();
+                root = old_root->children[0].get();
+                allocator<inner_node>(*mem).deallocate(old_root, 1);
+            }
+
+            return iterator(this, next, 0);
+        }
+    };
+}
+
+#endif
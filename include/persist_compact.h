@@ -0,0 +1,724 @@
+// Copyright (C) Calum Grant 2003-2021
+// Copying permitted under the terms of the GNU Public Licence (GPL)
+//
+// Containers whose nodes are linked by 32-bit offsets from the start of the heap.
+// They hold the same data as the containers in persist_stl.h in less memory: a
+// compact_map<int,int> node is 24 bytes, where a persist::map<int,int> node is 40.
+
+#ifndef PERSIST_COMPACT_H
+#define PERSIST_COMPACT_H
+#include "persist.h"
+
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+
+namespace persist
+{
+    // compact_ptr
+    // A pointer stored in 32 bits, as its offset from the start of the heap in units of 8 bytes,
+    // so it can point to any block in the first 32GB of the heap, and throws std::length_error for
+    // one beyond that.  It is converted using the heap, which the containers below hold once instead
+    // of in every node.
+    template<class T>
+    class compact_ptr
+    {
+    public:
+        compact_ptr() : value(0) { }
+
+        compact_ptr(const shared_memory &mem, const T *p) : value(0)
+        {
+            if(!p) return;
+            std::size_t offset = std::size_t((const char*)p - (const char*)&mem) >> 3;
+            if(offset >> 32) throw std::length_error("compact_ptr: block beyond the first 32GB of the heap");
+            value = std::uint32_t(offset);
+            assert(get(mem) == p);
+        }
+
+        T *get(const shared_memory &mem) const
+        {
+            return value ? (T*)((const char*)&mem + (std::size_t(value) << 3)) : nullptr;
+        }
+
+        explicit operator bool() const { return value != 0; }
+        bool operator==(const compact_ptr &p) const { return value == p.value; }
+        bool operator!=(const compact_ptr &p) const { return value != p.value; }
+
+        // A well-mixed hash of the pointer
+        std::uint32_t hash() const
+        {
+            std::uint32_t h = value;
+            h ^= h >> 16; h *= 0x85ebca6b;
+            h ^= h >> 13; h *= 0xc2b2ae35;
+            return h ^ h >> 16;
+        }
+
+    private:
+        std::uint32_t value;
+    };
+
+    // compact_nodes
+    // The heap of a compact container, which allocates its nodes and follows their links.
+    template<class Node>
+    class compact_nodes
+    {
+    public:
+        compact_nodes(shared_memory &mem) : mem(&mem) { }
+
+        Node *at(compact_ptr<Node> p) const { return p.get(*mem); }
+        compact_ptr<Node> link(const Node *n) const { return compact_ptr<Node>(*mem, n); }
+
+        template<class... Args>
+        Node *create(Args&&... args)
+        {
+            Node *n = allocator<Node>(*mem).allocate(1);
+            try
+            {
+                return new(n) Node(std::forward<Args>(args)...);
+            }
+            catch(...)
+            {
+                allocator<Node>(*mem).deallocate(n, 1);
+                throw;
+            }
+        }
+
+        void destroy(Node *n)
+        {
+            n->~Node();
+            allocator<Node>(*mem).deallocate(n, 1);
+        }
+
+        shared_memory &heap() const { return *mem; }
+
+    private:
+        offset_ptr<shared_memory> mem;
+    };
+
+    struct key_of_value
+    {
+        template<class V> const V &operator()(const V &v) const { return v; }
+    };
+
+    struct key_of_pair
+    {
+        template<class P> const typename P::first_type &operator()(const P &p) const { return p.first; }
+    };
+
+    // compact_list
+    // A doubly-linked list.
+    template<class T>
+    class compact_list
+    {
+        struct node
+        {
+            compact_ptr<node> next, prev;
+            T value;
+
+            template<class... Args> node(Args&&... args) : value(std::forward<Args>(args)...) { }
+        };
+
+    public:
+        template<class V>
+        class basic_iterator
+        {
+        public:
+            typedef std::bidirectional_iterator_tag iterator_category;
+            typedef T value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef V *pointer;
+            typedef V &reference;
+
+            basic_iterator() : list(nullptr), n(nullptr) { }
+            basic_iterator(const compact_list *list, node *n) : list(list), n(n) { }
+            template<class W> basic_iterator(const basic_iterator<W> &i) : list(i.list), n(i.n) { }
+
+            reference operator*() const { return n->value; }
+            pointer operator->() const { return &n->value; }
+
+            basic_iterator &operator++() { n = list->nodes.at(n->next); return *this; }
+            basic_iterator &operator--() { n = list->nodes.at(n ? n->prev : list->tail); return *this; }
+            basic_iterator operator++(int) { auto i = *this; ++*this; return i; }
+            basic_iterator operator--(int) { auto i = *this; --*this; return i; }
+
+            template<class W> bool operator==(const basic_iterator<W> &i) const { return n == i.n; }
+            template<class W> bool operator!=(const basic_iterator<W> &i) const { return n != i.n; }
+
+        private:
+            friend class compact_list;
+            template<class W> friend class basic_iterator;
+            const compact_list *list;
+            node *n;    // nullptr at the end
+        };
+
+        typedef T value_type;
+        typedef std::size_t size_type;
+        typedef basic_iterator<T> iterator;
+        typedef basic_iterator<const T> const_iterator;
+
+        compact_list(shared_memory &mem) : nodes(mem), count(0) { }
+        ~compact_list() { clear(); }
+        compact_list(const compact_list&) = delete;
+        compact_list &operator=(const compact_list&) = delete;
+
+        iterator begin() { return iterator(this, nodes.at(head)); }
+        iterator end() { return iterator(this, nullptr); }
+        const_iterator begin() const { return const_iterator(this, nodes.at(head)); }
+        const_iterator end() const { return const_iterator(this, nullptr); }
+
+        size_type size() const { return count; }
+        bool empty() const { return count == 0; }
+
+        T &front() { return nodes.at(head)->value; }
+        T &back() { return nodes.at(tail)->value; }
+        const T &front() const { return nodes.at(head)->value; }
+        const T &back() const { return nodes.at(tail)->value; }
+
+        void push_front(const T &value) { emplace(begin(), value); }
+        void push_back(const T &value) { emplace(end(), value); }
+        void pop_front() { erase(begin()); }
+        void pop_back() { erase(--end()); }
+
+        iterator insert(const_iterator pos, const T &value) { return emplace(pos, value); }
+
+        template<class... Args>
+        iterator emplace(const_iterator pos, Args&&... args)
+        {
+            node *n = nodes.create(std::forward<Args>(args)...);
+            node *next = pos.n, *prev = nodes.at(next ? next->prev : tail);
+            n->next = nodes.link(next);
+            n->prev = nodes.link(prev);
+            (next ? next->prev : tail) = nodes.link(n);
+            (prev ? prev->next : head) = nodes.link(n);
+            ++count;
+            return iterator(this, n);
+        }
+
+        iterator erase(const_iterator pos)
+        {
+            node *n = pos.n, *next = nodes.at(n->next), *prev = nodes.at(n->prev);
+            (next ? next->prev : tail) = n->prev;
+            (prev ? prev->next : head) = n->next;
+            nodes.destroy(n);
+            --count;
+            return iterator(this, next);
+        }
+
+        void clear()
+        {
+            while(head) pop_front();
+        }
+
+    private:
+        compact_nodes<node> nodes;
+        compact_ptr<node> head, tail;
+        size_type count;
+    };
+
+    // compact_tree
+    // The ordered containers are treaps: binary search trees whose nodes are also in heap
+    // order of a priority, which keeps them balanced on average.  The priority is a hash of
+    // the node's address, so it is not stored, and rotations keep both orders.
+    template<class Key, class Value, class KeyOf, class Compare>
+    class compact_tree
+    {
+    protected:
+        struct node
+        {
+            compact_ptr<node> left, right, parent;
+            Value value;
+
+            template<class... Args> node(Args&&... args) : value(std::forward<Args>(args)...) { }
+        };
+
+    public:
+        template<class V>
+        class basic_iterator
+        {
+        public:
+            typedef std::bidirectional_iterator_tag iterator_category;
+            typedef Value value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef V *pointer;
+            typedef V &reference;
+
+            basic_iterator() : tree(nullptr), n(nullptr) { }
+            basic_iterator(const compact_tree *tree, node *n) : tree(tree), n(n) { }
+            template<class W> basic_iterator(const basic_iterator<W> &i) : tree(i.tree), n(i.n) { }
+
+            reference operator*() const { return n->value; }
+            pointer operator->() const { return &n->value; }
+
+            basic_iterator &operator++() { n = tree->next(n); return *this; }
+            basic_iterator &operator--() { n = tree->prev(n); return *this; }
+            basic_iterator operator++(int) { auto i = *this; ++*this; return i; }
+            basic_iterator operator--(int) { auto i = *this; --*this; return i; }
+
+            template<class W> bool operator==(const basic_iterator<W> &i) const { return n == i.n; }
+            template<class W> bool operator!=(const basic_iterator<W> &i) const { return n != i.n; }
+
+        private:
+            friend class compact_tree;
+            template<class W> friend class basic_iterator;
+            const compact_tree *tree;
+            node *n;    // nullptr at the end
+        };
+
+        typedef Key key_type;
+        typedef Value value_type;
+        typedef std::size_t size_type;
+        typedef basic_iterator<Value> iterator;
+        typedef basic_iterator<const Value> const_iterator;
+
+        compact_tree(shared_memory &mem, const Compare &less = Compare()) : nodes(mem), items(0), less(less) { }
+        ~compact_tree() { clear(); }
+        compact_tree(const compact_tree&) = delete;
+        compact_tree &operator=(const compact_tree&) = delete;
+
+        iterator begin() { return iterator(this, leftmost(nodes.at(root))); }
+        iterator end() { return iterator(this, nullptr); }
+        const_iterator begin() const { return const_iterator(this, leftmost(nodes.at(root))); }
+        const_iterator end() const { return const_iterator(this, nullptr); }
+
+        size_type size() const { return items; }
+        bool empty() const { return items == 0; }
+
+        iterator find(const Key &key) { return iterator(this, find_node(key)); }
+        const_iterator find(const Key &key) const { return const_iterator(this, find_node(key)); }
+        size_type count(const Key &key) const { return find_node(key) ? 1 : 0; }
+
+        iterator lower_bound(const Key &key) { return iterator(this, bound(key, false)); }
+        iterator upper_bound(const Key &key) { return iterator(this, bound(key, true)); }
+        const_iterator lower_bound(const Key &key) const { return const_iterator(this, bound(key, false)); }
+        const_iterator upper_bound(const Key &key) const { return const_iterator(this, bound(key, true)); }
+
+        iterator erase(const_iterator pos)
+        {
+            node *n = pos.n, *following = next(n);
+            erase_node(n);
+            return iterator(this, following);
+        }
+
+        size_type erase(const Key &key)
+        {
+            node *n = find_node(key);
+            if(n) erase_node(n);
+            return n ? 1 : 0;
+        }
+
+        // Destroys the nodes from the bottom up, without rotating
+        void clear()
+        {
+            for(node *n = nodes.at(root); n; )
+            {
+                if(n->left) n = nodes.at(std::exchange(n->left, compact_ptr<node>()));
+                else if(n->right) n = nodes.at(std::exchange(n->right, compact_ptr<node>()));
+                else
+                {
+                    node *parent = nodes.at(n->parent);
+                    nodes.destroy(n);
+                    n = parent;
+                }
+            }
+            root = compact_ptr<node>();
+            items = 0;
+        }
+
+    protected:
+        // Inserts a node made from @args unless there is already one for @key
+        template<class... Args>
+        std::pair<iterator, bool> emplace_key(const Key &key, Args&&... args)
+        {
+            node *parent = nullptr;
+            compact_ptr<node> *link = &root;
+            while(*link)
+            {
+                parent = nodes.at(*link);
+                if(less(key, KeyOf()(parent->value))) link = &parent->left;
+                else if(less(KeyOf()(parent->value), key)) link = &parent->right;
+                else return { iterator(this, parent), false };
+            }
+
+            node *n = nodes.create(std::forward<Args>(args)...);
+            n->parent = nodes.link(parent);
+            *link = nodes.link(n);
+
+            while(n->parent && priority(n) > priority(nodes.at(n->parent)))
+            {
+                node *p = nodes.at(n->parent);
+                if(p->left == nodes.link(n)) rotate_right(p);
+                else rotate_left(p);
+            }
+
+            ++items;
+            return { iterator(this, n), true };
+        }
+
+    private:
+        compact_nodes<node> nodes;
+        compact_ptr<node> root;
+        size_type items;
+        Compare less;
+
+        std::uint32_t priority(const node *n) const { return nodes.link(n).hash(); }
+
+        node *leftmost(node *n) const
+        {
+            while(n && n->left) n = nodes.at(n->left);
+            return n;
+        }
+
+        node *rightmost(node *n) const
+        {
+            while(n && n->right) n = nodes.at(n->right);
+            return n;
+        }
+
+        node *next(node *n) const
+        {
+            if(n->right) return leftmost(nodes.at(n->right));
+            node *p = nodes.at(n->parent);
+            while(p && p->right == nodes.link(n))
+                n = p, p = nodes.at(p->parent);
+            return p;
+        }
+
+        node *prev(node *n) const
+        {
+            if(!n) return rightmost(nodes.at(root));
+            if(n->left) return rightmost(nodes.at(n->left));
+            node *p = nodes.at(n->parent);
+            while(p && p->left == nodes.link(n))
+                n = p, p = nodes.at(p->parent);
+            return p;
+        }
+
+        node *find_node(const Key &key) const
+        {
+            node *n = bound(key, false);
+            return n && !less(key, KeyOf()(n->value)) ? n : nullptr;
+        }
+
+        // The first node whose key is not less than @key, or greater than it if @upper
+        node *bound(const Key &key, bool upper) const
+        {
+            node *result = nullptr;
+            for(node *n = nodes.at(root); n; )
+            {
+                if(upper ? less(key, KeyOf()(n->value)) : !less(KeyOf()(n->value), key))
+                    result = n, n = nodes.at(n->left);
+                else
+                    n = nodes.at(n->right);
+            }
+            return result;
+        }
+
+        // The link that points to @n
+        compact_ptr<node> &slot(node *n)
+        {
+            node *p = nodes.at(n->parent);
+            return !p ? root : p->left == nodes.link(n) ? p->left : p->right;
+        }
+
+        // Moves the right child of @x into its place
+        void rotate_left(node *x)
+        {
+            node *y = nodes.at(x->right);
+            slot(x) = nodes.link(y);
+            y->parent = x->parent;
+            x->right = y->left;
+            if(y->left) nodes.at(y->left)->parent = nodes.link(x);
+            y->left = nodes.link(x);
+            x->parent = nodes.link(y);
+        }
+
+        // Moves the left child of @x into its place
+        void rotate_right(node *x)
+        {
+            node *y = nodes.at(x->left);
+            slot(x) = nodes.link(y);
+            y->parent = x->parent;
+            x->left = y->right;
+            if(y->right) nodes.at(y->right)->parent = nodes.link(x);
+            y->right = nodes.link(x);
+            x->parent = nodes.link(y);
+        }
+
+        // Rotates @n down until it is a leaf, and removes it
+        void erase_node(node *n)
+        {
+            while(n->left || n->right)
+            {
+                node *l = nodes.at(n->left), *r = nodes.at(n->right);
+                if(!r || (l && priority(l) > priority(r))) rotate_right(n);
+                else rotate_left(n);
+            }
+            slot(n) = compact_ptr<node>();
+            nodes.destroy(n);
+            --items;
+        }
+    };
+
+    template<class K, class C = std::less<K> >
+    class compact_set : public compact_tree<K, const K, key_of_value, C>
+    {
+        typedef compact_tree<K, const K, key_of_value, C> base;
+    public:
+        compact_set(shared_memory &mem) : base(mem) { }
+
+        std::pair<typename base::iterator, bool> insert(const K &key) { return this->emplace_key(key, key); }
+    };
+
+    template<class K, class V, class C = std::less<K> >
+    class compact_map : public compact_tree<K, std::pair<const K, V>, key_of_pair, C>
+    {
+        typedef compact_tree<K, std::pair<const K, V>, key_of_pair, C> base;
+    public:
+        typedef V mapped_type;
+
+        compact_map(shared_memory &mem) : base(mem) { }
+
+        std::pair<typename base::iterator, bool> insert(const typename base::value_type &value)
+        {
+            return this->emplace_key(value.first, value);
+        }
+
+        V &operator[](const K &key)
+        {
+            return this->emplace_key(key, std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple()).first->second;
+        }
+    };
+
+    // compact_hash
+    // The hash containers chain their nodes from an array of buckets, which doubles
+    // when there are more nodes than buckets.
+    template<class Key, class Value, class KeyOf, class Hash, class Equal>
+    class compact_hash
+    {
+    protected:
+        struct node
+        {
+            compact_ptr<node> next;
+            Value value;
+
+            template<class... Args> node(Args&&... args) : value(std::forward<Args>(args)...) { }
+        };
+
+    public:
+        template<class V>
+        class basic_iterator
+        {
+        public:
+            typedef std::forward_iterator_tag iterator_category;
+            typedef Value value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef V *pointer;
+            typedef V &reference;
+
+            basic_iterator() : hash(nullptr), n(nullptr), bucket(0) { }
+            basic_iterator(const compact_hash *hash, node *n, std::size_t bucket) : hash(hash), n(n), bucket(bucket) { }
+            template<class W> basic_iterator(const basic_iterator<W> &i) : hash(i.hash), n(i.n), bucket(i.bucket) { }
+
+            reference operator*() const { return n->value; }
+            pointer operator->() const { return &n->value; }
+
+            basic_iterator &operator++()
+            {
+                n = hash->nodes.at(n->next);
+                if(!n) *this = hash->first_from(bucket + 1);
+                return *this;
+            }
+            basic_iterator operator++(int) { auto i = *this; ++*this; return i; }
+
+            template<class W> bool operator==(const basic_iterator<W> &i) const { return n == i.n; }
+            template<class W> bool operator!=(const basic_iterator<W> &i) const { return n != i.n; }
+
+        private:
+            friend class compact_hash;
+            template<class W> friend class basic_iterator;
+            const compact_hash *hash;
+            node *n;    // nullptr at the end
+            std::size_t bucket;
+        };
+
+        typedef Key key_type;
+        typedef Value value_type;
+        typedef std::size_t size_type;
+        typedef basic_iterator<Value> iterator;
+        typedef basic_iterator<const Value> const_iterator;
+
+        compact_hash(shared_memory &mem) : nodes(mem), bucket_count(0), items(0) { }
+        ~compact_hash() { clear(); }
+        compact_hash(const compact_hash&) = delete;
+        compact_hash &operator=(const compact_hash&) = delete;
+
+        iterator begin() { return first_from(0); }
+        iterator end() { return iterator(this, nullptr, 0); }
+        const_iterator begin() const { return first_from(0); }
+        const_iterator end() const { return const_iterator(this, nullptr, 0); }
+
+        size_type size() const { return items; }
+        bool empty() const { return items == 0; }
+
+        iterator find(const Key &key)
+        {
+            compact_ptr<node> *link = find_link(key);
+            return link && *link ? iterator(this, nodes.at(*link), index(key)) : end();
+        }
+
+        const_iterator find(const Key &key) const { return const_cast<compact_hash*>(this)->find(key); }
+        size_type count(const Key &key) const { return find(key) != end() ? 1 : 0; }
+
+        size_type erase(const Key &key)
+        {
+            compact_ptr<node> *link = find_link(key);
+            if(!link || !*link) return 0;
+
+            node *n = nodes.at(*link);
+            *link = n->next;
+            nodes.destroy(n);
+            --items;
+            return 1;
+        }
+
+        iterator erase(const_iterator pos)
+        {
+            iterator following(this, pos.n, pos.bucket);
+            ++following;
+            erase(KeyOf()(pos.n->value));
+            return following;
+        }
+
+        void clear()
+        {
+            for(std::size_t b = 0; b < bucket_count; ++b)
+            {
+                for(node *n = nodes.at(buckets()[b]); n; )
+                {
+                    node *next = nodes.at(n->next);
+                    nodes.destroy(n);
+                    n = next;
+                }
+            }
+
+            if(bucket_count) nodes.heap().free(buckets(), bucket_count * sizeof(compact_ptr<node>));
+            table = offset_ptr<compact_ptr<node>>();
+            bucket_count = 0;
+            items = 0;
+        }
+
+    protected:
+        // Inserts a node made from @args unless there is already one for @key
+        template<class... Args>
+        std::pair<iterator, bool> emplace_key(const Key &key, Args&&... args)
+        {
+            compact_ptr<node> *link = find_link(key);
+            if(link && *link) return { iterator(this, nodes.at(*link), index(key)), false };
+
+            if(items >= bucket_count) rehash(bucket_count ? 2 * bucket_count : 16);
+
+            node *n = nodes.create(std::forward<Args>(args)...);
+            std::size_t b = index(key);
+            n->next = buckets()[b];
+            buckets()[b] = nodes.link(n);
+            ++items;
+            return { iterator(this, n, b), true };
+        }
+
+    private:
+        compact_nodes<node> nodes;
+        offset_ptr<compact_ptr<node>> table;
+        std::size_t bucket_count;    // A power of 2
+        size_type items;
+
+        compact_ptr<node> *buckets() const { return table.get(); }
+
+        // Mixes the hash, so that keys which differ only in their high bits are spread out
+        std::size_t index(const Key &key) const
+        {
+            std::uint64_t h = Hash()(key);
+            h ^= h >> 33; h *= 0xff51afd7ed558ccdull;
+            h ^= h >> 33;
+            return h & (bucket_count - 1);
+        }
+
+        // The link that points to the node for @key, or that would do
+        compact_ptr<node> *find_link(const Key &key) const
+        {
+            if(!bucket_count) return nullptr;
+
+            compact_ptr<node> *link = &buckets()[index(key)];
+            while(*link && !Equal()(KeyOf()(nodes.at(*link)->value), key))
+                link = &nodes.at(*link)->next;
+            return link;
+        }
+
+        iterator first_from(std::size_t bucket) const
+        {
+            for(; bucket < bucket_count; ++bucket)
+                if(buckets()[bucket]) return iterator(this, nodes.at(buckets()[bucket]), bucket);
+            return iterator(this, nullptr, 0);
+        }
+
+        void rehash(std::size_t new_count)
+        {
+            auto new_table = (compact_ptr<node>*)nodes.heap().malloc(new_count * sizeof(compact_ptr<node>));
+            if(!new_table) throw std::bad_alloc();
+            for(std::size_t b = 0; b < new_count; ++b)
+                new(&new_table[b]) compact_ptr<node>();
+
+            std::size_t old_count = bucket_count;
+            compact_ptr<node> *old_table = buckets();
+            table = new_table;
+            bucket_count = new_count;
+
+            for(std::size_t b = 0; b < old_count; ++b)
+            {
+                for(node *n = nodes.at(old_table[b]); n; )
+                {
+                    node *next = nodes.at(n->next);
+                    std::size_t i = index(KeyOf()(n->value));
+                    n->next = new_table[i];
+                    new_table[i] = nodes.link(n);
+                    n = next;
+                }
+            }
+
+            if(old_count) nodes.heap().free(old_table, old_count * sizeof(compact_ptr<node>));
+        }
+    };
+
+    template<class K, class H = std::hash<K>, class E = std::equal_to<K> >
+    class compact_hash_set : public compact_hash<K, const K, key_of_value, H, E>
+    {
+        typedef compact_hash<K, const K, key_of_value, H, E> base;
+    public:
+        compact_hash_set(shared_memory &mem) : base(mem) { }
+
+        std::pair<typename base::iterator, bool> insert(const K &key) { return this->emplace_key(key, key); }
+    };
+
+    template<class K, class V, class H = std::hash<K>, class E = std::equal_to<K> >
+    class compact_hash_map : public compact_hash<K, std::pair<const K, V>, key_of_pair, H, E>
+    {
+        typedef compact_hash<K, std::pair<const K, V>, key_of_pair, H, E> base;
+    public:
+        typedef V mapped_type;
+
+        compact_hash_map(shared_memory &mem) : base(mem) { }
+
+        std::pair<typename base::iterator, bool> insert(const typename base::value_type &value)
+        {
+            return this->emplace_key(value.first, value);
+        }
+
+        V &operator[](const K &key)
+        {
+            return this->emplace_key(key, std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple()).first->second;
+        }
+    };
+}
+
+#endif
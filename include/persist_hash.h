@@ -0,0 +1,388 @@
+// Copyright (C) Calum Grant 2003-2021
+// Copying permitted under the terms of the GNU Public Licence (GPL)
+//
+// Hashing, and a persistent open-addressing hash map
+
+#ifndef PERSIST_HASH_H
+#define PERSIST_HASH_H
+#include "persist.h"
+
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace persist
+{
+    // The high and low halves of a*b, xored together
+    inline std::uint64_t hash_mix(std::uint64_t a, std::uint64_t b)
+    {
+#ifdef _MSC_VER
+        std::uint64_t high, low = _umul128(a, b, &high);
+        return low ^ high;
+#else
+        unsigned __int128 r = (unsigned __int128)a * b;
+        return std::uint64_t(r) ^ std::uint64_t(r >> 64);
+#endif
+    }
+
+    // Hashes a block of memory, using wyhash
+    inline std::uint64_t hash_bytes(const void *data, std::size_t length, std::uint64_t seed=0)
+    {
+        static const std::uint64_t secret[4] = { 0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull };
+        auto read8 = [](const unsigned char *p) { std::uint64_t v; std::memcpy(&v, p, 8); return v; };
+        auto read4 = [](const unsigned char *p) { std::uint32_t v; std::memcpy(&v, p, 4); return std::uint64_t(v); };
+
+        auto p = (const unsigned char*)data;
+        std::uint64_t a, b;
+        seed ^= hash_mix(seed ^ secret[0], secret[1]);
+
+        if(length <= 16)
+        {
+            if(length >= 4)
+            {
+                a = read4(p) << 32 | read4(p + (length >> 3 << 2));
+                b = read4(p + length - 4) << 32 | read4(p + length - 4 - (length >> 3 << 2));
+            }
+            else if(length > 0)
+            {
+                a = std::uint64_t(p[0]) << 16 | std::uint64_t(p[length >> 1]) << 8 | p[length - 1];
+                b = 0;
+            }
+            else
+                a = b = 0;
+        }
+        else
+        {
+            std::size_t i = length;
+            if(i > 48)
+            {
+                std::uint64_t seed1 = seed, seed2 = seed;
+                do
+                {
+                    seed = hash_mix(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+                    seed1 = hash_mix(read8(p + 16) ^ secret[2], read8(p + 24) ^ seed1);
+                    seed2 = hash_mix(read8(p + 32) ^ secret[3], read8(p + 40) ^ seed2);
+                    p += 48; i -= 48;
+                }
+                while(i > 48);
+                seed ^= seed1 ^ seed2;
+            }
+            for(; i > 16; i -= 16, p += 16)
+                seed = hash_mix(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+            a = read8(p + i - 16);
+            b = read8(p + i - 8);
+        }
+
+        a ^= secret[1];
+        b ^= seed;
+#ifdef _MSC_VER
+        a = _umul128(a, b, &b);
+#else
+        unsigned __int128 r = (unsigned __int128)a * b;
+        a = std::uint64_t(r);
+        b = std::uint64_t(r >> 64);
+#endif
+        return hash_mix(a ^ secret[0] ^ length, b ^ secret[1]);
+    }
+
+    // hash
+    // The default hash of persist containers.  Strings (anything with c_str() and size())
+    // are hashed by their characters, and other types by mixing the bits of std::hash.
+    template<class T, class = void>
+    struct hash
+    {
+        std::size_t operator()(const T &value) const
+        {
+            return hash_mix(std::hash<T>()(value) ^ 0xa0761d6478bd642full, 0xe7037ed1a0b428dbull);
+        }
+    };
+
+    template<class T>
+    struct hash<T, std::void_t<decltype(std::declval<const T&>().c_str()), decltype(std::declval<const T&>().size())>>
+    {
+        std::size_t operator()(const T &value) const
+        {
+            return hash_bytes(value.c_str(), value.size() * sizeof(*value.c_str()));
+        }
+    };
+
+    // flat_hash_group
+    // The control bytes of 16 slots of a flat_hash_map, which are compared all at once.
+    // A control byte is the low 7 bits of the hash of a full slot, or negative for a free one.
+    class flat_hash_group
+    {
+    public:
+        static constexpr int size = 16;
+        static constexpr signed char empty_slot = -128, deleted_slot = -2;
+
+#ifdef __SSE2__
+        flat_hash_group(const signed char *ctrl) : bytes(_mm_loadu_si128((const __m128i*)ctrl)) { }
+
+        // Bit i is set when byte i is c
+        std::uint32_t match(signed char c) const
+        {
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)));
+        }
+
+        std::uint32_t free() const { return _mm_movemask_epi8(bytes); }
+#else
+        flat_hash_group(const signed char *ctrl) : bytes(ctrl) { }
+
+        std::uint32_t match(signed char c) const
+        {
+            std::uint32_t mask = 0;
+            for(int i=0; i<size; ++i) mask |= std::uint32_t(bytes[i] == c) << i;
+            return mask;
+        }
+
+        std::uint32_t free() const
+        {
+            std::uint32_t mask = 0;
+            for(int i=0; i<size; ++i) mask |= std::uint32_t(bytes[i] < 0) << i;
+            return mask;
+        }
+#endif
+
+        std::uint32_t empty() const { return match(empty_slot); }
+
+        // The index of the lowest bit of a mask
+        static int first(std::uint32_t mask)
+        {
+#ifdef _MSC_VER
+            unsigned long i;
+            _BitScanForward(&i, mask);
+            return i;
+#else
+            return __builtin_ctz(mask);
+#endif
+        }
+
+    private:
+#ifdef __SSE2__
+        __m128i bytes;
+#else
+        const signed char *bytes;
+#endif
+    };
+
+    // flat_hash_map
+    // A hash map that stores its values in a single block, found by probing groups of control bytes.
+    // Values move when the map grows, so iterators and references are invalidated by insertion.
+    // Each slot takes sizeof(value_type)+1 bytes, and the slot count is a power of two that is at
+    // most 7/8 full, so a map takes 1.15 to 2.3 slots per item.  For large values, a hash_map,
+    // which allocates a node per item, can be smaller.  Growing frees the old block, but the heap
+    // does not shrink, so call reserve() first when the number of items is known.
+    template<class K, class V, class H = persist::hash<K>, class E = std::equal_to<K> >
+    class flat_hash_map
+    {
+    public:
+        typedef K key_type;
+        typedef V mapped_type;
+        typedef std::pair<const K, V> value_type;
+        typedef std::size_t size_type;
+
+        static_assert(alignof(value_type) <= 8, "flat_hash_map values must be 8-byte aligned");
+
+        template<class T>
+        class basic_iterator
+        {
+        public:
+            typedef std::forward_iterator_tag iterator_category;
+            typedef std::pair<const K, V> value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef T *pointer;
+            typedef T &reference;
+
+            basic_iterator() : ctrl(nullptr), end(nullptr), slot(nullptr) { }
+            basic_iterator(const signed char *ctrl, const signed char *end, T *slot) : ctrl(ctrl), end(end), slot(slot) { skip(); }
+            template<class U> basic_iterator(const basic_iterator<U> &i) : ctrl(i.ctrl), end(i.end), slot(i.slot) { }
+
+            reference operator*() const { return *slot; }
+            pointer operator->() const { return slot; }
+
+            basic_iterator &operator++() { ++ctrl, ++slot; skip(); return *this; }
+            basic_iterator operator++(int) { auto i = *this; ++*this; return i; }
+
+            template<class U> bool operator==(const basic_iterator<U> &i) const { return ctrl == i.ctrl; }
+            template<class U> bool operator!=(const basic_iterator<U> &i) const { return ctrl != i.ctrl; }
+
+        private:
+            friend class flat_hash_map;
+            template<class U> friend class basic_iterator;
+            const signed char *ctrl, *end;
+            T *slot;
+
+            void skip()
+            {
+                while(ctrl != end && *ctrl < 0) ++ctrl, ++slot;
+            }
+        };
+
+        typedef basic_iterator<value_type> iterator;
+        typedef basic_iterator<const value_type> const_iterator;
+
+        flat_hash_map(shared_memory &mem) : mem(&mem), ctrl(nullptr), slot_count(0), items(0), growth_left(0) { }
+        ~flat_hash_map() { clear(); }
+        flat_hash_map(const flat_hash_map&) = delete;
+        flat_hash_map &operator=(const flat_hash_map&) = delete;
+
+        iterator begin() { return iterator(ctrl.get(), ctrl.get() + slot_count, slots()); }
+        iterator end() { return iterator(ctrl.get() + slot_count, ctrl.get() + slot_count, slots() + slot_count); }
+        const_iterator begin() const { return const_cast<flat_hash_map*>(this)->begin(); }
+        const_iterator end() const { return const_cast<flat_hash_map*>(this)->end(); }
+
+        size_type size() const { return items; }
+        bool empty() const { return items == 0; }
+        size_type capacity() const { return slot_count; }
+
+        iterator find(const K &key)
+        {
+            std::size_t i = find_index(key, H()(key));
+            return i == slot_count ? end() : at(i);
+        }
+
+        const_iterator find(const K &key) const { return const_cast<flat_hash_map*>(this)->find(key); }
+        size_type count(const K &key) const { return find_index(key, H()(key)) != slot_count; }
+        bool contains(const K &key) const { return count(key) != 0; }
+
+        template<class... Args>
+        std::pair<iterator, bool> try_emplace(const K &key, Args&&... args)
+        {
+            std::size_t h = H()(key), i = find_index(key, h);
+            if(i != slot_count) return { at(i), false };
+
+            if(!growth_left) rehash(items + 1 > slot_count * 7 / 16 ? std::max<std::size_t>(2 * slot_count, flat_hash_group::size) : slot_count);
+
+            i = free_index(h);
+            new(slots() + i) value_type(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+            if(ctrl[i] == flat_hash_group::empty_slot) --growth_left;
+            ctrl[i] = h & 0x7f;
+            ++items;
+            return { at(i), true };
+        }
+
+        std::pair<iterator, bool> insert(const value_type &value) { return try_emplace(value.first, value.second); }
+        V &operator[](const K &key) { return try_emplace(key).first->second; }
+
+        size_type erase(const K &key)
+        {
+            std::size_t i = find_index(key, H()(key));
+            if(i == slot_count) return 0;
+            erase_index(i);
+            return 1;
+        }
+
+        iterator erase(const_iterator pos)
+        {
+            std::size_t i = pos.ctrl - ctrl.get();
+            erase_index(i);
+            return at(i);
+        }
+
+        void clear()
+        {
+            for(std::size_t i = 0; i < slot_count; ++i)
+                if(ctrl[i] >= 0) slots()[i].~value_type();
+
+            if(slot_count) mem->free(ctrl, bytes(slot_count));
+            ctrl = nullptr;
+            slot_count = items = growth_left = 0;
+        }
+
+        // Makes room for @count items without growing
+        void reserve(size_type count)
+        {
+            std::size_t n = flat_hash_group::size;
+            while(n * 7 / 8 < count) n *= 2;
+            if(n > slot_count) rehash(n);
+        }
+
+    private:
+        offset_ptr<shared_memory> mem;
+        offset_ptr<signed char> ctrl;   // slot_count control bytes, followed by the slots
+        size_type slot_count, items, growth_left;
+
+        value_type *slots() const { return (value_type*)(ctrl.get() + slot_count); }
+        static std::size_t bytes(std::size_t slots) { return slots + slots * sizeof(value_type); }
+        iterator at(std::size_t i) { return iterator(ctrl.get() + i, ctrl.get() + slot_count, slots() + i); }
+
+        // The index of the slot holding @key, or slot_count if there isn't one.
+        // The groups are probed in triangular steps, which visit each one once.
+        std::size_t find_index(const K &key, std::size_t h) const
+        {
+            if(!slot_count) return slot_count;
+
+            std::size_t mask = slot_count / flat_hash_group::size - 1, g = (h >> 7) & mask;
+            for(std::size_t step = 1; ; g = (g + step++) & mask)
+            {
+                flat_hash_group group(ctrl.get() + g * flat_hash_group::size);
+                for(std::uint32_t m = group.match(h & 0x7f); m; m &= m - 1)
+                {
+                    std::size_t i = g * flat_hash_group::size + flat_hash_group::first(m);
+                    if(E()(slots()[i].first, key)) return i;
+                }
+                if(group.empty()) return slot_count;
+            }
+        }
+
+        // The first empty or deleted slot where @h probes
+        std::size_t free_index(std::size_t h) const
+        {
+            std::size_t mask = slot_count / flat_hash_group::size - 1, g = (h >> 7) & mask;
+            for(std::size_t step = 1; ; g = (g + step++) & mask)
+            {
+                std::uint32_t m = flat_hash_group(ctrl.get() + g * flat_hash_group::size).free();
+                if(m) return g * flat_hash_group::size + flat_hash_group::first(m);
+            }
+        }
+
+        // A group with an empty slot has never been full, so no probe has passed it,
+        // and the erased slot can be made empty.  Otherwise it is marked deleted.
+        void erase_index(std::size_t i)
+        {
+            slots()[i].~value_type();
+            bool empty = flat_hash_group(ctrl.get() + (i & ~std::size_t(flat_hash_group::size - 1))).empty();
+            ctrl[i] = empty ? flat_hash_group::empty_slot : flat_hash_group::deleted_slot;
+            if(empty) ++growth_left;
+            --items;
+        }
+
+        // Moves the values into a new block of @new_count slots, which also clears deleted slots
+        void rehash(std::size_t new_count)
+        {
+            auto new_ctrl = (signed char*)mem->malloc(bytes(new_count));
+            if(!new_ctrl) throw std::bad_alloc();
+            std::memset(new_ctrl, flat_hash_group::empty_slot, new_count);
+
+            signed char *old_ctrl = ctrl;
+            value_type *old_slots = slots();
+            std::size_t old_count = slot_count;
+            ctrl = new_ctrl;
+            slot_count = new_count;
+
+            for(std::size_t i = 0; i < old_count; ++i)
+            {
+                if(old_ctrl[i] < 0) continue;
+                std::size_t h = H()(old_slots[i].first), j = free_index(h);
+                new(slots() + j) value_type(std::move(old_slots[i]));
+                old_slots[i].~value_type();
+                ctrl[j] = h & 0x7f;
+            }
+
+            growth_left = new_count * 7 / 8 - items;
+            if(old_count) mem->free(old_ctrl, bytes(old_count));
+        }
+    };
+}
+
+#endif
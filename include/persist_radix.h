@@ -0,0 +1,710 @@
+// Copyright (C) Calum Grant 2003-2021
+// Copying permitted under the terms of the GNU Public Licence (GPL)
+//
+// A persistent adaptive radix tree
+
+#ifndef PERSIST_RADIX_H
+#define PERSIST_RADIX_H
+#include "persist.h"
+#include "persist_hash.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <string_view>
+#include <tuple>
+#include <utility>
+
+namespace persist
+{
+    // radix_map
+    // A map from strings to values, stored in an adaptive radix tree.  K is a string type,
+    // such as fixed_string or persist::string, with c_str() and size().
+    //
+    // Each inner node branches on one byte of the key, and grows from 4 to 16, 48 and 256
+    // children as it fills.  A chain of nodes with one child is stored as a prefix in the node
+    // below it, of which the first max_prefix bytes are kept, and the rest are checked against
+    // the key in the leaf.  A key that ends at an inner node is its terminal leaf.
+    // The leaves are linked in key order, for iteration and for prefix scans.
+    template<class K, class V>
+    class radix_map
+    {
+    public:
+        typedef K key_type;
+        typedef V mapped_type;
+        typedef std::pair<const K, V> value_type;
+        typedef std::size_t size_type;
+
+        static constexpr int max_prefix = 8;
+
+    private:
+        enum { leaf_type, node4_type, node16_type, node48_type, node256_type };
+
+        struct node
+        {
+            std::uint8_t type;
+
+            node(std::uint8_t type) : type(type) { }
+        };
+
+        struct leaf : node
+        {
+            offset_ptr<leaf> prev, next;
+            value_type value;
+
+            template<class... Args> leaf(Args&&... args) : node(leaf_type), value(std::forward<Args>(args)...) { }
+        };
+
+        struct inner : node
+        {
+            std::uint16_t count = 0;
+            std::uint32_t prefix_length = 0;
+            unsigned char prefix[max_prefix];
+            offset_ptr<leaf> terminal;
+
+            inner(std::uint8_t type) : node(type) { }
+        };
+
+        // Node4 and Node16 keep their keys sorted
+        struct node4 : inner
+        {
+            unsigned char keys[4];
+            offset_ptr<node> children[4];
+            node4() : inner(node4_type) { }
+        };
+
+        struct node16 : inner
+        {
+            unsigned char keys[16];
+            offset_ptr<node> children[16];
+            node16() : inner(node16_type) { }
+        };
+
+        // index holds 1 + the slot of the child for each byte, or 0
+        struct node48 : inner
+        {
+            unsigned char index[256] = { };
+            offset_ptr<node> children[48];
+            node48() : inner(node48_type) { }
+        };
+
+        struct node256 : inner
+        {
+            offset_ptr<node> children[256];
+            node256() : inner(node256_type) { }
+        };
+
+    public:
+        template<class T>
+        class basic_iterator
+        {
+        public:
+            typedef std::bidirectional_iterator_tag iterator_category;
+            typedef std::pair<const K, V> value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef T *pointer;
+            typedef T &reference;
+
+            basic_iterator() : tree(nullptr), l(nullptr) { }
+            basic_iterator(const radix_map *tree, leaf *l) : tree(tree), l(l) { }
+            template<class U> basic_iterator(const basic_iterator<U> &i) : tree(i.tree), l(i.l) { }
+
+            reference operator*() const { return l->value; }
+            pointer operator->() const { return &l->value; }
+
+            basic_iterator &operator++() { l = l->next; return *this; }
+            basic_iterator &operator--() { l = l ? l->prev.get() : tree->last.get(); return *this; }
+            basic_iterator operator++(int) { auto i = *this; ++*this; return i; }
+            basic_iterator operator--(int) { auto i = *this; --*this; return i; }
+
+            template<class U> bool operator==(const basic_iterator<U> &i) const { return l == i.l; }
+            template<class U> bool operator!=(const basic_iterator<U> &i) const { return l != i.l; }
+
+        private:
+            friend class radix_map;
+            template<class U> friend class basic_iterator;
+            const radix_map *tree;
+            leaf *l;    // nullptr at the end
+        };
+
+        typedef basic_iterator<value_type> iterator;
+        typedef basic_iterator<const value_type> const_iterator;
+
+        radix_map(shared_memory &mem) : mem(&mem), root(nullptr), first(nullptr), last(nullptr), items(0) { }
+        ~radix_map() { clear(); }
+        radix_map(const radix_map&) = delete;
+        radix_map &operator=(const radix_map&) = delete;
+
+        iterator begin() { return iterator(this, first); }
+        iterator end() { return iterator(this, nullptr); }
+        const_iterator begin() const { return const_iterator(this, first); }
+        const_iterator end() const { return const_iterator(this, nullptr); }
+
+        size_type size() const { return items; }
+        bool empty() const { return items == 0; }
+
+        iterator find(const K &key) { return iterator(this, find_leaf(bytes(key))); }
+        const_iterator find(const K &key) const { return const_iterator(this, find_leaf(bytes(key))); }
+        size_type count(const K &key) const { return find_leaf(bytes(key)) != nullptr; }
+
+        V &operator[](const K &key) { return try_emplace(key).first->second; }
+        std::pair<iterator, bool> insert(const value_type &value) { return try_emplace(value.first, value.second); }
+
+        template<class... Args>
+        std::pair<iterator, bool> try_emplace(const K &key, Args&&... args)
+        {
+            std::string_view k = bytes(key);
+            offset_ptr<node> *ref = &root;
+            std::size_t depth = 0;
+
+            for(;;)
+            {
+                node *n = *ref;
+                if(!n)
+                {
+                    leaf *l = new_leaf(key, std::forward<Args>(args)...);
+                    *ref = l;
+                    return { link(l), true };
+                }
+
+                if(n->type == leaf_type)
+                {
+                    // Both leaves go below a new node, after the bytes they share
+                    auto old = (leaf*)n;
+                    std::string_view other = bytes(old->value.first);
+                    if(other == k) return { iterator(this, old), false };
+
+                    std::size_t common = depth;
+                    while(common < k.size() && common < other.size() && k[common] == other[common]) ++common;
+
+                    leaf *l = new_leaf(key, std::forward<Args>(args)...);
+                    inner *split = create<node4>();
+                    set_prefix(split, k.data() + depth, common - depth);
+                    place(split, old, other, common);
+                    place(split, l, k, common);
+                    *ref = split;
+                    return { link(l), true };
+                }
+
+                auto i = (inner*)n;
+                if(i->prefix_length)
+                {
+                    std::size_t match = prefix_match(i, k, depth);
+                    if(match < i->prefix_length)
+                    {
+                        // The prefix is split, and the node goes below a new node with the part before
+                        unsigned char byte = prefix_byte(i, depth, match);
+                        inner *split = create<node4>();
+                        set_prefix(split, i->prefix, match);
+                        drop_prefix(i, depth, match + 1);
+                        split = add_child(split, byte, i);
+
+                        leaf *l = new_leaf(key, std::forward<Args>(args)...);
+                        place(split, l, k, depth + match);
+                        *ref = split;
+                        return { link(l), true };
+                    }
+                    depth += i->prefix_length;
+                }
+
+                if(depth == k.size())
+                {
+                    if(i->terminal) return { iterator(this, i->terminal), false };
+                    leaf *l = new_leaf(key, std::forward<Args>(args)...);
+                    i->terminal = l;
+                    return { link(l), true };
+                }
+
+                offset_ptr<node> *child = find_child(i, k[depth]);
+                if(!child)
+                {
+                    leaf *l = new_leaf(key, std::forward<Args>(args)...);
+                    *ref = add_child(i, k[depth], l);
+                    return { link(l), true };
+                }
+
+                ref = child;
+                ++depth;
+            }
+        }
+
+        size_type erase(const K &key)
+        {
+            leaf *l = find_leaf(bytes(key));
+            if(l) erase_leaf(l);
+            return l != nullptr;
+        }
+
+        iterator erase(const_iterator pos)
+        {
+            leaf *next = pos.l->next;
+            erase_leaf(pos.l);
+            return iterator(this, next);
+        }
+
+        // The values whose keys start with @prefix
+        std::pair<iterator, iterator> prefix_range(std::string_view prefix)
+        {
+            node *n = root;
+            std::size_t depth = 0;
+
+            // Bytes of prefixes that are not stored are skipped, and checked at the end
+            while(n && n->type != leaf_type && depth < prefix.size())
+            {
+                auto i = (inner*)n;
+                std::size_t stored = std::min<std::size_t>(i->prefix_length, max_prefix);
+                for(std::size_t p = 0; p < stored && depth + p < prefix.size(); ++p)
+                    if(i->prefix[p] != (unsigned char)prefix[depth + p]) return { end(), end() };
+
+                depth += i->prefix_length;
+                if(depth >= prefix.size()) break;
+
+                offset_ptr<node> *child = find_child(i, prefix[depth]);
+                n = child ? child->get() : nullptr;
+                ++depth;
+            }
+
+            leaf *low = n ? min_leaf(n) : nullptr;
+            if(!low || bytes(low->value.first).substr(0, prefix.size()) != prefix) return { end(), end() };
+            return { iterator(this, low), iterator(this, max_leaf(n)->next) };
+        }
+
+        void clear()
+        {
+            if(root) destroy(root);
+            root = nullptr;
+            first = last = nullptr;
+            items = 0;
+        }
+
+    private:
+        offset_ptr<shared_memory> mem;
+        offset_ptr<node> root;
+        offset_ptr<leaf> first, last;
+        size_type items;
+
+        static std::string_view bytes(const K &key)
+        {
+            return std::string_view((const char*)key.c_str(), key.size() * sizeof(*key.c_str()));
+        }
+
+        template<class N, class... Args>
+        N *create(Args&&... args)
+        {
+            N *n = allocator<N>(*mem).allocate(1);
+            return new(n) N(std::forward<Args>(args)...);
+        }
+
+        template<class... Args>
+        leaf *new_leaf(const K &key, Args&&... args)
+        {
+            return create<leaf>(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+        }
+
+        template<class N>
+        void release(N *n)
+        {
+            n->~N();
+            allocator<N>(*mem).deallocate(n, 1);
+        }
+
+        void release(inner *n)
+        {
+            switch(n->type)
+            {
+            case node4_type: release((node4*)n); break;
+            case node16_type: release((node16*)n); break;
+            case node48_type: release((node48*)n); break;
+            default: release((node256*)n); break;
+            }
+        }
+
+        void destroy(node *n)
+        {
+            if(n->type == leaf_type)
+            {
+                release((leaf*)n);
+                return;
+            }
+
+            auto i = (inner*)n;
+            if(i->terminal) release(i->terminal.get());
+            int byte = -1;
+            while(node *child = next_child(i, byte)) destroy(child);
+            release(i);
+        }
+
+        // The smallest and largest leaves below @n
+        leaf *min_leaf(node *n) const
+        {
+            while(n->type != leaf_type)
+            {
+                auto i = (inner*)n;
+                if(i->terminal) return i->terminal;
+                int byte = -1;
+                n = next_child(i, byte);
+            }
+            return (leaf*)n;
+        }
+
+        leaf *max_leaf(node *n) const
+        {
+            while(n->type != leaf_type)
+            {
+                auto i = (inner*)n;
+                node *child = prev_child(i, 256);
+                if(!child) return i->terminal;
+                n = child;
+            }
+            return (leaf*)n;
+        }
+
+        leaf *find_leaf(std::string_view k) const
+        {
+            node *n = root;
+            std::size_t depth = 0;
+            while(n && n->type != leaf_type)
+            {
+                auto i = (inner*)n;
+                std::size_t stored = std::min<std::size_t>(i->prefix_length, max_prefix);
+                if(depth + i->prefix_length > k.size()) return nullptr;
+                for(std::size_t p = 0; p < stored; ++p)
+                    if(i->prefix[p] != (unsigned char)k[depth + p]) return nullptr;
+                depth += i->prefix_length;
+
+                if(depth == k.size())
+                {
+                    n = i->terminal;
+                    break;
+                }
+
+                offset_ptr<node> *child = find_child(i, k[depth]);
+                n = child ? child->get() : nullptr;
+                ++depth;
+            }
+
+            return n && bytes(((leaf*)n)->value.first) == k ? (leaf*)n : nullptr;
+        }
+
+        // Adds @l below @i, whose prefix ends at @depth in @key
+        void place(inner *&i, leaf *l, std::string_view key, std::size_t depth)
+        {
+            if(depth == key.size()) i->terminal = l;
+            else i = add_child(i, key[depth], l);
+        }
+
+        void set_prefix(inner *i, const void *p, std::size_t length)
+        {
+            i->prefix_length = length;
+            std::memcpy(i->prefix, p, std::min<std::size_t>(length, max_prefix));
+        }
+
+        // Byte @p of the prefix of @i, which starts at @depth
+        unsigned char prefix_byte(inner *i, std::size_t depth, std::size_t p) const
+        {
+            return p < max_prefix ? i->prefix[p] : bytes(min_leaf(i)->value.first)[depth + p];
+        }
+
+        // The number of bytes of the prefix of @i that match @k from @depth
+        std::size_t prefix_match(inner *i, std::string_view k, std::size_t depth) const
+        {
+            std::size_t p = 0;
+            for(; p < i->prefix_length && p < max_prefix; ++p)
+                if(depth + p >= k.size() || i->prefix[p] != (unsigned char)k[depth + p]) return p;
+
+            if(p < i->prefix_length)
+            {
+                std::string_view other = bytes(min_leaf(i)->value.first);
+                for(; p < i->prefix_length; ++p)
+                    if(depth + p >= k.size() || other[depth + p] != k[depth + p]) return p;
+            }
+            return p;
+        }
+
+        // Removes the first @count bytes of the prefix of @i, which starts at @depth
+        void drop_prefix(inner *i, std::size_t depth, std::size_t count)
+        {
+            std::size_t length = i->prefix_length - count;
+            if(i->prefix_length <= max_prefix)
+                std::memmove(i->prefix, i->prefix + count, length);
+            else
+                std::memcpy(i->prefix, bytes(min_leaf(i)->value.first).data() + depth + count, std::min<std::size_t>(length, max_prefix));
+            i->prefix_length = length;
+        }
+
+        // The slot of the child of @i for @byte, or nullptr.
+        // Node16 compares all its keys at once, as flat_hash_map compares control bytes.
+        offset_ptr<node> *find_child(inner *i, unsigned char byte) const
+        {
+            switch(i->type)
+            {
+            case node4_type:
+                {
+                    auto n = (node4*)i;
+                    for(int c = 0; c < n->count; ++c)
+                        if(n->keys[c] == byte) return &n->children[c];
+                    return nullptr;
+                }
+            case node16_type:
+                {
+                    auto n = (node16*)i;
+                    std::uint32_t mask = flat_hash_group((const signed char*)n->keys).match(byte) & ((1u << n->count) - 1);
+                    return mask ? &n->children[flat_hash_group::first(mask)] : nullptr;
+                }
+            case node48_type:
+                {
+                    auto n = (node48*)i;
+                    return n->index[byte] ? &n->children[n->index[byte] - 1] : nullptr;
+                }
+            default:
+                {
+                    auto n = (node256*)i;
+                    return n->children[byte] ? &n->children[byte] : nullptr;
+                }
+            }
+        }
+
+        // The first child of @i after @byte, which is updated to the child's byte
+        node *next_child(inner *i, int &byte) const
+        {
+            switch(i->type)
+            {
+            case node4_type:
+            case node16_type:
+                {
+                    unsigned char *keys = i->type == node4_type ? ((node4*)i)->keys : ((node16*)i)->keys;
+                    offset_ptr<node> *children = i->type == node4_type ? ((node4*)i)->children : ((node16*)i)->children;
+                    for(int c = 0; c < i->count; ++c)
+                        if(keys[c] > byte) return byte = keys[c], children[c].get();
+                    return nullptr;
+                }
+            case node48_type:
+                {
+                    auto n = (node48*)i;
+                    for(int b = byte + 1; b < 256; ++b)
+                        if(n->index[b]) return byte = b, n->children[n->index[b] - 1].get();
+                    return nullptr;
+                }
+            default:
+                {
+                    auto n = (node256*)i;
+                    for(int b = byte + 1; b < 256; ++b)
+                        if(n->children[b]) return byte = b, n->children[b].get();
+                    return nullptr;
+                }
+            }
+        }
+
+        // The last child of @i before @byte
+        node *prev_child(inner *i, int byte) const
+        {
+            node *result = nullptr;
+            for(int b = -1; node *child = next_child(i, b); )
+            {
+                if(b >= byte) break;
+                result = child;
+            }
+            return result;
+        }
+
+        bool full(inner *i) const
+        {
+            static const int capacity[] = { 0, 4, 16, 48, 256 };
+            return i->count == capacity[i->type];
+        }
+
+        // Adds @child for @byte, and returns the node, which is replaced by a larger one if @i is full
+        inner *add_child(inner *i, unsigned char byte, node *child)
+        {
+            if(full(i)) i = resize(i, i->type + 1);
+
+            switch(i->type)
+            {
+            case node4_type:
+            case node16_type:
+                {
+                    unsigned char *keys = i->type == node4_type ? ((node4*)i)->keys : ((node16*)i)->keys;
+                    offset_ptr<node> *children = i->type == node4_type ? ((node4*)i)->children : ((node16*)i)->children;
+                    int c = i->count;
+                    for(; c > 0 && keys[c-1] > byte; --c)
+                    {
+                        keys[c] = keys[c-1];
+                        children[c] = children[c-1];
+                    }
+                    keys[c] = byte;
+                    children[c] = child;
+                    break;
+                }
+            case node48_type:
+                {
+                    auto n = (node48*)i;
+                    int c = 0;
+                    while(n->children[c]) ++c;
+                    n->children[c] = child;
+                    n->index[byte] = c + 1;
+                    break;
+                }
+            default:
+                ((node256*)i)->children[byte] = child;
+            }
+
+            ++i->count;
+            return i;
+        }
+
+        void remove_child(inner *i, unsigned char byte)
+        {
+            switch(i->type)
+            {
+            case node4_type:
+            case node16_type:
+                {
+                    unsigned char *keys = i->type == node4_type ? ((node4*)i)->keys : ((node16*)i)->keys;
+                    offset_ptr<node> *children = i->type == node4_type ? ((node4*)i)->children : ((node16*)i)->children;
+                    int c = std::find(keys, keys + i->count, byte) - keys;
+                    for(; c + 1 < i->count; ++c)
+                    {
+                        keys[c] = keys[c+1];
+                        children[c] = children[c+1];
+                    }
+                    children[c] = nullptr;
+                    break;
+                }
+            case node48_type:
+                {
+                    auto n = (node48*)i;
+                    n->children[n->index[byte] - 1] = nullptr;
+                    n->index[byte] = 0;
+                    break;
+                }
+            default:
+                ((node256*)i)->children[byte] = nullptr;
+            }
+
+            --i->count;
+        }
+
+        // Moves the contents of @i into a new node of @type
+        inner *resize(inner *i, int type)
+        {
+            inner *n;
+            switch(type)
+            {
+            case node4_type: n = create<node4>(); break;
+            case node16_type: n = create<node16>(); break;
+            case node48_type: n = create<node48>(); break;
+            default: n = create<node256>(); break;
+            }
+
+            n->prefix_length = i->prefix_length;
+            std::memcpy(n->prefix, i->prefix, max_prefix);
+            n->terminal = i->terminal;
+            for(int byte = -1; node *child = next_child(i, byte); )
+                add_child(n, byte, child);
+
+            release(i);
+            return n;
+        }
+
+        // Links the new leaf @l in order, before the first leaf after it in the tree.
+        // That is the smallest leaf below the deepest child after the path to @l.
+        iterator link(leaf *l)
+        {
+            std::string_view k = bytes(l->value.first);
+            node *n = root, *after = nullptr;
+            std::size_t depth = 0;
+            while(n != l)
+            {
+                auto i = (inner*)n;
+                depth += i->prefix_length;
+                int byte = depth == k.size() ? -1 : (unsigned char)k[depth];
+                if(node *child = next_child(i, byte)) after = child;
+                if(depth == k.size()) break;
+                n = *find_child(i, k[depth++]);
+            }
+
+            leaf *next = after ? min_leaf(after) : nullptr;
+            l->next = next;
+            l->prev = next ? next->prev : last;
+            (l->prev ? l->prev->next : first) = l;
+            (next ? next->prev : last) = l;
+            ++items;
+            return iterator(this, l);
+        }
+
+        void erase_leaf(leaf *l)
+        {
+            std::string_view k = bytes(l->value.first);
+            offset_ptr<node> *ref = &root, *parent_ref = nullptr;
+            std::size_t depth = 0;
+            while(ref->get() != l)
+            {
+                auto i = (inner*)ref->get();
+                depth += i->prefix_length;
+                if(depth == k.size()) break;
+                parent_ref = ref;
+                ref = find_child(i, k[depth++]);
+            }
+
+            (l->prev ? l->prev->next : first) = l->next;
+            (l->next ? l->next->prev : last) = l->prev;
+            --items;
+
+            if(ref->get() != l)
+            {
+                // The terminal of an inner node
+                ((inner*)ref->get())->terminal = nullptr;
+                release(l);
+                tidy(*ref, depth - ((inner*)ref->get())->prefix_length);
+            }
+            else if(!parent_ref)
+            {
+                root = nullptr;
+                release(l);
+            }
+            else
+            {
+                auto parent = (inner*)parent_ref->get();
+                remove_child(parent, k[depth - 1]);
+                release(l);
+                tidy(*parent_ref, depth - 1 - parent->prefix_length);
+            }
+        }
+
+        // Restores the shape of the node at @ref, which starts at @depth, after an entry is removed.
+        // A node with one entry is replaced by it, and a node with few children becomes smaller.
+        void tidy(offset_ptr<node> &ref, std::size_t depth)
+        {
+            auto i = (inner*)ref.get();
+            if(i->count == 0)
+            {
+                ref = i->terminal.get();
+                release(i);
+            }
+            else if(i->count == 1 && !i->terminal)
+            {
+                int byte = -1;
+                node *child = next_child(i, byte);
+                if(child->type != leaf_type)
+                {
+                    // The prefixes join, with the byte between them
+                    auto c = (inner*)child;
+                    unsigned char joined[max_prefix];
+                    std::size_t length = i->prefix_length + 1 + c->prefix_length;
+                    for(std::size_t p = 0; p < max_prefix && p < length; ++p)
+                        joined[p] = p < i->prefix_length ? prefix_byte(i, depth, p) : p == i->prefix_length ? byte : prefix_byte(c, depth + i->prefix_length + 1, p - i->prefix_length - 1);
+                    set_prefix(c, joined, length);
+                }
+                ref = child;
+                release(i);
+            }
+            else if((i->type == node16_type && i->count <= 3) || (i->type == node48_type && i->count <= 12) ||
+                (i->type == node256_type && i->count <= 37))
+            {
+                ref = resize(i, i->type - 1);
+            }
+        }
+    };
+}
+
+#endif
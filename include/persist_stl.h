@@ -6,6 +6,7 @@
 #ifndef _PERSIST_STL_H
 #define _PERSIST_STL_H
 #include "persist.h"
+#include "persist_hash.h"
 
 #include <vector>
 #include <string>
@@ -34,6 +35,8 @@ namespace persist
     template<class T>
     class list : public std::list<T, persist::allocator<T> >
     {
+    public:
+        list(shared_memory &mem) : std::list<T, persist::allocator<T> >(persist::allocator<T>(mem)) { }
     };
     
     template<class C, class Traits = std::char_traits<C> >
@@ -41,12 +44,12 @@ namespace persist
     {
         void operator=(const std::basic_string<C> &s);
     public:
-        basic_string() { }
-        basic_string(const C*c) : std::basic_string<C, Traits, persist::allocator<C> >(c) { }
+        basic_string(shared_memory &mem) : std::basic_string<C, Traits, persist::allocator<C> >(persist::allocator<C>(mem)) { }
+        basic_string(shared_memory &mem, const C*c) : std::basic_string<C, Traits, persist::allocator<C> >(c, persist::allocator<C>(mem)) { }
 
-        basic_string(const std::basic_string<C> &s)
+        basic_string(shared_memory &mem, const std::basic_string<C> &s) : basic_string(mem)
         {
-            assign(s.begin(), s.end());
+            this->assign(s.begin(), s.end());
         }
 
         basic_string &operator=(const C *s)
@@ -67,68 +70,94 @@ namespace persist
     template<class T>
     class vector : public std::vector<T, persist::allocator<T> >
     {
+    public:
+        vector(shared_memory &mem) : std::vector<T, persist::allocator<T> >(persist::allocator<T>(mem)) { }
         // TODO: constructors
     };
 
     template<class T, class L = std::less<T> >
     class set : public std::set<T, L, persist::allocator<T> >
     {
+    public:
+        set(shared_memory &mem) : std::set<T, L, persist::allocator<T> >(persist::allocator<T>(mem)) { }
     };
 
     template<class T, class L = std::less<T> >
     class multiset : public std::multiset<T, L, persist::allocator<T> >
     {
+    public:
+        multiset(shared_memory &mem) : std::multiset<T, L, persist::allocator<T> >(persist::allocator<T>(mem)) { }
     };
 
     template<class T, class V, class L = std::less<T> >
-    class map : public std::map<T, V, L, persist::allocator<std::pair<T,V> > >
+    class map : public std::map<T, V, L, persist::allocator<std::pair<const T,V> > >
     {
+    public:
+        map(shared_memory &mem) : std::map<T, V, L, persist::allocator<std::pair<const T,V> > >(persist::allocator<std::pair<const T,V> >(mem)) { }
     };
 
     template<class T, class V, class L = std::less<T> >
-    class multimap : public std::multimap<T, V, L, persist::allocator<std::pair<T,V> > >
+    class multimap : public std::multimap<T, V, L, persist::allocator<std::pair<const T,V> > >
     {
+    public:
+        multimap(shared_memory &mem) : std::multimap<T, V, L, persist::allocator<std::pair<const T,V> > >(persist::allocator<std::pair<const T,V> >(mem)) { }
     };
 
 #if microsoft_stl
     template<class T, class H = std::hash_compare<T, std::less<T> > >
     class hash_set : public stdext::hash_set<T, H, persist::allocator<T> >
     {
+    public:
+        hash_set(shared_memory &mem) : stdext::hash_set<T, H, persist::allocator<T> >(H(), persist::allocator<T>(mem)) { }
     };
 
     template<class K, class V, class H = std::hash_compare<K, std::less<K> > >
     class hash_map : public stdext::hash_map<K, V, H, persist::allocator<std::pair<K, V> > >
     {
+    public:
+        hash_map(shared_memory &mem) : stdext::hash_map<K, V, H, persist::allocator<std::pair<K, V> > >(H(), persist::allocator<std::pair<K, V> >(mem)) { }
     };
 
     template<class T, class H = std::hash_compare<T, std::less<T> > >
     class hash_multiset : public stdext::hash_multiset<T, H, persist::allocator<T> >
     {
+    public:
+        hash_multiset(shared_memory &mem) : stdext::hash_multiset<T, H, persist::allocator<T> >(H(), persist::allocator<T>(mem)) { }
     };
 
     template<class K, class V, class H = std::hash_compare<K, std::less<K> > >
     class hash_multimap : public stdext::hash_multimap<K, V, H, persist::allocator<std::pair<K, V> > >
     {
+    public:
+        hash_multimap(shared_memory &mem) : stdext::hash_multimap<K, V, H, persist::allocator<std::pair<K, V> > >(H(), persist::allocator<std::pair<K, V> >(mem)) { }
     };
 #elif sgi_stl
     template< class K, class H = __gnu_cxx::hash<K>, class E = __gnu_cxx::equal_to<K> >
     class hash_set : public __gnu_cxx::hash_set< K, H, E, persist::allocator<K> >
     {
+    public:
+        hash_set(shared_memory &mem) : __gnu_cxx::hash_set< K, H, E, persist::allocator<K> >(100, H(), E(), persist::allocator<K>(mem)) { }
     };
 
     template<class K, class V, class H = __gnu_cxx::hash<K>, class E=__gnu_cxx::equal_to<K> > 
     class hash_map : public __gnu_cxx::hash_map<K, V, H, E, persist::allocator<V> > 
     {
+    public:
+        hash_map(shared_memory &mem) : __gnu_cxx::hash_map<K, V, H, E, persist::allocator<V> >(100, H(), E(), persist::allocator<V>(mem)) { }
     };
 
     template< class K, class H = __gnu_cxx::hash<K>, class E = __gnu_cxx::equal_to<K> >
     class hash_multiset : public __gnu_cxx::hash_multiset< K, H, E, persist::allocator<K> >
     {
+    public:
+        hash_multiset(shared_memory &mem) : __gnu_cxx::hash_multiset< K, H, E, persist::allocator<K> >(100, H(), E(), persist::allocator<K>(mem)) { }
     };
 
     template<class K, class V, class H = __gnu_cxx::hash<K>, class E=__gnu_cxx::equal_to<K> > 
     class hash_multimap : public __gnu_cxx::hash_multimap<K, V, H, E, persist::allocator<V> > 
     {
+    public:
+        hash_multimap(shared_memory &mem) : __gnu_cxx::hash_multimap<K, V, H, E, persist::allocator<V> >(100, H(), E(), persist::allocator<V>(mem)) { }
     };
 #endif
 
@@ -139,10 +168,10 @@ namespace persist
     template<class T, class A = persist::allocator<T> >
     class owner
     {
-        T *ptr;
+        offset_ptr<T> ptr;
 
     public:
-        owner() : ptr(0) { }
+        owner() : ptr(nullptr) { }
         owner(T *p) : ptr(p) { }
         owner(const owner<T,A>& o)
         {
@@ -324,10 +353,7 @@ namespace std
 
         size_t operator()(const key_type &s) const
         {
-            size_t h=0;
-            for(typename key_type::const_iterator x=s.begin(); x!=s.end(); ++x)
-                h = h*5 + *x;
-            return h;
+            return persist::hash_bytes(s.c_str(), s.size() * sizeof(T));
         }
 
         bool operator()(const key_type &s1, const key_type &s2)
@@ -347,10 +373,7 @@ namespace std
 
         size_t operator()(const key_type &s) const
         {
-            size_t h=0;
-            for(typename key_type::const_iterator x=s.begin(); x!=s.end(); ++x)
-                h = h*5 + *x;
-            return h;
+            return persist::hash_bytes(s.c_str(), s.size() * sizeof(C));
         }
 
         bool operator()(const key_type &s1, const key_type &s2)
@@ -370,10 +393,18 @@ namespace __gnu_cxx
     public:
         size_t operator()(const key_type &s) const
         {
-            size_t h=0;
-            for(typename key_type::const_iterator x=s.begin(); x!=s.end(); ++x)
-                h = h*5 + *x;
-            return h;
+            return persist::hash_bytes(s.c_str(), s.size() * sizeof(T));
+        }
+    };
+
+    template<int N, class C>
+    class hash<persist::fixed_string<N,C> >
+    {
+        typedef persist::fixed_string<N,C> key_type;
+    public:
+        size_t operator()(const key_type &s) const
+        {
+            return persist::hash_bytes(s.c_str(), s.size() * sizeof(C));
         }
     };
 }
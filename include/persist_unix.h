@@ -3,7 +3,7 @@
 //
 // Data stored specific to unix
 
-#include <mutex>
+#include <pthread.h>
 
 namespace persist
 {
@@ -11,11 +11,33 @@ namespace persist
 
     const size_t default_map_address = 0x188000000000ll;
 
+    // process_mutex
+    // A mutex stored in the heap, which works between processes.
+    class process_mutex
+    {
+    public:
+        process_mutex()
+        {
+            pthread_mutexattr_t attr;
+            pthread_mutexattr_init(&attr);
+            pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+            pthread_mutex_init(&mutex, &attr);
+            pthread_mutexattr_destroy(&attr);
+        }
+
+        process_mutex(const process_mutex&) = delete;
+
+        void lock() { pthread_mutex_lock(&mutex); }
+        void unlock() { pthread_mutex_unlock(&mutex); }
+
+    private:
+        pthread_mutex_t mutex;
+    };
+
     class shared_base   // unix version
     {
     public:
-        int fd;
-        std::mutex mem_mutex, user_mutex;
+        process_mutex mem_mutex, user_mutex;
         int mapFlags;
     };
 
@@ -3,8 +3,11 @@
 
 // This file is only included in win32 targets
 
+#include <mutex>
+
 namespace persist
 {
+    typedef std::mutex process_mutex;
     typedef unsigned __int64 offset_t;
     typedef unsigned page_t;
 
@@ -1,12 +1,20 @@
 // bench.cpp : Defines the entry point for the console application.
 //
 
+// Build with WITH_MYSQL=1 to compare with MySQL
+#if WITH_MYSQL
 typedef int SOCKET;
 #include <mysql/mysql.h>
+#endif
 #include <ctime>
+#include <cstring>
 
 #include "persist_stl.h"
+#include "persist_btree.h"
+#include "persist_hash.h"
+#include "persist_radix.h"
 #include <iostream>
+#include <fstream>
 #include <cassert>
 
 
@@ -14,18 +22,28 @@ typedef int SOCKET;
 
 namespace persist
 {
-struct AddressBook
+struct Person
 {
-    struct Person
-    {
-        // string address;
-        fixed_string<30> address;
-        fixed_string<14> telephone;
-    };
+    // string address;
+    fixed_string<30> address;
+    fixed_string<14> telephone;
+};
 
-    typedef map<fixed_string<20>, Person> Pmap;
+template<class Map>
+struct BasicAddressBook
+{
+    typedef persist::Person Person;
+    typedef Map Pmap;
     Pmap addresses;
+
+    BasicAddressBook(shared_memory &mem) : addresses(mem) { }
 };
+
+typedef BasicAddressBook<map<fixed_string<20>, Person>> AddressBook;
+typedef BasicAddressBook<hash_map<fixed_string<20>, Person>> HashAddressBook;
+typedef BasicAddressBook<flat_hash_map<fixed_string<20>, Person>> FlatAddressBook;
+typedef BasicAddressBook<btree_map<fixed_string<20>, Person>> BtreeAddressBook;
+typedef BasicAddressBook<radix_map<fixed_string<20>, Person>> RadixAddressBook;
 }
 
 namespace std
@@ -54,10 +72,19 @@ struct AddressBook
 using namespace std;
 using namespace persist;
 
+// Sizes a map that has reserve(), so that it does not leave the smaller tables
+// it grows out of in the heap
+template<class Map>
+auto reserve(Map &map, int num) -> decltype(map.reserve(num)) { map.reserve(num); }
+
+template<class Map>
+void reserve(Map &, long) { }
+
 template<class AddressBook>
 void create_persist(AddressBook &addresses, int num)
 {
     addresses.addresses.clear();
+    reserve(addresses.addresses, num);
 
     for(int i=0; i<num; ++i)
     {
@@ -134,6 +161,7 @@ void delete_persist(AddressBook &addresses)
 }
 
 
+#if WITH_MYSQL
 void create_mysql(MYSQL *mysql, int num)
 {
     mysql_query(mysql, "CREATE TABLE IF NOT EXISTS Addresses ( name varchar(255) primary key, address varchar(255), telephone char(15) );");
@@ -229,11 +257,56 @@ void delete_mysql(MYSQL*mysql, int num)
         mysql_query(mysql, query);
     }
 }
+#endif
+
+
+int ms(clock_t cd)
+{
+    return 1000ll*cd/CLOCKS_PER_SEC;
+}
 
+// The resident set size of this process in MB, or 0 if it is not known
+size_t rss()
+{
+    size_t size=0, resident=0;
+    std::ifstream("/proc/self/statm") >> size >> resident;
+    return resident * 4096 >> 20;
+}
 
-const int ms(int cd)
+// Runs the workload on a Book in the heap.
+// Returns the size of the heap once the book is created.
+template<class Book>
+size_t run_persist(shared_memory &mem, int n, time_t &t1, time_t &t2, time_t &t3, time_t &t4, time_t &t5)
 {
-    return 1000*cd/CLOCKS_PER_SEC;
+    map_data<Book> root(mem, mem);
+    t1 = clock();
+    create_persist(*root, n);
+    t2 = clock();
+    size_t heap_size = mem.size();
+    read_seq_persist(*root);
+    t3 = clock();
+    read_rand_persist(*root);
+    t4 = clock();
+    delete_persist(*root);
+    t5 = clock();
+    return heap_size;
+}
+
+// Scans a map created by create_persist, in a newly mapped heap.
+// Returns the resident set size at the end of the scan.
+size_t scan_persist(int budget, size_t &total)
+{
+    map_file file("bench.map", 0, 0, 0, 16384, 0x60000000);
+    map_data<persist::AddressBook> root(file.data(), file.data());
+    scan_guard guard(file.data(), budget ? budget : 1<<30);
+    total = 0;
+
+    for(auto &i : root->addresses)
+    {
+        if(budget) guard.visit(&i);
+        total += i.second.address.size();
+    }
+    return rss();
 }
 
 
@@ -241,37 +314,44 @@ int main(int argc, char **argv)
 {
     if(argc!=3)
     {
-        std::cout << "Usage: [ram|persist|mysql] <number>\n";
+        std::cout << "Usage: [ram|persist|persist-huge|persist-hash|persist-flat|persist-btree|persist-radix|persist-scan|mysql] <number>\n";
         return 1;
     }
 
     int n = atoi(argv[2]);
     time_t t0, t1, t2, t3, t4, t5;
+    size_t heap_size = 0;
 
-    if(strcmp(argv[1], "persist")==0)
+    if(strcmp(argv[1], "persist")==0 || strcmp(argv[1], "persist-huge")==0 ||
+        strcmp(argv[1], "persist-hash")==0 || strcmp(argv[1], "persist-flat")==0 || strcmp(argv[1], "persist-btree")==0 ||
+        strcmp(argv[1], "persist-radix")==0)
     {
+        // persist-huge uses a temporary heap, on hugetlbfs if the system has reserved huge pages.
+        // persist-hash, persist-flat, persist-btree and persist-radix store the book in a hash_map,
+        // a flat_hash_map, a btree_map and a radix_map instead of a map.
+        int flags = strcmp(argv[1], "persist-huge")==0 ? temp_heap|huge_pages : create_new;
+
         try
         {
         t0 = clock();
-        map_data<persist::AddressBook> root("bench.map", 0x10000000, 0, 0x60000000);
+        map_file file("bench.map", 0, 0, 0, 16384, 0x60000000, flags);
 
-        if(root)
-        {
-            t1 = clock();
-            create_persist(*root, n);
-            t2 = clock();
-            read_seq_persist(*root);
-            t3 = clock();
-            read_rand_persist(*root);
-            t4 = clock();
-            delete_persist(*root);
-            t5 = clock();
-        }
-        else
+        if(!file)
         {
             cout << "Failed to map file\n";
             return 2;
         }
+
+        if(strcmp(argv[1], "persist-hash")==0)
+            heap_size = run_persist<persist::HashAddressBook>(file.data(), n, t1, t2, t3, t4, t5);
+        else if(strcmp(argv[1], "persist-flat")==0)
+            heap_size = run_persist<persist::FlatAddressBook>(file.data(), n, t1, t2, t3, t4, t5);
+        else if(strcmp(argv[1], "persist-btree")==0)
+            heap_size = run_persist<persist::BtreeAddressBook>(file.data(), n, t1, t2, t3, t4, t5);
+        else if(strcmp(argv[1], "persist-radix")==0)
+            heap_size = run_persist<persist::RadixAddressBook>(file.data(), n, t1, t2, t3, t4, t5);
+        else
+            heap_size = run_persist<persist::AddressBook>(file.data(), n, t1, t2, t3, t4, t5);
         }
         catch(std::bad_alloc)
         {
@@ -279,6 +359,24 @@ int main(int argc, char **argv)
             return 3;
         }
     }
+    else if(strcmp(argv[1], "persist-scan")==0)
+    {
+        // Compares a plain scan with one using a scan_guard
+        {
+            map_file file("bench.map", 0, 0, 0, 16384, 0x60000000, create_new);
+            map_data<persist::AddressBook> root(file.data(), file.data());
+            create_persist(*root, n);
+        }
+
+        for(int budget : { 0, 16<<20 })
+        {
+            clock_t t = clock();
+            size_t total, size = scan_persist(budget, total);
+            cout << (budget ? "guarded" : "plain") << " scan " << n << ": scan=" << ms(clock()-t) << " rss=" << size << "MB bytes=" << total << "\n";
+        }
+        return 0;
+    }
+#if WITH_MYSQL
     else if(strcmp(argv[1], "mysql")==0)
     {
         t0 = clock();
@@ -299,6 +397,7 @@ int main(int argc, char **argv)
 
         mysql_close(&mysql);
     }
+#endif
     else if(strcmp(argv[1], "ram")==0)
     {
         t0 = clock();
@@ -322,7 +421,9 @@ int main(int argc, char **argv)
 
     cout << argv[1] << " " << n << ": setup=" << ms(t1-t0) << " create=" << ms(t2-t1) << 
         " seq_read=" << ms(t3-t2) << " rand_read=" << ms(t4-t3) << 
-        " delete=" << ms(t5-t4) << endl;
+        " delete=" << ms(t5-t4);
+    if(heap_size) cout << " heap=" << heap_size;
+    cout << endl;
 
 	return 0;
 }
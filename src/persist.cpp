@@ -5,184 +5,1392 @@
 #include "shared_data.h"
 
 #include <cassert>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 #include <iostream>  // Debug only
 
-using namespace persist;
+using namespace persist;
+
+// Whether to reuse freed memory (yes, you want to do this)
+#define RECYCLE 1 
+
+// Whether to report memory allocations and deallocations
+#define TRACE_ALLOCS 0
+
+// Whether to give each thread its own cache of small free blocks
+#define THREAD_CACHE RECYCLE
+
+
+// operator new
+//
+// Allocates space for one object in the shared memory
+
+void *operator new(size_t size, persist::shared_memory &file)
+{
+    void *p = file.malloc(size);
+
+    if(!p) throw std::bad_alloc();
+
+    return p;
+}
+
+
+// operator delete
+//
+// Matches operator new.  Not used.
+
+void operator delete(void *p, persist::shared_memory &file)
+{
+}
+
+
+
+namespace persist
+{
+    // slab
+    //
+    // Blocks up to max_slab_block bytes are allocated from slabs.  A slab is an aligned
+    // page that holds blocks of a single cell, and starts with this header.
+    // The bitmap has a bit set for each free block, so blocks in a slab are reused
+    // lowest address first, and we know when the whole slab is free again.
+    // A free slab can be reused for any cell in the same arena.
+    //
+    // Slabs are linked using their offsets from the start of the heap.
+
+    struct slab
+    {
+        std::uint16_t cell, block_size, capacity, free, arena;
+        size_t next, prev;
+        std::uint64_t bitmap[8];
+
+        char *block(int i) { return (char*)this + first_block + i*block_size; }
+        int index(void *block) const { return ((char*)block - (char*)this - first_block) / block_size; }
+
+        static const size_t size = 4096;
+        static const size_t first_block;
+    };
+
+    const size_t slab::first_block = (sizeof(slab) + 15) & ~15;
+
+
+    // large_block
+    //
+    // Blocks too big for a slab are managed as in TLSF ("two-level segregated fit").
+    // Each block has a one-word header with its size and flags, and a free block
+    // also has a footer with its size, so that neighbouring free blocks are merged.
+    // The top byte of the header is the arena that owns the block.
+    //
+    // Large blocks are carved from the top of the heap in chunks, and each chunk ends
+    // with a header of size 0.  The last chunk of an arena is extended in place when
+    // possible, and free space at the end of it is given back to the top of the heap.
+    //
+    // Free blocks are linked in lists by size, using their offsets from the start of the heap.
+    // The list for a size is found using the top bit of the size (the first level),
+    // and the 3 bits below it (the second level).  Bitmaps record which lists are non-empty.
+
+    struct large_block
+    {
+        size_t header;
+        size_t next, prev;  // Only in free blocks
+
+        static const size_t free_bit = 1, prev_free_bit = 2, flags = 7;
+        static const size_t min_size = 32;
+        static const int arena_shift = 56;
+        static const size_t size_mask = ((size_t(1) << arena_shift) - 1) & ~flags;
+
+        size_t size() const { return header & size_mask; }
+        int arena() const { return header >> arena_shift; }
+        size_t tag() const { return header & ~size_mask & ~free_bit; }   // The arena and prev_free_bit
+        bool is_free() const { return header & free_bit; }
+        bool prev_free() const { return header & prev_free_bit; }
+        bool is_end() const { return size() == 0; }
+
+        large_block *next_block() { return (large_block*)((char*)this + size()); }
+        large_block *prev_block() { return (large_block*)((char*)this - ((size_t*)this)[-1]); }
+        void set_footer() { ((size_t*)next_block())[-1] = size(); }
+
+        void *payload() { return &next; }
+        static large_block *of(void *payload) { return (large_block*)((char*)payload - sizeof(size_t)); }
+
+        // Rounds a requested size up to a block size
+        static size_t block_size(size_t size)
+        {
+            size = ((size+7) & ~7) + sizeof(size_t);
+            return size < min_size ? min_size : size;
+        }
+
+        // Finds the list for blocks of @size
+        static void list(size_t size, int &fl, int &sl)
+        {
+            fl = highest_bit(size);
+            sl = (size >> (fl-3)) & 7;
+        }
+
+        // Rounds @size up to the start of the next list, so that every block in
+        // that list is big enough
+        static size_t fit_size(size_t size)
+        {
+            size_t step = size_t(1) << (highest_bit(size) - 3);
+            return (size + step - 1) & ~(step - 1);
+        }
+    };
+}
+
+namespace
+{
+    const size_t max_slab_block = 512;
+
+    template<class T>
+    T *at(shared_memory *mem, size_t offset)
+    {
+        return (T*)((char*)mem + offset);
+    }
+
+    size_t offset(const shared_memory *mem, const void *p)
+    {
+        return (const char*)p - (const char*)mem;
+    }
+
+    slab *slab_of(void *block)
+    {
+        return (slab*)((std::uintptr_t)block & ~(slab::size-1));
+    }
+
+    const int max_slab_cell = object_cell(max_slab_block);
+}
+
+
+// grow_to
+//
+// Makes sure that the heap extends to @new_top.  Growing the heap takes mem_mutex.
+
+bool shared_memory::grow_to(char *new_top)
+{
+    if(new_top <= (char*)this + end) return true;
+
+    lockMem();
+    bool ok = new_top <= (char*)this + end || (max_size > current_size && extend_to(new_top));
+    unlockMem();
+
+    return ok;
+}
+
+
+// allocate_top
+//
+// Allocates @size bytes from the top of the heap, growing the heap if necessary.
+// The top is shared by all arenas and fast_malloc(), so it is only moved by compare-and-swap.
+
+void *shared_memory::allocate_top(size_t size)
+{
+    size_t t = top;
+
+    do
+    {
+        if(!grow_to((char*)this + t + size))
+            return nullptr;
+    }
+    while(!top.compare_exchange_weak(t, t + size));
+
+#if TRACE_ALLOCS
+    std::cout << " +" << (void*)((char*)this + t) << "(" << size << ")";
+#endif
+
+    return (char*)this + t;
+}
+
+
+// owner
+//
+// Returns the arena that allocated @block, of @cell.
+
+arena &shared_memory::owner(int cell, void *block)
+{
+    return arenas[cell <= max_slab_cell ? slab_of(block)->arena : large_block::of(block)->arena()];
+}
+
+
+// new_slab
+//
+// Starts a slab for @cell, reusing a free slab of the arena if there is one, and adds it to
+// the partial slabs of the cell.
+
+slab *shared_memory::new_slab(arena &a, int cell)
+{
+    slab *s;
+
+    if(a.empty_slabs)
+    {
+        s = at<slab>(this, a.empty_slabs);
+        a.empty_slabs = s->next;
+    }
+    else
+    {
+        // Slabs are aligned so that free() can find them from the block address.
+        // The gap before the slab goes to the large blocks if it is big enough.
+        size_t t = top;
+        char *start;
+
+        do
+        {
+            start = (char*)(((std::uintptr_t)this + t + slab::size-1) & ~(slab::size-1));
+            if(!grow_to(start + slab::size))
+                return nullptr;
+        }
+        while(!top.compare_exchange_weak(t, offset(this, start + slab::size)));
+
+        if(start > at<char>(this, t)) large_donate(a, at<char>(this, t), start - at<char>(this, t));
+
+        s = (slab*)start;
+    }
+
+    s->cell = cell;
+    s->arena = &a - arenas;
+    s->block_size = cell_size(cell);
+    s->capacity = s->free = (slab::size - slab::first_block) / s->block_size;
+
+    for(int w=0; w<8; ++w)
+    {
+        int bits = s->capacity - 64*w;
+        s->bitmap[w] = bits >= 64 ? ~0ull : bits <= 0 ? 0 : (1ull<<bits)-1;
+    }
+
+    s->prev = 0;
+    s->next = a.partial_slabs[cell];
+    if(s->next) at<slab>(this, s->next)->prev = offset(this, s);
+    a.partial_slabs[cell] = offset(this, s);
+
+    return s;
+}
+
+
+// slab_allocate
+//
+// Takes the lowest free block from the first partial slab for @cell.
+// There must be a partial slab.
+
+void *shared_memory::slab_allocate(arena &a, int cell)
+{
+    slab *s = at<slab>(this, a.partial_slabs[cell]);
+
+    int w=0;
+    while(!s->bitmap[w]) ++w;
+    int i = 64*w + lowest_bit(s->bitmap[w]);
+    s->bitmap[w] &= s->bitmap[w]-1;
+
+    if(--s->free == 0)
+    {
+        // The slab is full, so it is no longer partial
+        a.partial_slabs[cell] = s->next;
+        if(s->next) at<slab>(this, s->next)->prev = 0;
+    }
+
+    void *block = s->block(i);
+
+#if TRACE_ALLOCS
+    std::cout << " +" << block << "(" << s->block_size << ")";
+#endif
+
+    return block;
+}
+
+
+// slab_free
+//
+// Marks a block as free in its slab.  A slab that was full becomes partial, and
+// a slab that is now entirely free is moved to the empty slabs.
+
+void shared_memory::slab_free(arena &a, int cell, void *block)
+{
+    slab *s = slab_of(block);
+    assert(s->cell == cell && s->arena == &a - arenas);
+
+    int i = s->index(block);
+    auto bit = 1ull << (i&63);
+
+    // A block freed twice is left alone in release builds
+    assert(!(s->bitmap[i>>6] & bit));
+    if(s->bitmap[i>>6] & bit) return;
+
+    s->bitmap[i>>6] |= bit;
+    size_t o = offset(this, s);
+
+    if(++s->free == 1)
+    {
+        s->prev = 0;
+        s->next = a.partial_slabs[cell];
+        if(s->next) at<slab>(this, s->next)->prev = o;
+        a.partial_slabs[cell] = o;
+    }
+    else if(s->free == s->capacity)
+    {
+        if(s->prev) at<slab>(this, s->prev)->next = s->next;
+        else a.partial_slabs[cell] = s->next;
+        if(s->next) at<slab>(this, s->next)->prev = s->prev;
+
+        s->next = a.empty_slabs;
+        a.empty_slabs = o;
+    }
+}
+
+
+// Lock-free free lists
+//
+// In a heap created with the lock_free flag, small blocks are not kept in slabs or
+// thread caches.  Each cell has a Treiber stack of free blocks, and new blocks come
+// straight from the top of the heap, so processes never wait for each other.
+//
+// The head of a stack is the offset of its first block in the low bits, and a counter
+// in the high bits that changes on every pop, so that a pop whose head has been popped
+// and pushed again in the meantime (the "ABA problem") fails its compare-and-swap.
+// A free block holds the offset of the next block.
+
+namespace
+{
+    const int stack_offset_bits = 40;
+    const std::uint64_t stack_offset_mask = (std::uint64_t(1) << stack_offset_bits) - 1;
+
+    std::atomic<std::uint64_t> &link(void *block)
+    {
+        return *(std::atomic<std::uint64_t>*)block;
+    }
+}
+
+
+// stack_pop
+//
+// Takes a free block of @cell, or a new block from the top of the heap.
+
+void *shared_memory::stack_pop(int cell)
+{
+    auto &head = free_stacks[cell];
+    std::uint64_t h = head.load(std::memory_order_acquire);
+
+    while(h & stack_offset_mask)
+    {
+        void *block = at<void>(this, h & stack_offset_mask);
+
+        // The block may already have been taken, but it is still in the heap, and then the
+        // counter has changed and the compare-and-swap fails
+        std::uint64_t next = link(block).load(std::memory_order_relaxed);
+        std::uint64_t new_head = next | ((h & ~stack_offset_mask) + (std::uint64_t(1) << stack_offset_bits));
+
+        if(head.compare_exchange_weak(h, new_head, std::memory_order_acquire))
+        {
+            link(block).store(0, std::memory_order_relaxed);
+            return block;
+        }
+    }
+
+    return allocate_top(cell_size(cell));
+}
+
+
+// stack_push
+//
+// Adds @block to the free blocks of @cell.
+
+void shared_memory::stack_push(int cell, void *block)
+{
+    auto &head = free_stacks[cell];
+    std::uint64_t o = offset(this, block);
+    std::uint64_t h = head.load(std::memory_order_relaxed);
+
+    do
+    {
+        link(block).store(h & stack_offset_mask, std::memory_order_relaxed);
+    }
+    while(!head.compare_exchange_weak(h, o | (h & ~stack_offset_mask), std::memory_order_release));
+}
+
+
+// large_insert
+//
+// Adds a free block to the front of its free list.
+
+void shared_memory::large_insert(arena &a, large_block *block)
+{
+    int fl, sl;
+    large_block::list(block->size(), fl, sl);
+
+    size_t o = offset(this, block);
+    block->prev = 0;
+    block->next = a.large_free_lists[fl][sl];
+    if(block->next) at<large_block>(this, block->next)->prev = o;
+    a.large_free_lists[fl][sl] = o;
+
+    a.large_subbitmap[fl] |= 1 << sl;
+    a.large_bitmap |= 1ull << fl;
+}
+
+
+// large_remove
+//
+// Unlinks a free block from its free list.
+
+void shared_memory::large_remove(arena &a, large_block *block)
+{
+    int fl, sl;
+    large_block::list(block->size(), fl, sl);
+
+    if(block->next) at<large_block>(this, block->next)->prev = block->prev;
+
+    if(block->prev)
+        at<large_block>(this, block->prev)->next = block->next;
+    else if(!(a.large_free_lists[fl][sl] = block->next))
+    {
+        a.large_subbitmap[fl] &= ~(1 << sl);
+        if(!a.large_subbitmap[fl]) a.large_bitmap &= ~(1ull << fl);
+    }
+}
+
+
+// large_find
+//
+// Finds a free block of at least @size bytes, without removing it.
+// Searches from the first list where every block is big enough, so this is a good fit
+// in constant time.  Failing that, tries a few blocks in the list for @size itself.
+
+large_block *shared_memory::large_find(arena &a, size_t size)
+{
+    int fl, sl;
+    large_block::list(large_block::fit_size(size), fl, sl);
+
+    if(fl < arena::large_lists)
+    {
+        unsigned sub = a.large_subbitmap[fl] & (~0u << sl);
+        auto first = a.large_bitmap & (~0ull << (fl+1));
+
+        if(sub)
+            return at<large_block>(this, a.large_free_lists[fl][lowest_bit(sub)]);
+
+        if(first)
+        {
+            fl = lowest_bit(first);
+            return at<large_block>(this, a.large_free_lists[fl][lowest_bit(a.large_subbitmap[fl])]);
+        }
+    }
+
+    large_block::list(size, fl, sl);
+    if(fl >= arena::large_lists) return nullptr;
+
+    size_t o = a.large_free_lists[fl][sl];
+    for(int i=0; o && i<8; ++i)
+    {
+        auto block = at<large_block>(this, o);
+        if(block->size() >= size) return block;
+        o = block->next;
+    }
+
+    return nullptr;
+}
+
+
+// large_allocate
+//
+// Allocates a block with room for @size bytes, splitting a free block if it is
+// too big.  If @grow, the heap is extended when there is no free block big enough.
+
+void *shared_memory::large_allocate(arena &a, size_t size, bool grow)
+{
+    size = large_block::block_size(size);
+
+    // Merged blocks must still fit in the free lists
+    if(size >= size_t(1) << (arena::large_lists-1))
+        return nullptr;
+
+    large_block *block = large_find(a, size);
+
+    if(!block)
+    {
+        if(!grow || !large_grow(a, large_block::fit_size(size) + sizeof(size_t)) || !(block = large_find(a, size)))
+            return nullptr;
+    }
+
+    large_remove(a, block);
+
+    size_t rest = block->size() - size;
+
+    if(rest >= large_block::min_size)
+    {
+        // Split the block, and keep the remainder
+        block->header = size | block->tag();
+        auto remainder = block->next_block();
+        remainder->header = rest | large_block::free_bit | (block->tag() & ~large_block::prev_free_bit);
+        remainder->set_footer();
+        large_insert(a, remainder);
+    }
+    else
+    {
+        block->header &= ~large_block::free_bit;
+        block->next_block()->header &= ~large_block::prev_free_bit;
+    }
+
+#if TRACE_ALLOCS
+    std::cout << " +" << block->payload() << "(" << block->size() << ")";
+#endif
+
+    return block->payload();
+}
+
+
+// large_free
+//
+// Frees a block, merging it with free neighbours.  If @trim and the block is now
+// at the end of the heap, it is given back to the top of the heap.
+
+void shared_memory::large_free(arena &a, large_block *block, bool trim)
+{
+    size_t size = block->size();
+
+    auto next = block->next_block();
+    if(next->is_free())
+    {
+        large_remove(a, next);
+        size += next->size();
+    }
+
+    if(block->prev_free())
+    {
+        block = block->prev_block();
+        large_remove(a, block);
+        size += block->size();
+    }
+
+    block->header = size | large_block::free_bit | (block->tag() & ~large_block::prev_free_bit);
+    next = block->next_block();
+
+    if(trim && next->is_end() && offset(this, next) == a.large_end)
+    {
+        // The block is at the end of the heap, so lower the top unless something else has moved it
+        size_t old_top = offset(this, next) + sizeof(size_t);
+        size_t new_top = offset(this, block) + sizeof(size_t);
+
+        if(top.compare_exchange_strong(old_top, new_top))
+        {
+            block->header = 0;
+            a.large_end = offset(this, block);
+            return;
+        }
+    }
+
+    block->set_footer();
+    next->header |= large_block::prev_free_bit;
+    large_insert(a, block);
+}
+
+
+// large_grow
+//
+// Takes @bytes from the top of the heap as a free large block.  If the arena's last
+// chunk ended at the old top of the heap, it is extended, otherwise a new chunk is started.
+
+bool shared_memory::large_grow(arena &a, size_t bytes)
+{
+    if(bytes < large_block::min_size + sizeof(size_t))
+        return false;
+
+    char *p = (char*)allocate_top(bytes);
+    if(!p) return false;
+
+    auto last = a.large_end ? at<large_block>(this, a.large_end) : nullptr;
+
+    if(last && (char*)last + sizeof(size_t) == p)
+    {
+        last->header = bytes | last->tag() | size_t(&a - arenas) << large_block::arena_shift;
+        last->next_block()->header = 0;
+        a.large_end = offset(this, last->next_block());
+        large_free(a, last, false);
+    }
+    else
+    {
+        large_donate(a, p, bytes);
+        a.large_end = offset(this, p + bytes - sizeof(size_t));
+    }
+
+    return true;
+}
+
+
+// large_donate
+//
+// Adds @bytes at @p to the free large blocks of the arena, as a chunk of their own.
+// Space too small for a block is lost.
+
+void shared_memory::large_donate(arena &a, void *p, size_t bytes)
+{
+    if(bytes < large_block::min_size + sizeof(size_t))
+        return;
+
+    auto block = (large_block*)p;
+    block->header = (bytes - sizeof(size_t)) | size_t(&a - arenas) << large_block::arena_shift;
+    block->next_block()->header = 0;
+
+    large_free(a, block, false);
+}
+
+
+// allocate_root
+//
+// Allocates the first block in the heap, which is the root object.
+// It goes directly after the header, and has no slab or block header.
+
+void *shared_memory::allocate_root(size_t size)
+{
+    size_t r = offset(this, root());
+    size = (size+7) & ~7;
+
+    if(grow_to(at<char>(this, r + size)) && top.compare_exchange_strong(r, r + size))
+        return root();
+
+    return nullptr;
+}
+
+
+// allocate_block
+//
+// Takes a block of @cell from a slab, or from the large blocks, growing the heap if necessary.
+
+void *shared_memory::allocate_block(arena &a, int cell)
+{
+    if(cell <= max_slab_cell)
+    {
+        if(!a.partial_slabs[cell] && !new_slab(a, cell))
+            return nullptr;
+
+        return slab_allocate(a, cell);
+    }
+
+    return large_allocate(a, cell_size(cell), true);
+}
+
+
+// allocate_blocks
+//
+// Allocates up to @count blocks of the same cell into @blocks, returning the number allocated.
+// The heap only grows if there are no free blocks of this size.
+
+int shared_memory::allocate_blocks(arena &a, int cell, void **blocks, int count)
+{
+    int n = 0;
+
+    if(cell <= max_slab_cell)
+    {
+        while(n < count && a.partial_slabs[cell])
+            blocks[n++] = slab_allocate(a, cell);
+    }
+    else
+    {
+        size_t size = cell_size(cell);
+
+        while(n < count && (blocks[n] = large_allocate(a, size, false)))
+            ++n;
+
+        if(n == 0 && large_grow(a, large_block::fit_size(count * large_block::block_size(size)) + sizeof(size_t)))
+        {
+            while(n < count && (blocks[n] = large_allocate(a, size, false)))
+                ++n;
+        }
+    }
+
+    if(n == 0 && (blocks[0] = allocate_block(a, cell)))
+        n = 1;
 
-// Whether to reuse freed memory (yes, you want to do this)
-#define RECYCLE 1 
+    return n;
+}
 
-// Whether to report memory allocations and deallocations
-#define TRACE_ALLOCS 0
 
-// Whether to include extra debugging information (slightly slower, bigger heap)
-#define CHECK_MEM 0
+// free_block
+//
+// Returns the block to its slab, or to the large blocks.
+// @a must be the owner of the block.
+
+void shared_memory::free_block(arena &a, int cell, void *block)
+{
+#if RECYCLE   // Enable this to enable block to be reused
+    if(cell <= max_slab_cell)
+        slab_free(a, cell, block);
+    else
+        large_free(a, large_block::of(block), true);
+#endif
+}
 
 
-// operator new
+// clear_free_lists
 //
-// Allocates space for one object in the shared memory
+// Forgets all free blocks, for a new or cleared heap.
 
-void *operator new(size_t size, persist::shared_memory &file)
+void shared_memory::clear_free_lists()
 {
-    void *p = file.malloc(size);
+    for(auto &a : arenas)
+    {
+        for(int i=0; i<cell_count; ++i)
+            a.partial_slabs[i] = 0;
+        a.empty_slabs = 0;
 
-    if(!p) throw std::bad_alloc();
+        a.large_bitmap = 0;
+        for(int i=0; i<arena::large_lists; ++i)
+        {
+            a.large_subbitmap[i] = 0;
+            for(int j=0; j<arena::large_sublists; ++j)
+                a.large_free_lists[i][j] = 0;
+        }
+        a.large_end = 0;
+    }
 
-    return p;
+    for(auto &stack : free_stacks)
+        stack = 0;
 }
 
 
-// operator delete
-//
-// Matches operator new.  Not used.
+#if THREAD_CACHE
 
-void operator delete(void *p, persist::shared_memory &file)
+namespace persist
 {
+    // thread_cache
+    //
+    // Free blocks held privately by one thread for one heap, in a stack per cell.
+    // malloc and free only take the arena's mutex when a stack needs refilling or
+    // flushing, and then they move a whole batch of blocks at once.
+    //
+    // The cache allocates from one arena.  Freed blocks may belong to any arena, and
+    // are returned to their owners when the cache is flushed.
+    //
+    // The cache also holds a chunk claimed from the top of the heap, which
+    // fast_malloc allocates from without touching the shared top.
+    //
+    // The owning thread holds "busy" while it uses the cache.  Another thread only
+    // takes it to drain the cache, when the heap is cleared or closed.
+
+    class thread_cache
+    {
+    public:
+        enum { batch = 16, max_blocks = 2*batch };
+        enum { chunk_size = 65536, max_chunk_block = chunk_size/8 };
+
+        std::atomic<shared_memory*> heap { nullptr };
+        int arena_id = 0;
+
+        // The cache for @heap and arena @arena_id, or -1 for any arena.
+        static thread_cache &local(shared_memory *heap, int arena_id=-1);
+
+        void *malloc(shared_memory *mem, int cell);
+        void free(shared_memory *mem, int cell, void *block);
+        void *fast_malloc(shared_memory *mem, size_t size);
+
+        void acquire() { while(busy.exchange(true, std::memory_order_acquire)); }
+        void release() { busy.store(false, std::memory_order_release); }
+
+        void flush_all();
+        void discard();
+        void reset();
+
+    private:
+        std::atomic<bool> busy { false };
+
+        struct bin
+        {
+            void *head = nullptr;
+            int count = 0;
+        } bins[cell_count];
+
+        char *chunk = nullptr, *chunk_end = nullptr;
+
+        void refill(int cell);
+        void flush(int cell, int count);
+        void retire_chunk();
+    };
 }
 
+namespace
+{
+    // cache_registry
+    //
+    // All of the thread caches in the process, so that a heap can take back
+    // its blocks from every thread before it is cleared or unmapped.
+    // Lock order: a transaction, then the registry mutex, then thread_cache::busy, then an arena mutex,
+    // then mem_mutex.
+
+    struct cache_registry
+    {
+        std::mutex mutex;
+        std::vector<thread_cache*> caches;
+
+#ifndef _WIN32
+        cache_registry()
+        {
+            pthread_atfork(&prepare_fork, &parent_fork, &child_fork);
+        }
+
+        // The child process must not reuse blocks cached by the parent,
+        // because the parent may still allocate them.
+        static void prepare_fork();
+        static void parent_fork();
+        static void child_fork();
+#endif
+    };
+
+    cache_registry &registry()
+    {
+        static cache_registry r;
+        return r;
+    }
+
+#ifndef _WIN32
+    void cache_registry::prepare_fork()
+    {
+        registry().mutex.lock();
+    }
+
+    void cache_registry::parent_fork()
+    {
+        registry().mutex.unlock();
+    }
+
+    void cache_registry::child_fork()
+    {
+        for(auto cache : registry().caches)
+            cache->reset();
+        registry().mutex.unlock();
+    }
+#endif
+
+    // local_caches
+    //
+    // The caches owned by the current thread, one for each heap and arena it has used.
+    // When the thread exits, all cached blocks are returned to their heaps.  A heap with
+    // transactions is only written by the thread running a transaction, so the blocks
+    // are returned in a transaction of their own.
+
+    struct local_caches
+    {
+        std::vector<std::unique_ptr<thread_cache>> caches;
+        thread_cache *last = nullptr;
+
+        ~local_caches()
+        {
+            auto &r = registry();
+            for(auto &cache : caches)
+            {
+#ifndef _WIN32
+                auto heap = cache->heap.load(std::memory_order_relaxed);
+                bool tx = heap && heap->begin();
+#endif
+                {
+                    std::lock_guard<std::mutex> lock(r.mutex);
+                    cache->acquire();
+                    cache->flush_all();
+                    cache->release();
+                    r.caches.erase(std::find(r.caches.begin(), r.caches.end(), cache.get()));
+                }
+#ifndef _WIN32
+                if(tx) heap->commit();
+#endif
+            }
+        }
+    };
+
+    // The initial-exec model avoids a call to find the variable in a shared library.
+#if defined(__GNUC__) && !defined(_WIN32)
+    thread_local local_caches this_thread_caches __attribute__((tls_model("initial-exec")));
+#else
+    thread_local local_caches this_thread_caches;
+#endif
+}
 
 
-// object_cell
+// thread_cache::local
 //
-// "free_space" is a table of free blocks.  We round the size up using
-// object_cell() into 64 discrete sizes, 4, 6, 8, 12, 16, 24, 32 ...
+// Returns the current thread's cache for @heap and @arena_id, creating it if necessary.
+// If @arena_id is -1, any cache for the heap will do, otherwise a new cache takes the
+// next arena in turn.
+
+thread_cache &thread_cache::local(shared_memory *heap, int arena_id)
+{
+    auto &local = this_thread_caches;
+
+    if(local.last && local.last->heap.load(std::memory_order_relaxed) == heap &&
+       (arena_id < 0 || local.last->arena_id == arena_id))
+        return *local.last;
+
+    thread_cache *unused = nullptr;
+
+    for(auto &cache : local.caches)
+    {
+        auto h = cache->heap.load(std::memory_order_relaxed);
+        if(h == heap && (arena_id < 0 || cache->arena_id == arena_id)) return *(local.last = cache.get());
+        if(!h) unused = cache.get();
+    }
+
+    if(!unused)
+    {
+        local.caches.emplace_back(new thread_cache);
+        unused = local.caches.back().get();
+
+        auto &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.caches.push_back(unused);
+    }
+
+    unused->acquire();
+    unused->arena_id = arena_id >= 0 ? arena_id : heap->next_arena++ % arena_count;
+    unused->heap = heap;
+    unused->release();
+    return *(local.last = unused);
+}
+
+
+void *thread_cache::malloc(shared_memory *mem, int cell)
+{
+    acquire();
+
+    if(heap.load(std::memory_order_relaxed) != mem)
+    {
+        // The cache was drained by another thread in the meantime
+        release();
+        auto &a = mem->arenas[arena_id];
+        a.lock();
+        void *block = mem->allocate_block(a, cell);
+        a.unlock();
+        return block;
+    }
+
+    auto &b = bins[cell];
+
+    if(!b.head) refill(cell);
+
+    void *block = b.head;
+    if(block)
+    {
+        b.head = *(void**)block;
+        *(void**)block = nullptr;   // Blocks fresh from the top of the heap are zeroed
+        --b.count;
+    }
+
+    release();
+    return block;
+}
+
+
+void thread_cache::free(shared_memory *mem, int cell, void *block)
+{
+    acquire();
+
+    if(heap.load(std::memory_order_relaxed) != mem)
+    {
+        release();
+        auto &a = mem->owner(cell, block);
+        a.lock();
+        mem->free_block(a, cell, block);
+        a.unlock();
+        return;
+    }
+
+    auto &b = bins[cell];
+    *(void**)block = b.head;
+    b.head = block;
+
+    if(++b.count > max_blocks)
+        flush(cell, batch);
+
+    release();
+}
+
+
+// thread_cache::fast_malloc
 //
-// Returns the cell number, and also rounds req_size up to the cell size
+// Bump-allocates @size bytes, a multiple of 8, from the thread's chunk.  When the
+// chunk is used up, the rest of it is retired and a new chunk is claimed.
 
-inline int object_cell(size_t &req_size)
+void *thread_cache::fast_malloc(shared_memory *mem, size_t size)
 {
-    int cell=0;
-    size_t cell_size=sizeof(void*);
+    acquire();
 
-    // TODO: A more efficient way of extracting just the top two bits of a number
+    if(heap.load(std::memory_order_relaxed) != mem)
+    {
+        release();
+        return mem->allocate_top(size);
+    }
+
+    if(chunk_end - chunk < (std::ptrdiff_t)size)
+    {
+        retire_chunk();
+        chunk = (char*)mem->allocate_top(chunk_size);
+        chunk_end = chunk ? chunk + chunk_size : nullptr;
+    }
 
-    while(cell<64)  // NB that's just 32 bits!
+    void *block = nullptr;
+    if(chunk)
     {
-        size_t s0 = cell_size>>1;
+        block = chunk;
+        chunk += size;
+    }
+
+    release();
+
+    // The heap is nearly full, so don't waste the space in a chunk
+    return block ? block : mem->allocate_top(size);
+}
+
+
+// thread_cache::retire_chunk
+//
+// Gives back the unused end of the chunk.  If it is at the top of the heap,
+// the top is lowered, otherwise it becomes a free large block.
 
-        if(req_size <= cell_size) { req_size = cell_size; return cell; }
-        cell++;        
-        cell_size += s0; 
+void thread_cache::retire_chunk()
+{
+    if(chunk == chunk_end) return;
+
+    auto mem = heap.load(std::memory_order_relaxed);
+    size_t old_top = offset(mem, chunk_end);
 
-        if(req_size <= cell_size) { req_size = cell_size; return cell; }
-        cell++;
-        cell_size += s0;
+    if(!mem->top.compare_exchange_strong(old_top, offset(mem, chunk)))
+    {
+        auto &a = mem->arenas[arena_id];
+        a.lock();
+        mem->large_donate(a, chunk, chunk_end - chunk);
+        a.unlock();
     }
 
-    return 0;   // Failure
+    chunk = chunk_end = nullptr;
 }
 
 
-// map_file::malloc
+// thread_cache::refill
 //
-// Allocates an object of size @size from the shared memory
-// If possible, use a block in the free_space instead of growing the heap.
-// Mutexed, threadsafe - very important.
+// Fetches up to one batch of blocks for @cell.  The blocks are stacked in the
+// order they were allocated, so the lowest address is used first.
 
-void *shared_memory::malloc(size_t size)
+void thread_cache::refill(int cell)
 {
-    if(size==0) return top;  // A valid address?  TODO
+    auto mem = heap.load(std::memory_order_relaxed);
+    auto &b = bins[cell];
+    void *blocks[batch];
+
+    auto &a = mem->arenas[arena_id];
+    a.lock();
+    int count = mem->allocate_blocks(a, cell, blocks, batch);
+    a.unlock();
+
+    for(int i=count-1; i>=0; --i)
+    {
+        *(void**)blocks[i] = b.head;
+        b.head = blocks[i];
+    }
+    b.count += count;
+}
+
+
+// thread_cache::flush
+//
+// Returns @count blocks from the top of the stack for @cell to the heap.
+// Each block goes to its own arena, and an arena's mutex is held for as many
+// blocks in a row as it owns.
+
+void thread_cache::flush(int cell, int count)
+{
+    auto &b = bins[cell];
+    if(count > b.count) count = b.count;
+    if(count == 0) return;
+
+    b.count -= count;
+
+    auto mem = heap.load(std::memory_order_relaxed);
+    arena *locked = nullptr;
+    while(count--)
+    {
+        void *block = b.head;
+        b.head = *(void**)block;
+
+        auto &a = mem->owner(cell, block);
+        if(&a != locked)
+        {
+            if(locked) locked->unlock();
+            (locked = &a)->lock();
+        }
+        mem->free_block(a, cell, block);
+    }
+    locked->unlock();
+}
 
-    lockMem();
-    
-    int free_cell = object_cell(size);
 
-#if RECYCLE   
-    if(free_space[free_cell])
+// thread_cache::flush_all
+//
+// Returns all cached blocks to the heap, and detaches the cache from the heap.
+// The caller holds "busy".
+
+void thread_cache::flush_all()
+{
+    if(heap.load(std::memory_order_relaxed))
     {
-        // We have a free cell of the desired size
+        for(int cell=0; cell<cell_count; ++cell)
+            flush(cell, bins[cell].count);
+        retire_chunk();
+    }
+    heap = nullptr;
+}
+
+
+// thread_cache::discard
+//
+// Forgets all cached blocks, for when the heap has been cleared.
+// The caller holds "busy".
+
+void thread_cache::discard()
+{
+    for(auto &b : bins)
+        b.head = nullptr, b.count = 0;
+    chunk = chunk_end = nullptr;
+    heap = nullptr;
+}
+
 
-        void *block = free_space[free_cell];
-        free_space[free_cell] = *(void**)block;
+// thread_cache::reset
+//
+// Forgets everything, including who holds the cache.  Only used in a forked
+// child, where the other threads no longer exist.
+
+void thread_cache::reset()
+{
+    discard();
+    release();
+}
 
-#if CHECK_MEM
-        ((int*)block)[-1] = size;
 #endif
 
-#if TRACE_ALLOCS
-        std::cout << " +" << block << "(" << size << ")";
+
+// shared_memory::drain_caches
+//
+// Detaches every thread's cache from this heap.  If @keep_blocks, the cached
+// blocks are returned to the heap, otherwise they are forgotten.
+
+void shared_memory::drain_caches(bool keep_blocks)
+{
+#if THREAD_CACHE
+    auto &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    for(auto cache : r.caches)
+    {
+        if(cache->heap.load(std::memory_order_relaxed) != this) continue;
+
+        cache->acquire();
+        if(cache->heap.load(std::memory_order_relaxed) == this)
+        {
+            if(keep_blocks)
+                cache->flush_all();
+            else
+                cache->discard();
+        }
+        cache->release();
+    }
 #endif
+}
 
-        unlockMem();
-        return block;
+
+// shared_memory::discard_thread_caches
+//
+// Forgets the blocks in the current thread's caches for this heap, when a transaction
+// that used them has been aborted.
+
+void shared_memory::discard_thread_caches()
+{
+#if THREAD_CACHE
+    for(auto &cache : this_thread_caches.caches)
+    {
+        cache->acquire();
+        if(cache->heap.load(std::memory_order_relaxed) == this)
+            cache->discard();
+        cache->release();
     }
 #endif
+}
+
+
+// shared_memory::allocating
+//
+// Calls enter_allocator() and leave_allocator() around an allocation, only on a heap
+// with transactions.
+
+struct shared_memory::allocating
+{
+    shared_memory *mem;
+
+    allocating(shared_memory *heap) : mem(heap->heap_flags & transactions ? heap : nullptr)
+    {
+        if(mem) mem->enter_allocator();
+    }
+
+    ~allocating()
+    {
+        if(mem) mem->leave_allocator();
+    }
+};
+
+
+// arena_for
+//
+// Returns arena @arena_id, or the current thread's arena if it is -1.
+
+arena &shared_memory::arena_for(int arena_id)
+{
+    if(arena_id >= 0)
+        return arenas[arena_id % arena_count];
 
-#if CHECK_MEM
-    *(int*)map_address->top = size;
-    map_address->top += sizeof(int);
+#if THREAD_CACHE
+    return arenas[thread_cache::local(this).arena_id];
+#else
+    return arenas[next_arena++ % arena_count];
 #endif
+}
 
-    void *t = top;
-        
-    auto new_top = top + size;
 
-    if(new_top > end)
+// map_file::malloc
+//
+// Allocates an object of size @size from the shared memory
+// If possible, use a free block instead of growing the heap.
+// Small blocks are rounded up to a cell, and come from the thread's cache, which
+// only needs the memory mutex to exchange a batch of blocks with the heap.
+// Threadsafe - very important.
+
+void *shared_memory::malloc(size_t size, int arena_id)
+{
+    if(size==0) return at<char>(this, top);  // A valid address?  TODO
+
+    if(size <= max_cell_size)
+        return malloc_cell(object_cell(size), arena_id);
+
+    allocating guard(this);
+    if(empty())
     {
-        if(max_size <= current_size || !extend_to(new_top))
-        {
-            unlockMem();
-            return nullptr;
-        }
+        if(void *block = allocate_root(size)) return block;
     }
 
-    top = new_top;
+    auto &a = arena_for(arena_id);
+    a.lock();
+    void *block = large_allocate(a, size, true);
+    a.unlock();
 
-#if TRACE_ALLOCS
-    std::cout << " +" << t << "(" << size << ")";
+    return block;
+}
+
+
+void *shared_memory::malloc_cell(int cell, int arena_id)
+{
+    allocating guard(this);
+    if(empty())
+    {
+        if(void *block = allocate_root(cell_size(cell))) return block;
+    }
+
+    if(heap_flags & lock_free)
+        return stack_pop(cell);
+
+#if THREAD_CACHE
+    return thread_cache::local(this, arena_id < 0 ? -1 : arena_id % arena_count).malloc(this, cell);
+#else
+    auto &a = arena_for(arena_id);
+    a.lock();
+    void *block = allocate_block(a, cell);
+    a.unlock();
+    return block;
 #endif
+}
 
-    unlockMem();
-    return t;
+
+// map_file::fast_malloc
+//
+// Allocates @size bytes that are never freed, from the current thread's chunk,
+// so that threads only contend for the top of the heap once per chunk.
+
+void *shared_memory::fast_malloc(size_t size)
+{
+    size = (size+7) & ~7;
+    allocating guard(this);
+
+#if THREAD_CACHE
+    if(size <= thread_cache::max_chunk_block)
+        return thread_cache::local(this).fast_malloc(this, size);
+#endif
+
+    return allocate_top(size);
 }
 
 
 // map_file::free
 //
 // Marks the given memory block as "free"
-// Free blocks are stored in a linked list, starting at the vector free_cell.
-// The minimum allocation size is 4 bytes to accomodate the pointer
+// Small blocks go back to their slab, larger blocks are merged with their free
+// neighbours.  Small blocks may be held in the thread's cache first.
 
 void shared_memory::free(void* block, size_t size)
 {
-    lockMem();
-
 #if TRACE_ALLOCS
     std::cout << " -" << block << "(" << size << ")";
 #endif
     if(size==0) return;  // Do nothing    
 
-    if(block < this || block >= end)
+    if(size <= max_cell_size)
+    {
+        free_cell(block, object_cell(size));
+        return;
+    }
+
+    if(block < this || block >= at<char>(this, end))
     {
         // We have attempted to "free" data not allocated by this memory manager
         // This is a serious fault, but we carry on
 
         std::cout << "Block out of range!\n";  // This is a serious error!
-
-        // This happens in basic_string...
-        unlockMem();
         return;
     }
 
-    assert(block>=this && block<end);
-        // This means that the address is not managed by this heap!
+#if RECYCLE
+    // The root object has no block header, and is not reused
+    if(block == root()) return;
 
-#if CHECK_MEM
-        assert(((int*)block)[-1] == size);
-        ((int*)block)[-1] = 0;  // This is now DEAD!
+    allocating guard(this);
+    auto &a = arenas[large_block::of(block)->arena()];
+    a.lock();
+    large_free(a, large_block::of(block), true);
+    a.unlock();
 #endif
+}
 
-#if RECYCLE   // Enable this to enable block to be reused
-    int free_cell = object_cell(size);
-    // free_cell is the cell number for blocks of size "size"
 
-    // Add the free block to the linked list in free_space
-    *(void**)block = free_space[free_cell];
-    free_space[free_cell] = block;
-#endif
+void shared_memory::free_cell(void *block, int cell)
+{
+    if(block < this || block >= at<char>(this, end))
+    {
+        std::cout << "Block out of range!\n";  // This is a serious error!
 
-    unlockMem();
+        // This happens in basic_string...
+        return;
+    }
+
+    // The root object has no slab or block header, and is not reused
+    if(block == root()) return;
+
+    allocating guard(this);
+    if(heap_flags & lock_free)
+    {
+        stack_push(cell, block);
+        return;
+    }
+
+#if THREAD_CACHE
+    thread_cache::local(this).free(this, cell, block);
+#else
+    auto &a = owner(cell, block);
+    a.lock();
+    free_block(a, cell, block);
+    a.unlock();
+#endif
 }
 
 // map_file::root
@@ -207,7 +1415,7 @@ const void *shared_memory::root() const
 
 bool shared_memory::empty() const
 {
-    return root() == top;  // No objects allocated
+    return (const char*)root() == (const char*)this + top;  // No objects allocated
 }
 
 shared_memory & map_file::data() const
@@ -217,9 +1425,10 @@ shared_memory & map_file::data() const
 
 void shared_memory::clear()
 {
-    top = (char*)root();
-    for(int i=0; i<64; ++i)
-        free_space[i] = nullptr;
+    allocating guard(this);
+    drain_caches(false);
+    top = offset(this, root());
+    clear_free_lists();
 }
 
 size_t shared_memory::capacity() const
@@ -229,7 +1438,7 @@ size_t shared_memory::capacity() const
 
 size_t shared_memory::size() const
 {
-    return top-(char*)root();
+    return top - offset(this, root());
 }
 
 size_t shared_memory::limit() const
@@ -242,6 +1451,12 @@ void shared_memory::limit(size_t size)
     max_size = size;
 }
 
+void shared_memory::growth(growth_policy policy, size_t amount)
+{
+    growth_mode = policy;
+    growth_amount = amount;
+}
+
 InvalidVersion::InvalidVersion() : std::runtime_error("Version number mismatch")
 {
 }
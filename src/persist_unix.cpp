@@ -1,264 +1,2386 @@
 
 #include "persist.h"
 #include "shared_data.h"
+#include "persist_hash.h"
 
 #include <iostream>  // tmp
 using namespace std; // tmp
 
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <future>
+#include <condition_variable>
+#include <sys/file.h>
+#include <sched.h>
 
 using namespace persist;
 
 
+namespace
+{
+    // local_mapping
+    //
+    // What this process knows about a heap that it has mapped.  This is not in
+    // the header, because each process has its own file descriptor and addresses.
+    //
+    // The whole limit() of the heap is reserved as inaccessible address space when the
+    // heap is mapped, so that the heap can grow in place by mapping the new pages over the
+    // reservation, while other threads continue to use the heap.
+    //
+    // When another process grows the heap, this process maps the new pages when it
+    // next accesses them (see on_fault), or when it grows the heap itself.
+    //
+    // The mappings are in a fixed table, so that the fault handler can search it.
+
+    struct local_mapping
+    {
+        std::atomic<shared_memory*> heap;
+        int fd, mapFlags;
+        size_t reserved, mapped;    // Bytes of address space from the start of the heap
+        unsigned generation;        // The generation of the heap that has been mapped
+        bool huge;                  // Advise the kernel to use huge pages
+        std::atomic<bool> busy;     // Held while changing the mapping
+
+        // With the working_set flag, the file that records the pages in memory, and
+        // the thread that reads them ahead.
+        std::string pages_file;
+        std::thread prefetcher;
+        std::atomic<bool> stop_prefetch;
+
+        // With the track_changes flag, one bit for each granule of the heap that has
+        // been written since the last checkpoint, see track_write.
+        std::unique_ptr<std::atomic<std::uint64_t>[]> dirty;
+        size_t granules;
+        int granule_shift;
+
+        // Likewise, the granules written since the last backup and the last batch shipped
+        // to a replica, see select_changes.  The first of each is full, and so is the next
+        // after one fails.
+        std::unique_ptr<std::atomic<std::uint64_t>[]> changed, unshipped;
+        bool backup_full, ship_full;
+
+        // The numbers of the last batch shipped, and applied to a replica
+        std::uint64_t shipped, applied;
+
+        // With the transactions flag, the redo log and the state of each page of the heap,
+        // see capture_write.  The tables are allocated with mmap, so that map_to can grow
+        // them with the heap, even in on_fault.
+        int log_fd;
+        std::uint64_t log_epoch;    // As in log_header
+        off_t log_end;              // Where the next group is written
+        off_t log_length;           // The log file is written up to here
+        bool log_locked;            // This process holds the flock on the log
+        std::mutex tx_mutex;        // Held while a transaction runs
+        std::atomic<bool> tx_active;
+        pthread_t tx_thread;        // The thread running the transaction
+        std::atomic<int> allocating;    // Threads in malloc() or free() outside the transaction
+        size_t tracked;             // Pages in the tables
+        std::uint8_t *page_state;
+        size_t *tx_pages, tx_count;             // The pages in the undo images
+        size_t *unsaved_pages, unsaved_count;   // The pages to capture when committing
+        size_t *private_pages, private_count;   // The pages copied from the file
+        char *undo;                 // An image of each page before the transaction wrote it
+
+        // Group commit, see write_groups
+        std::mutex sync_mutex;
+        std::condition_variable synced_cv;
+        std::vector<char> group, writing;   // The open group, and the one being written
+        size_t group_pages;
+        std::uint64_t group_id, written;    // The id of the open group, and the groups before it are written
+        std::vector<std::uint64_t> failed;  // The ids of recent groups that could not be written
+        bool leading, executing;
+        bool keep_private;          // A group could not be written to the heap file
+
+        // While a snapshot is written, the file, and the pages that have been claimed
+        // and copied, see snapshot_copy.  A backup only holds the selected pages, see
+        // snapshot_position.
+        int snapshot_fd;
+        size_t snapshot_pages;
+        std::unique_ptr<std::atomic<std::uint64_t>[]> snapshot_claimed, snapshot_copied;
+        std::vector<std::uint64_t> snapshot_selected;
+        std::vector<std::uint32_t> snapshot_rank;
+        off_t snapshot_start;
+        std::thread snapshotter;
+
+        void acquire() { while(busy.exchange(true, std::memory_order_acquire)); }
+        void release() { busy.store(false, std::memory_order_release); }
+    };
+
+    const int max_mappings = 256;
+    local_mapping mappings[max_mappings];
+
+    local_mapping *mapping_of(const shared_memory *mem)
+    {
+        for(auto &m : mappings)
+            if(m.heap.load(std::memory_order_acquire) == mem) return &m;
+        return nullptr;
+    }
+
+    local_mapping *new_mapping(shared_memory *mem)
+    {
+        for(auto &m : mappings)
+        {
+            shared_memory *unused = nullptr;
+            if(m.heap.compare_exchange_strong(unused, mem)) return &m;
+        }
+        return nullptr;
+    }
+
+    size_t round_up(size_t length, size_t size)
+    {
+        return (length + size - 1) & ~(size - 1);
+    }
+
+    size_t page_size()
+    {
+        static const size_t size = sysconf(_SC_PAGESIZE);
+        return size;
+    }
+
+    size_t round_to_page(size_t length)
+    {
+        return round_up(length, page_size());
+    }
+
+    // Heaps with the huge_pages flag are always a multiple of this size
+    const size_t huge_page_size = 2<<20;
+
+    // huge_temp_file
+    //
+    // Returns an anonymous file of @length bytes on hugetlbfs, or -1.  This only works if
+    // the system has reserved enough huge pages, so check that the file can be mapped.
+
+    int huge_temp_file(size_t length)
+    {
+#ifdef MFD_HUGETLB
+        int fd = memfd_create("persist", MFD_HUGETLB);
+        if(fd == -1) return -1;
+
+        void *p = ftruncate(fd, length) == 0 ? mmap(nullptr, length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if(p != MAP_FAILED)
+        {
+            munmap(p, length);
+            return fd;
+        }
+        ::close(fd);
+#endif
+        return -1;
+    }
+
+    // size_file
+    //
+    // Makes the file at least @length bytes long.  If @allocate, the disk space is
+    // allocated now, otherwise the file may be sparse.
+
+    bool size_file(int fd, size_t length, bool allocate)
+    {
+        struct stat st;
+        if(fstat(fd, &st) == 0 && (size_t)st.st_size >= length) return true;
+
+        if(allocate)
+            return posix_fallocate(fd, 0, length) == 0;
+
+        char c=0;
+        return lseek(fd, length-1, SEEK_SET) != -1 && write(fd, &c, 1) == 1;
+    }
+
+    // reserve
+    //
+    // Reserves the address space after the heap up to @length bytes from its start.
+    // The addresses are only reserved if nothing else is using them.
+
+    bool reserve(const shared_memory *mem, local_mapping &m, size_t length)
+    {
+        length = round_to_page(length);
+        if(length <= m.reserved) return true;
+
+        char *start = (char*)mem + m.reserved;
+        void *p = mmap(start, length - m.reserved, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+
+        if(p == MAP_FAILED) return false;
+
+        if(p != start)
+        {
+            munmap(p, length - m.reserved);
+            return false;
+        }
+
+        m.reserved = length;
+        return true;
+    }
+
+    // reserve_anywhere
+    //
+    // Reserves @length bytes of address space aligned to @align, at @hint if it is free.
+
+    char *reserve_anywhere(size_t hint, size_t length, size_t align)
+    {
+        size_t extra = align - page_size();
+        char *p = (char*)mmap((void*)hint, length + extra, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if(p == MAP_FAILED) return nullptr;
+
+        char *start = (char*)round_up((size_t)p, align);
+        if(start > p) munmap(p, start - p);
+        if(p + extra > start) munmap(start + length, p + extra - start);
+        return start;
+    }
+
+    // grow_table
+    //
+    // Grows a table allocated with mmap from @old_count to @count entries, keeping its
+    // contents.  The new entries are zero, and are only given memory when they are used.
+
+    template<typename T>
+    bool grow_table(T *&table, size_t old_count, size_t count)
+    {
+        size_t old_length = round_to_page(old_count * sizeof(T)), length = round_to_page(count * sizeof(T));
+        if(length <= old_length) return true;
+
+        void *p = table ? mremap(table, old_length, length, MREMAP_MAYMOVE) :
+            mmap(nullptr, length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if(p == MAP_FAILED) return false;
+        table = (T*)p;
+        return true;
+    }
+
+    template<typename T>
+    void free_table(T *&table, size_t count)
+    {
+        if(table) munmap(table, round_to_page(count * sizeof(T)));
+        table = nullptr;
+    }
+
+    // track_pages
+    //
+    // Grows the tables of a transactional heap to cover its first @length bytes.
+
+    bool track_pages(local_mapping &m, size_t length)
+    {
+        size_t pages = length / page_size();
+        if(m.log_fd == -1 || pages <= m.tracked) return true;
+
+        bool ok = grow_table(m.page_state, m.tracked, pages) && grow_table(m.tx_pages, m.tracked, pages) &&
+            grow_table(m.unsaved_pages, m.tracked, pages) && grow_table(m.private_pages, m.tracked, pages) &&
+            grow_table(m.undo, m.tracked * page_size(), pages * page_size());
+        if(ok) m.tracked = pages;
+        return ok;
+    }
+
+    // map_to
+    //
+    // Maps the file up to @length bytes from the start of the heap, over the reservation.
+    // The caller holds m.busy.
+
+    bool map_to(const shared_memory *mem, local_mapping &m, size_t length)
+    {
+        length = round_to_page(length);
+        if(length <= m.mapped) return true;
+
+        // limit() may have been raised since the heap was mapped
+        if(!reserve(mem, m, length)) return false;
+
+        // When tracking changes, new pages are protected like the rest of the heap
+        char *start = (char*)mem + m.mapped;
+        int prot = m.dirty || m.log_fd != -1 ? PROT_READ : PROT_WRITE|PROT_READ;
+        if(!track_pages(m, length)) return false;
+        char *p = (char*)mmap(start, length - m.mapped, prot, m.mapFlags, m.fd, m.mapped);
+        if(p == MAP_FAILED) return false;
+        assert(p == start);
+
+        // The advice is lost when the reservation is replaced, so it is given for each new mapping
+        if(m.huge) madvise(start, length - m.mapped, MADV_HUGEPAGE);
+
+        m.mapped = length;
+        return true;
+    }
+
+    // resident_pages
+    //
+    // Returns one byte for each page of @length bytes from @start, whose bottom bit
+    // is set if the page is in memory.
+
+    std::vector<unsigned char> resident_pages(const void *start, size_t length)
+    {
+        std::vector<unsigned char> pages(round_to_page(length) / page_size());
+        if(mincore((void*)start, length, pages.data()) != 0) pages.clear();
+        return pages;
+    }
+
+    // Working set
+    //
+    // With the working_set flag, the pages of the heap that are in memory when it is
+    // closed are recorded in a file next to the heap, one bit per page.  When the heap
+    // is next opened, a thread reads those pages ahead in address order, which is much
+    // faster than faulting them in at random.
+
+    const int working_set_magic = 0x77736574;
+
+    struct working_set_header
+    {
+        int magic;
+        unsigned page_size;
+        size_t pages;
+    };
+
+    void record_working_set(const shared_memory *mem, const local_mapping &m)
+    {
+        auto pages = resident_pages(mem, m.mapped);
+        std::vector<unsigned char> bits((pages.size() + 7) / 8);
+        for(size_t p=0; p<pages.size(); ++p)
+            if(pages[p] & 1) bits[p/8] |= 1 << p%8;
+
+        working_set_header header = { working_set_magic, (unsigned)page_size(), pages.size() };
+
+        // Write a new file, so that a process reading the old one is not affected
+        std::string temp = m.pages_file + ".tmp";
+        FILE *file = fopen(temp.c_str(), "wb");
+        if(!file) return;
+        bool ok = fwrite(&header, sizeof header, 1, file) == 1 && fwrite(bits.data(), 1, bits.size(), file) == bits.size();
+        ok = fclose(file) == 0 && ok;
+        if(!ok || rename(temp.c_str(), m.pages_file.c_str()) != 0)
+            remove(temp.c_str());
+    }
+
+    // prefetch_working_set
+    //
+    // Runs on its own thread, until the pages are read or the heap is closed.
+
+    void prefetch_working_set(local_mapping *m, char *heap, size_t length)
+    {
+        FILE *file = fopen(m->pages_file.c_str(), "rb");
+        if(!file) return;
+
+        working_set_header header;
+        std::vector<unsigned char> bits;
+        if(fread(&header, sizeof header, 1, file) == 1 && header.magic == working_set_magic && header.page_size == page_size())
+        {
+            header.pages = std::min(header.pages, length / page_size());
+            bits.resize((header.pages + 7) / 8);
+            if(fread(bits.data(), 1, bits.size(), file) != bits.size()) bits.clear();
+        }
+        fclose(file);
+
+        size_t pages = std::min(header.pages, bits.size() * 8);
+        auto in_set = [&](size_t p) { return (bits[p/8] >> p%8) & 1; };
+
+        for(size_t p=0; p<pages && !m->stop_prefetch; ++p)
+        {
+            if(!in_set(p)) continue;
+
+            size_t start = p;
+            while(p < pages && in_set(p)) ++p;
+            madvise(heap + start * page_size(), (p - start) * page_size(), MADV_WILLNEED);
+        }
+    }
+
+    // Change tracking
+    //
+    // With the track_changes flag, the heap is divided into at most max_granules granules, which
+    // are write-protected except for the first, which holds the header and is always written.
+    // The first write to a granule faults, and on_fault marks it as dirty and makes it writable.
+    // checkpoint() protects the dirty granules again before writing them to disk, so that a write
+    // made during the checkpoint is either written by it, or faults and is marked for the next one.
+
+    const size_t max_granules = 8192;
+
+    void start_tracking(const shared_memory *mem, local_mapping &m, size_t limit)
+    {
+        m.granule_shift = m.huge ? 21 : 16;
+        while((size_t(1) << m.granule_shift) * max_granules < limit) ++m.granule_shift;
+
+        m.granules = (limit >> m.granule_shift) + 1;
+        m.dirty.reset(new std::atomic<std::uint64_t>[(m.granules + 63) / 64]());
+        m.changed.reset(new std::atomic<std::uint64_t>[(m.granules + 63) / 64]());
+        m.unshipped.reset(new std::atomic<std::uint64_t>[(m.granules + 63) / 64]());
+
+        size_t first = std::min(size_t(1) << m.granule_shift, m.mapped);
+        mprotect((char*)mem + first, m.mapped - first, PROT_READ);
+    }
+
+    // The addresses of @granule.  The last granule extends to the end of the heap,
+    // in case limit() has been raised.
+    std::pair<char*, size_t> granule_range(const shared_memory *mem, const local_mapping &m, size_t granule)
+    {
+        size_t start = granule << m.granule_shift;
+        size_t end = granule+1 == m.granules ? m.mapped : std::min(start + (size_t(1) << m.granule_shift), m.mapped);
+        return { (char*)mem + start, end > start ? end - start : 0 };
+    }
+
+    void mark_dirty(local_mapping &m, size_t granule)
+    {
+        m.dirty[granule/64].fetch_or(std::uint64_t(1) << granule%64);
+    }
+
+    // track_write
+    //
+    // Called from on_fault for a write to a protected granule.  m.busy is held so that
+    // take_changes cannot protect the granule again between marking it and unprotecting it.
+    // None of the code that holds m.busy writes to the heap, so this cannot deadlock.
+
+    void track_write(const shared_memory *mem, local_mapping &m, char *address)
+    {
+        size_t granule = std::min<size_t>((address - (char*)mem) >> m.granule_shift, m.granules-1);
+        m.acquire();
+        mark_dirty(m, granule);
+        m.changed[granule/64].fetch_or(std::uint64_t(1) << granule%64);
+        m.unshipped[granule/64].fetch_or(std::uint64_t(1) << granule%64);
+        auto range = granule_range(mem, m, granule);
+        mprotect(range.first, range.second, PROT_READ|PROT_WRITE);
+        m.release();
+    }
+
+    typedef std::vector<std::pair<char*, size_t>> ranges;
+
+    // take_changes
+    //
+    // Returns the parts of the heap to write to disk, and protects them again.
+    // Adjacent granules are joined into one range.
+
+    ranges take_changes(const shared_memory *mem, local_mapping &m)
+    {
+        m.acquire();
+        ranges changes;
+
+        if(!m.dirty)
+            changes.push_back({ (char*)mem, m.mapped });
+        else
+        {
+            changes.push_back(granule_range(mem, m, 0));
+
+            for(size_t w=0; w < (m.granules + 63) / 64; ++w)
+            {
+                auto bits = m.dirty[w].exchange(0);
+                for(; bits; bits &= bits-1)
+                {
+                    auto range = granule_range(mem, m, w*64 + __builtin_ctzll(bits));
+                    if(!range.second) continue;
+                    mprotect(range.first, range.second, PROT_READ);
+
+                    if(changes.back().first + changes.back().second == range.first)
+                        changes.back().second += range.second;
+                    else
+                        changes.push_back(range);
+                }
+            }
+        }
+
+        m.release();
+        return changes;
+    }
+
+    // write_changes
+    //
+    // Writes the ranges to disk.  If this fails, they are marked as dirty again,
+    // to be retried by the next checkpoint.
+
+    bool write_changes(const shared_memory *mem, local_mapping *m, const ranges &changes)
+    {
+        bool ok = true;
+        for(auto &range : changes)
+        {
+            if(msync(range.first, range.second, MS_SYNC) == 0) continue;
+
+            ok = false;
+            if(m->dirty)
+                for(size_t offset = 0; offset < range.second; offset += size_t(1) << m->granule_shift)
+                    mark_dirty(*m, std::min<size_t>((range.first + offset - (char*)mem) >> m->granule_shift, m->granules-1));
+        }
+        return ok;
+    }
+
+    // Transactions
+    //
+    // A transactional heap is mapped privately and write-protected, so its pages only reach
+    // the file when a transaction commits.  During a transaction, the first write to each page
+    // faults, and on_fault copies the page to an undo image in memory before making it
+    // writable.  Aborting copies the images back.  Committing copies the pages that have been
+    // written, whether in the transaction or outside one, into the open group, and protects
+    // them again.
+    //
+    // The log is filename.log.  It starts with a log_header, followed by groups.  Each group is
+    // a group_header followed by its pages, each after the offset of the page in the heap.
+    // One thread writes the open group to the log and syncs it, which commits every
+    // transaction in it, and then writes its pages to the heap file.  Meanwhile the next
+    // transaction runs, and the transactions that commit join the next group.  A group that
+    // cannot be written is added to the next one.
+    //
+    // Transactions in one process run one at a time, because the pages are protected for the
+    // whole process, so a write cannot be told apart from a write by another thread.  While a
+    // process runs or commits transactions, it holds an flock on the log.  A process that takes
+    // the flock applies any groups left by a process that died.  If another process has
+    // committed since it last held the flock, it reads the heap's header again, and drops the
+    // other pages that it has copied from the file, so that it reads them from the file.  They
+    // are also dropped when it releases the flock, if there are more than max_private_pages.
+    //
+    // The log file is written with zeros ahead of the groups, so that syncing a group does not
+    // also have to sync the length of the file.
+    //
+    // When the log is longer than max_log_length, the heap file is synced and the log starts
+    // again from the beginning, with the next epoch.  A process that opens the heap while no
+    // other process has it open applies the groups in the log, in case the system crashed
+    // before the heap file was synced, and starts the log again.  A group that was being
+    // written when the system crashed fails its check, and ends the log.
+
+    const int log_magic = 0x7265646f;
+    const off_t max_log_length = 64<<20, log_chunk = 1<<20;
+    const size_t max_private_pages = 4096;
+
+    // The state of a page in local_mapping::page_state
+    enum
+    {
+        page_writable = 1,      // Not write-protected, unless for a snapshot
+        page_unsaved = 2,       // Written since it was last captured
+        page_logged = 4,        // Has an undo image in the current transaction
+        page_private = 8        // Copied from the file when it was written
+    };
+
+    // Set in tx_pages if the page was already unsaved
+    const size_t was_unsaved = size_t(1) << 63;
+
+    // end is written when a process releases the log, without syncing, so that the
+    // next process can tell whether it committed anything.
+    struct log_header
+    {
+        int magic;
+        unsigned page_size;
+        std::uint64_t epoch;
+        std::uint64_t end;
+    };
+
+    // The check is a hash of the pages and the rest of the header, so that a group that
+    // was being written when the system crashed, or one from an earlier epoch, is ignored.
+    struct group_header
+    {
+        std::uint64_t epoch;
+        std::uint64_t position;
+        std::uint64_t pages;
+        std::uint64_t check;
+    };
+
+    const off_t log_start = sizeof(log_header);
+
+    size_t record_size()
+    {
+        return sizeof(std::uint64_t) + page_size();
+    }
+
+    size_t header_pages()
+    {
+        return round_to_page(sizeof(shared_memory)) / page_size();
+    }
+
+    std::uint64_t group_check(const group_header &header, const char *records)
+    {
+        return hash_bytes(records, header.pages * record_size(), hash_mix(header.epoch, header.position ^ header.pages));
+    }
+
+    bool write_log_header(int fd, std::uint64_t epoch, off_t end, bool sync)
+    {
+        log_header header = { log_magic, (unsigned)page_size(), epoch, (std::uint64_t)end };
+        return pwrite(fd, &header, sizeof header, 0) == sizeof header && (!sync || fdatasync(fd) == 0);
+    }
+
+    // apply_records
+    //
+    // Writes the @pages records in @records to the heap file @heap_fd.
+
+    bool apply_records(int heap_fd, const char *records, size_t pages)
+    {
+        bool ok = true;
+        for(size_t r=0; r<pages; ++r, records += record_size())
+        {
+            std::uint64_t offset;
+            memcpy(&offset, records, sizeof offset);
+            ok = pwrite(heap_fd, records + sizeof offset, page_size(), offset) == (ssize_t)page_size() && ok;
+        }
+        return ok;
+    }
+
+    // replay_log
+    //
+    // Applies the groups of @epoch in the log from @position, and returns where they end.
+
+    off_t replay_log(int fd, int heap_fd, std::uint64_t epoch, off_t position, bool &ok)
+    {
+        std::vector<char> records;
+        group_header header;
+        while(pread(fd, &header, sizeof header, position) == sizeof header &&
+              header.epoch == epoch && header.position == (std::uint64_t)position && header.pages < (std::uint64_t(1) << 32))
+        {
+            records.resize(header.pages * record_size());
+            if(pread(fd, records.data(), records.size(), position + sizeof header) != (ssize_t)records.size() ||
+               header.check != group_check(header, records.data()))
+                break;
+
+            ok = apply_records(heap_fd, records.data(), header.pages) && ok;
+            position += sizeof header + records.size();
+        }
+        return position;
+    }
+
+    // open_log
+    //
+    // Opens the log for the heap file @heap_fd, creating it if @create.  If no process is
+    // running transactions, the groups left by a process that died are applied, or if this
+    // process is @alone, every group in the log, after which the log starts again.
+
+    int open_log(const char *filename, int heap_fd, bool create, bool truncate, bool alone)
+    {
+        std::string name = std::string(filename) + ".log";
+        int fd = ::open(name.c_str(), O_RDWR | (create ? O_CREAT : 0) | (truncate ? O_TRUNC : 0), S_IRUSR|S_IWUSR);
+        if(fd == -1) return -1;
+
+        log_header header;
+        if(pread(fd, &header, sizeof header, 0) != sizeof header)
+        {
+            header = { log_magic, (unsigned)page_size(), 0, log_start };
+            if(!write_log_header(fd, header.epoch, header.end, false))
+            {
+                ::close(fd);
+                return -1;
+            }
+        }
+
+        if(header.magic != log_magic || header.page_size != page_size())
+        {
+            ::close(fd);
+            return -1;
+        }
+
+        if(flock(fd, LOCK_EX|LOCK_NB) == 0)
+        {
+            bool ok = true;
+            off_t end = replay_log(fd, heap_fd, header.epoch, alone ? log_start : header.end, ok);
+
+            // With the heap synced, the log is no longer needed
+            if(alone && ok && fdatasync(heap_fd) == 0)
+                write_log_header(fd, header.epoch + 1, log_start, true);
+            else if(end != (off_t)header.end)
+                write_log_header(fd, header.epoch, end, false);
+            flock(fd, LOCK_UN);
+        }
+
+        return fd;
+    }
+
+    void start_transactions(const shared_memory *mem, local_mapping &m, int log_fd)
+    {
+        log_header header;
+        struct stat st;
+        if(pread(log_fd, &header, sizeof header, 0) != sizeof header || fstat(log_fd, &st) != 0) return;
+
+        m.log_fd = log_fd;
+        m.log_epoch = header.epoch;
+        m.log_end = header.end;
+        m.log_length = st.st_size;
+        m.log_locked = false;
+        m.tx_active = false;
+        m.allocating = 0;
+        m.tracked = 0;
+        m.tx_count = m.unsaved_count = m.private_count = 0;
+        m.group.clear();
+        m.group_pages = 0;
+        m.group_id = m.written = 0;
+        m.failed.clear();
+        m.leading = m.executing = m.keep_private = false;
+
+        if(!track_pages(m, m.mapped))
+        {
+            m.log_fd = -1;
+            return;
+        }
+
+        mprotect((void*)mem, m.mapped, PROT_READ);
+    }
+
+    thread_local int allocator_depth __attribute__((tls_model("initial-exec")));
+
+    // capture_write
+    //
+    // Called from on_fault for a write to a protected page of a transactional heap.
+    // Returns false if the page is not tracked, so that the write crashes.
+    //
+    // A thread that writes while another is running a transaction waits for it to finish, and
+    // then writes again.  Only a thread in malloc() or free() does not, because the transaction
+    // has not started yet, see enter_allocator.  Outside a transaction, the page is made
+    // writable without an undo image, and is captured by the next commit.
+
+    bool capture_write(const shared_memory *mem, local_mapping &m, char *address)
+    {
+        size_t page = (address - (char*)mem) / page_size();
+
+        m.acquire();
+        if(page >= m.tracked)
+        {
+            m.release();
+            return false;
+        }
+
+        bool in_transaction = m.tx_active && pthread_equal(m.tx_thread, pthread_self());
+        if(m.tx_active && !in_transaction && !allocator_depth)
+        {
+            m.release();
+            while(m.tx_active) sched_yield();
+            return true;
+        }
+
+        // Otherwise the page was protected for a snapshot
+        auto &state = m.page_state[page];
+        char *start = (char*)mem + page * page_size();
+        if(!(state & page_writable))
+        {
+            if(in_transaction && !(state & page_logged))
+            {
+                memcpy(m.undo + m.tx_count * page_size(), start, page_size());
+                m.tx_pages[m.tx_count++] = page | (state & page_unsaved ? was_unsaved : 0);
+                state |= page_logged;
+            }
+            if(!(state & page_unsaved))
+                m.unsaved_pages[m.unsaved_count++] = page;
+            if(!(state & page_private))
+                m.private_pages[m.private_count++] = page;
+            state |= page_writable | page_unsaved | page_private;
+        }
+
+        mprotect(start, page_size(), PROT_READ|PROT_WRITE);
+        m.release();
+        return true;
+    }
+
+    // protect_unsaved
+    //
+    // Write-protects the pages written since the last commit, so that the transaction
+    // that is starting takes an undo image of each before writing it.  The caller holds m.busy.
+
+    void protect_unsaved(const shared_memory *mem, local_mapping &m)
+    {
+        for(size_t i=0; i<m.unsaved_count; ++i)
+        {
+            size_t page = m.unsaved_pages[i];
+            if(!(m.page_state[page] & page_writable)) continue;
+            m.page_state[page] &= ~page_writable;
+            mprotect((char*)mem + page * page_size(), page_size(), PROT_READ);
+        }
+    }
+
+    // end_transaction
+    //
+    // Forgets the undo images, and returns the memory of all but the first few.
+    // The caller holds m.busy.
+
+    void end_transaction(local_mapping &m)
+    {
+        const size_t keep = 256;
+        if(m.tx_count > keep)
+            madvise(m.undo + keep * page_size(), (m.tx_count - keep) * page_size(), MADV_DONTNEED);
+        m.tx_count = 0;
+        m.tx_active = false;
+    }
+
+    // drop_private_pages
+    //
+    // Drops this process's copies of the pages that have been committed and written to the
+    // file, so that they are read from the file again.  The header is kept, because the
+    // mutexes in it belong to this process.  The caller holds m.busy.
+
+    void drop_private_pages(const shared_memory *mem, local_mapping &m)
+    {
+        std::sort(m.private_pages, m.private_pages + m.private_count);
+
+        size_t kept = 0;
+        for(size_t i=0; i<m.private_count; ++i)
+        {
+            size_t page = m.private_pages[i];
+            if(page < header_pages() || (m.page_state[page] & page_unsaved))
+            {
+                m.private_pages[kept++] = page;
+                continue;
+            }
+
+            size_t run = i;
+            while(run+1 < m.private_count && m.private_pages[run+1] == m.private_pages[run] + 1 &&
+                  !(m.page_state[m.private_pages[run+1]] & page_unsaved))
+                ++run;
+
+            for(size_t p = i; p <= run; ++p)
+                m.page_state[m.private_pages[p]] &= ~page_private;
+            madvise((char*)mem + page * page_size(), (run+1 - i) * page_size(), MADV_DONTNEED);
+            i = run;
+        }
+        m.private_count = kept;
+    }
+
+    // lock_log
+    //
+    // Takes the flock on the log for this process, and applies any groups left by a process
+    // that died.  Returns true if another process has committed since this one last held it.
+    // The caller holds m.sync_mutex.
+
+    bool lock_log(local_mapping &m, bool &changed)
+    {
+        log_header header;
+        if(flock(m.log_fd, LOCK_EX) != 0) return false;
+        if(pread(m.log_fd, &header, sizeof header, 0) != sizeof header)
+        {
+            flock(m.log_fd, LOCK_UN);
+            return false;
+        }
+
+        bool ok = true;
+        off_t end = replay_log(m.log_fd, m.fd, header.epoch, header.end, ok);
+        changed = header.epoch != m.log_epoch || end != m.log_end;
+        m.log_epoch = header.epoch;
+        m.log_end = end;
+        m.log_locked = true;
+        return true;
+    }
+
+    // release_log
+    //
+    // Releases the flock on the log once this process has no transactions running or being
+    // committed.  The caller holds m.sync_mutex.
+
+    void release_log(const shared_memory *mem, local_mapping &m)
+    {
+        if(!m.log_locked || m.executing || m.leading || m.group_pages) return;
+
+        if(!m.keep_private && m.private_count > max_private_pages)
+        {
+            m.acquire();
+            drop_private_pages(mem, m);
+            m.release();
+        }
+
+        write_log_header(m.log_fd, m.log_epoch, m.log_end, false);
+        flock(m.log_fd, LOCK_UN);
+        m.log_locked = false;
+    }
+
+    // write_group
+    //
+    // Writes the group in m.writing to the log and syncs it.  The log starts again first if it
+    // is too long, once the heap file is synced.  Only the thread leading the group commit
+    // writes to the log.
+
+    bool write_group(local_mapping &m, size_t pages)
+    {
+        off_t length = m.writing.size();
+        if(m.log_end > log_start && m.log_end + length > max_log_length)
+        {
+            if(fdatasync(m.fd) != 0 || !write_log_header(m.log_fd, m.log_epoch + 1, log_start, true))
+                return false;
+            ++m.log_epoch;
+            m.log_end = log_start;
+        }
+
+        if(m.log_end + length > m.log_length)
+        {
+            std::vector<char> zeros(log_chunk);
+            off_t extend = round_up(m.log_end + length - m.log_length, log_chunk);
+            for(off_t done = 0; done < extend; done += log_chunk)
+                if(pwrite(m.log_fd, zeros.data(), log_chunk, m.log_length + done) != log_chunk) return false;
+            m.log_length += extend;
+        }
+
+        auto &header = *(group_header*)m.writing.data();
+        header = { m.log_epoch, (std::uint64_t)m.log_end, pages, 0 };
+        header.check = group_check(header, m.writing.data() + sizeof header);
+
+        if(pwrite(m.log_fd, m.writing.data(), length, m.log_end) != length || fdatasync(m.log_fd) != 0)
+            return false;
+        m.log_end += length;
+        return true;
+    }
+
+    // write_groups
+    //
+    // Waits until the group @id has been written.  If no thread is writing a group, this one
+    // writes the open group, and then writes its pages to the heap file.  Returns false if
+    // the group could not be written.
+
+    bool write_groups(const shared_memory *mem, local_mapping &m, std::unique_lock<std::mutex> &lock, std::uint64_t id)
+    {
+        while(m.written <= id)
+        {
+            if(m.leading)
+            {
+                m.synced_cv.wait(lock);
+                continue;
+            }
+
+            m.leading = true;
+            std::uint64_t writing = m.group_id++;
+            size_t pages = m.group_pages;
+            m.writing.swap(m.group);
+            m.group.clear();
+            m.group_pages = 0;
+            lock.unlock();
+
+            bool ok = pages == 0 || write_group(m, pages);
+
+            lock.lock();
+            m.written = writing + 1;
+            if(!ok)
+            {
+                m.failed.push_back(writing);
+                if(m.failed.size() > 64) m.failed.erase(m.failed.begin());
+
+                // The pages are still in memory, and are written with the next group
+                if(!m.group.empty()) m.writing.insert(m.writing.end(), m.group.begin() + sizeof(group_header), m.group.end());
+                m.writing.swap(m.group);
+                m.group_pages += pages;
+            }
+            m.synced_cv.notify_all();
+
+            if(ok && pages)
+            {
+                lock.unlock();
+                ok = apply_records(m.fd, m.writing.data() + sizeof(group_header), pages);
+                lock.lock();
+
+                // The file is behind, until the log is applied when the heap is next opened
+                if(!ok) m.keep_private = true;
+            }
+
+            m.leading = false;
+            m.synced_cv.notify_all();
+            release_log(mem, m);
+        }
+
+        return std::find(m.failed.begin(), m.failed.end(), id) == m.failed.end();
+    }
+
+    // stop_transactions
+    //
+    // Waits for the group being written, when the heap is closed.
+
+    void stop_transactions(const shared_memory *mem, local_mapping &m)
+    {
+        std::unique_lock<std::mutex> lock(m.sync_mutex);
+        while(m.leading) m.synced_cv.wait(lock);
+        release_log(mem, m);
+        lock.unlock();
+
+        free_table(m.page_state, m.tracked);
+        free_table(m.tx_pages, m.tracked);
+        free_table(m.unsaved_pages, m.tracked);
+        free_table(m.private_pages, m.tracked);
+        free_table(m.undo, m.tracked * page_size());
+        m.tracked = 0;
+    }
+
+    // Snapshots
+    //
+    // A snapshot is written by a thread while the heap is in use.  The heap is write-protected
+    // when the snapshot starts, and a page that is written before the thread has copied it
+    // is copied by on_fault first.  Each page is claimed by whoever copies it, and a writer
+    // that finds its page claimed by the thread waits for it to be copied.
+    //
+    // The thread copies 1MB at a time.  From a shared map, the file is copied directly
+    // with copy_file_range, which shares the blocks on filesystems that support it.
+    // A private map may differ from its file, so it is copied from memory.
+
+    const size_t snapshot_chunk = 256;     // Pages
+
+    bool claim(std::atomic<std::uint64_t> *bits, size_t page)
+    {
+        return !(bits[page/64].fetch_or(std::uint64_t(1) << page%64) & std::uint64_t(1) << page%64);
+    }
+
+    bool is_set(const std::atomic<std::uint64_t> *bits, size_t page)
+    {
+        return bits[page/64].load() & std::uint64_t(1) << page%64;
+    }
+
+    // snapshot_position
+    //
+    // Returns where @page is written in the snapshot.  A backup holds the selected pages in
+    // order, so the position is found by counting the selected pages before it.
+
+    off_t snapshot_position(const local_mapping &m, size_t page)
+    {
+        if(m.snapshot_rank.empty()) return page * page_size();
+
+        std::uint64_t before = m.snapshot_selected[page/64] & ((std::uint64_t(1) << page%64) - 1);
+        return m.snapshot_start + off_t(m.snapshot_rank[page/64] + __builtin_popcountll(before)) * page_size();
+    }
+
+    // Copies @count pages from @page, which are selected and are together in the snapshot.
+    // Only the thread uses copy_file_range, which is not a plain system call everywhere.
+    bool copy_pages(const shared_memory *mem, const local_mapping &m, size_t page, size_t count, bool from_file)
+    {
+        off_t offset = page * page_size(), position = snapshot_position(m, page);
+        size_t length = count * page_size();
+
+        if(from_file && !(m.mapFlags & MAP_PRIVATE))
+        {
+            off_t in = offset, out = position;
+            while(length > 0)
+            {
+                ssize_t n = copy_file_range(m.fd, &in, m.snapshot_fd, &out, length, 0);
+                if(n <= 0) break;
+                length -= n;
+            }
+            position += in - offset;
+            offset = in;
+        }
+
+        return length == 0 || pwrite(m.snapshot_fd, (char*)mem + offset, length, position) == (ssize_t)length;
+    }
+
+    // snapshot_copy
+    //
+    // Called from on_fault.  Copies @count pages from @page that are in the snapshot
+    // before they are written.  Returns false if none of them are.  A page that the
+    // thread has claimed is being copied, so this waits for it, which is at most the
+    // time it takes to copy one run of snapshot_chunk pages.
+
+    bool snapshot_copy(const shared_memory *mem, local_mapping &m, size_t page, size_t count)
+    {
+        m.acquire();
+        bool in_snapshot = m.snapshot_fd != -1 && page < m.snapshot_pages;
+        if(in_snapshot)
+        {
+            for(size_t p = page; p < page + count && p < m.snapshot_pages; ++p)
+            {
+                if(claim(m.snapshot_claimed.get(), p))
+                {
+                    copy_pages(mem, m, p, 1, false);
+                    m.snapshot_copied[p/64].fetch_or(std::uint64_t(1) << p%64);
+                }
+                else
+                    while(!is_set(m.snapshot_copied.get(), p));
+            }
+        }
+        m.release();
+        return in_snapshot;
+    }
+
+    // write_snapshot
+    //
+    // Runs on its own thread, and copies the pages that have not already been copied.
+    // Pages are only made writable once they have been copied, and only in heaps that
+    // are not otherwise protected.  Returns the snapshot's file in @fd.
+
+    bool write_snapshot(shared_memory *mem, local_mapping *m, int &fd)
+    {
+        bool ok = true, unprotect = m->log_fd == -1 && !m->dirty;
+
+        for(size_t chunk = 0; chunk < m->snapshot_pages; chunk += snapshot_chunk)
+        {
+            size_t end = std::min(chunk + snapshot_chunk, m->snapshot_pages);
+
+            for(size_t page = chunk; page < end; ++page)
+            {
+                if(!claim(m->snapshot_claimed.get(), page)) continue;
+
+                size_t run = page;
+                while(run+1 < end && claim(m->snapshot_claimed.get(), run+1)) ++run;
+
+                ok = copy_pages(mem, *m, page, run+1 - page, true) && ok;
+                for(size_t p = page; p <= run; ++p)
+                    m->snapshot_copied[p/64].fetch_or(std::uint64_t(1) << p%64);
+
+                if(unprotect)
+                    mprotect((char*)mem + page * page_size(), (run+1 - page) * page_size(), PROT_READ|PROT_WRITE);
+                page = run;
+            }
+        }
+
+        m->acquire();
+        fd = m->snapshot_fd;
+        m->snapshot_fd = -1;
+        m->snapshot_claimed.reset();
+        m->snapshot_copied.reset();
+        m->snapshot_selected.clear();
+        m->snapshot_rank.clear();
+        m->release();
+
+        return ok;
+    }
+
+    // Backups
+    //
+    // A backup is written like a snapshot, but holds only the selected pages.  The file starts
+    // with a backup_header, followed by one bit for each page of the heap, and then the selected
+    // pages in order from the next page boundary.  The heap's header is always selected.
+    //
+    // Each backup has the next number, which is also stored in the heap, so restore() can check
+    // that an incremental backup follows the one last applied to the file.
+
+    const int backup_magic = 0x6261636b;
+
+    struct backup_header
+    {
+        int magic;
+        unsigned page_size;
+        std::uint64_t epoch;
+        std::uint64_t length;   // Of the heap
+        bool full;              // Every page is selected
+    };
+
+    off_t backup_start(size_t pages)
+    {
+        return round_to_page(sizeof(backup_header) + (pages + 63) / 64 * sizeof(std::uint64_t));
+    }
+
+    // select_changes
+    //
+    // Returns one bit for each of the first @pages pages of the heap, which is set if the
+    // page is in the granules marked in @changes, or for every page if @full, and clears
+    // the changes.  The caller holds m.busy, and protects the pages, so that the next write
+    // to each of these granules is tracked again.
+
+    std::vector<std::uint64_t> select_changes(const shared_memory *mem, local_mapping &m,
+        std::atomic<std::uint64_t> *changes, bool full, size_t pages)
+    {
+        std::vector<std::uint64_t> selected((pages + 63) / 64, full ? ~std::uint64_t(0) : 0);
+
+        for(size_t w=0; changes && w < (m.granules + 63) / 64; ++w)
+        {
+            auto bits = changes[w].exchange(0);
+            for(; bits && !full; bits &= bits-1)
+            {
+                auto range = granule_range(mem, m, w*64 + __builtin_ctzll(bits));
+                size_t first = (range.first - (const char*)mem) / page_size();
+                for(size_t p = first; p < first + range.second / page_size() && p < pages; ++p)
+                    selected[p/64] |= std::uint64_t(1) << p%64;
+            }
+        }
+
+        selected[0] |= 1;
+        if(pages % 64) selected.back() &= (std::uint64_t(1) << pages%64) - 1;
+        return selected;
+    }
+
+    // copy_file
+    //
+    // Copies @length bytes from @from in @in to @to in @out.
+
+    bool copy_file(int in, off_t from, int out, off_t to, size_t length)
+    {
+        while(length > 0)
+        {
+            ssize_t n = copy_file_range(in, &from, out, &to, length, 0);
+            if(n <= 0) break;
+            length -= n;
+        }
+
+        std::vector<char> buffer(std::min<size_t>(length, 1<<20));
+        while(length > 0)
+        {
+            size_t n = std::min(length, buffer.size());
+            if(pread(in, buffer.data(), n, from) != (ssize_t)n || pwrite(out, buffer.data(), n, to) != (ssize_t)n)
+                return false;
+            from += n, to += n, length -= n;
+        }
+        return true;
+    }
+
+    // Replication
+    //
+    // A batch is a ship_header, followed by ranges of pages, each a ship_range followed by
+    // the pages.  The batches are numbered so that the replica can tell if one is missing.
+    // The primary holds lock() while it writes a batch, so the batch is consistent, and the
+    // replica holds lock() while it reads one.
+
+    const int ship_magic = 0x73686970;
+
+    struct ship_header
+    {
+        int magic;
+        unsigned page_size;
+        std::uint64_t sequence;
+        std::uint64_t length;   // Of the heap
+        std::uint64_t ranges;
+        bool full;
+    };
+
+    struct ship_range
+    {
+        std::uint64_t offset, length;
+    };
+
+    bool write_all(int fd, const void *data, size_t length)
+    {
+        for(const char *p = (const char*)data; length > 0; )
+        {
+            ssize_t n = ::write(fd, p, length);
+            if(n <= 0) return false;
+            p += n, length -= n;
+        }
+        return true;
+    }
+
+    bool read_all(int fd, void *data, size_t length)
+    {
+        for(char *p = (char*)data; length > 0; )
+        {
+            ssize_t n = ::read(fd, p, length);
+            if(n <= 0) return false;
+            p += n, length -= n;
+        }
+        return true;
+    }
+
+    // lock_writers
+    //
+    // Holds lock(), and runs a transaction, so that the heap can be copied while no other
+    // thread writes to it.  Returns true if the transaction must be committed.
+
+    bool lock_writers(shared_memory *mem, local_mapping &m)
+    {
+        mem->lock();
+        return m.log_fd != -1 && mem->begin();
+    }
+
+    void unlock_writers(shared_memory *mem, bool transaction)
+    {
+        if(transaction) mem->commit();
+        mem->unlock();
+    }
+
+    // on_fault
+    //
+    // Handles SIGSEGV.  If the address is in a heap that has been grown by another
+    // process, the new pages are mapped and the access is retried.  Otherwise the
+    // previous handler is called.
+    //
+    // This runs in a signal handler, so everything it calls only uses atomics and
+    // plain system calls: mmap, mremap, munmap, mprotect, madvise, pread, pwrite and
+    // sched_yield.  It never allocates, or takes a mutex.  It waits for m.busy, which is
+    // never held while writing to the heap, and for another thread's transaction.
+
+    struct sigaction previous_action;
+
+    void on_fault(int sig, siginfo_t *info, void *context)
+    {
+        char *address = (char*)info->si_addr;
+
+        for(auto &m : mappings)
+        {
+            auto heap = m.heap.load(std::memory_order_acquire);
+            if(heap && address >= (char*)heap && address < (char*)heap + m.reserved)
+            {
+                // A tracked heap makes the whole granule writable
+                if(m.snapshot_fd != -1 && address < (char*)heap + m.mapped)
+                {
+                    size_t offset = address - (char*)heap;
+                    size_t page = offset / page_size(), count = 1;
+                    if(m.dirty && m.log_fd == -1)
+                    {
+                        page = (offset >> m.granule_shift << m.granule_shift) / page_size();
+                        count = (size_t(1) << m.granule_shift) / page_size();
+                    }
+
+                    if(snapshot_copy(heap, m, page, count) && m.log_fd == -1 && !m.dirty)
+                    {
+                        mprotect(address - offset % page_size(), page_size(), PROT_READ|PROT_WRITE);
+                        return;
+                    }
+                }
+
+                if(m.log_fd != -1 && address < (char*)heap + m.mapped)
+                {
+                    if(capture_write(heap, m, address)) return;
+                    break;
+                }
+
+                if(m.dirty && address < (char*)heap + m.mapped)
+                {
+                    track_write(heap, m, address);
+                    return;
+                }
+
+                heap->refresh();
+
+                // Another thread may have mapped the page first
+                if(address < (char*)heap + m.mapped) return;
+                break;
+            }
+        }
+
+        if(previous_action.sa_flags & SA_SIGINFO)
+            previous_action.sa_sigaction(sig, info, context);
+        else if(previous_action.sa_handler != SIG_DFL && previous_action.sa_handler != SIG_IGN)
+            previous_action.sa_handler(sig);
+        else
+            signal(sig, SIG_DFL);   // Fault again, and crash
+    }
+
+    bool install_fault_handler()
+    {
+        struct sigaction action = {};
+        action.sa_sigaction = &on_fault;
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        return sigaction(SIGSEGV, &action, &previous_action) == 0;
+    }
+}
+
+
 // constructor::map_file
 //
-// Opens the file to get the file descriptor (fd).  Then calls mmap to map the file to memory.
-// It first read the first part of the file, and the might need to remap the file to the 
-// location specified by the first invocation of the map.
+// Opens the file to get the file descriptor (fd).  Then calls mmap to map the file to memory.
+// It first read the first part of the file, and the might need to remap the file to the 
+// location specified by the first invocation of the map.
+
+map_file::map_file(const char *filename, int applicationId, short majorVersion, short minorVersion,
+                   size_t length, size_t limit, int flags, size_t base)
+{
+    map_address = 0;
+    open(filename, applicationId, majorVersion, minorVersion, length, limit, flags, base);
+}
+
+void map_file::open(const char *filename,  int applicationId, short majorVersion, short minorVersion, size_t length, size_t limit, int flags, size_t base)
+{
+    close();
+
+    // The heap must at least hold its header
+    const size_t header_length = (sizeof(shared_memory) + 4095) & ~4095;
+    if(length < header_length) length = header_length;
+    if(limit < length) limit = length;
+
+    if(flags & huge_pages)
+    {
+        length = round_up(length, huge_page_size);
+        limit = round_up(limit, huge_page_size);
+    }
+    
+    const int persistMagic = 0x99a10f17;
+    const int hardwareId = 0x00000001;
+
+    
+    int mapFlags;
+
+    if(flags & private_map) mapFlags = MAP_PRIVATE|MAP_FIXED;
+    else mapFlags =  MAP_SHARED|MAP_FIXED;
+
+    if(flags & populate) mapFlags |= MAP_POPULATE;
+    
+    int fd = -1;
+    
+    int open_flags = O_RDWR;
+    if(flags & create_new) open_flags |= O_TRUNC;
+    
+    if(flags & temp_heap)
+    {
+        // Use real huge pages if there are any.  They cannot be written to, so are always fallocated.
+        if(flags & huge_pages)
+        {
+            fd = huge_temp_file(length);
+            if(fd != -1) flags |= preallocate;
+        }
+
+        if(fd == -1)
+        {
+            char filename[] = "/tmp/persist-XXXXXX";
+            fd = mkstemp(filename);
+            remove(filename);
+        }
+
+        if(fd == -1) return;
+    }
+    else
+    {
+        fd = ::open(filename, open_flags, S_IRWXU|S_IRGRP|S_IROTH);
+    
+        if(fd == -1)
+        {
+            // File did not exist, so we create it instead
+
+            fd = ::open(filename, O_CREAT|O_RDWR, S_IRWXU|S_IRGRP|S_IROTH);
+
+            if(fd == -1) return;  // Failed to create file
+        }
+    }
+
+    // A new file is filled up with zeros.  An existing heap is mapped at its own size.
+    if(!size_file(fd, length, flags & preallocate))
+    {
+        ::close(fd);
+        return;
+    }
+
+    // Each process holds a shared flock on the file while the heap is mapped.  A process that
+    // gets an exclusive lock is the only one using the heap, so a mutex in the heap that is held
+    // must have been held by a process that died, and the mutexes are reset, see reset_locks.
+    // Other processes wait for this to finish before they map the heap.
+    bool alone = (flags & temp_heap) || flock(fd, LOCK_EX|LOCK_NB) == 0;
+    if(!alone) flock(fd, LOCK_SH);
+
+    // Roll back a transaction left by a process that died, before the heap is read
+    int log_fd = flags & temp_heap ? -1 : open_log(filename, fd, flags & transactions, flags & create_new, alone);
+
+    
+    // The header says where the heap was created and how long it is, so it is only mapped once.
+    // A relocatable heap is mapped over a reservation of its limit, wherever there is room.
+    std::vector<char> header(sizeof(shared_memory));
+    auto existing = reinterpret_cast<const shared_memory*>(header.data());
+    if(pread(fd, header.data(), header.size(), 0) != (ssize_t)header.size()) existing = nullptr;
+    if(existing && (!existing->address || existing->magic != persistMagic)) existing = nullptr;
+
+    bool relocate = existing ? existing->heap_flags & relocatable : flags & relocatable;
+
+    // A transactional heap is mapped privately, so that its pages only reach the file when they are committed
+    bool transactional = log_fd != -1 && !(flags & private_map) && ((existing ? existing->heap_flags : flags) & transactions);
+    if(transactional) mapFlags = (mapFlags & ~MAP_SHARED) | MAP_PRIVATE;
+    if(existing)
+    {
+        length = existing->current_size;
+        if(!relocate) base = (size_t)existing->address;
+    }
+
+    size_t reserved = round_to_page(length);
+    char *addr = (char*)MAP_FAILED;
+
+    if(relocate)
+    {
+        bool huge = existing ? existing->heap_flags & huge_pages : flags & huge_pages;
+        reserved = round_to_page(std::max(existing ? existing->max_size : limit, length));
+        char *start = reserve_anywhere(base, reserved, huge ? huge_page_size : page_size());
+        if(start)
+        {
+            addr = (char*)mmap(start, length, PROT_WRITE|PROT_READ, mapFlags, fd, 0);
+            if(addr == MAP_FAILED) munmap(start, reserved);
+        }
+    }
+    else
+    {
+        if(base == 0) mapFlags -= MAP_FIXED;
+        addr = (char*)mmap((char*)base, length, PROT_WRITE|PROT_READ, mapFlags, fd, 0);
+        if(base == 0) mapFlags += MAP_FIXED;
+    }
+
+    map_address = addr == MAP_FAILED ? nullptr : (shared_memory*)addr;
+
+    local_mapping *mapping = map_address ? new_mapping(map_address) : nullptr;
+
+    if(mapping)
+    {
+        [[maybe_unused]] static bool handler_installed = install_fault_handler();
+
+        mapping->fd = fd;
+        mapping->mapFlags = mapFlags;
+        mapping->mapped = round_to_page(length);
+        mapping->reserved = reserved;
+        mapping->generation = map_address->address ? map_address->generation.load() : 0;
+        mapping->huge = false;
+        mapping->pages_file.clear();
+        mapping->dirty.reset();
+        mapping->log_fd = -1;
+        mapping->changed.reset();
+        mapping->unshipped.reset();
+        mapping->backup_full = mapping->ship_full = true;
+        mapping->shipped = mapping->applied = 0;
+        mapping->snapshot_fd = -1;
+    }
+    else
+    {
+        // Too many heaps are open, or the file could not be mapped
+        if(map_address) munmap((char*)map_address, reserved);
+        map_address = nullptr;
+        ::close(fd);
+    }
+
+    if(map_address)
+    {
+        if(map_address->address)
+        {
+            // Check the versions
+            if(map_address->magic != persistMagic ||
+               map_address->applicationId != applicationId ||
+               map_address->hardwareId != hardwareId ||
+               map_address->majorVersion != majorVersion ||
+               map_address->minorVersion != minorVersion)
+            {
+                close();
+                throw InvalidVersion();
+            }
+            
+            if(map_address->address != map_address && !(map_address->heap_flags & relocatable))
+            {
+                // This is a failure!
+
+                close();
+            }
+            else if(alone)
+                map_address->reset_locks();
+        }
+        else
+        {
+            // This is a new address
+            map_address->address = map_address;
+            map_address->current_size = length;
+            map_address->max_size = limit;
+            map_address->end = length;
+            map_address->top = (char*)map_address->root() - (char*)map_address;
+            map_address->magic = persistMagic;
+            map_address->applicationId = applicationId;
+            map_address->hardwareId = hardwareId;
+            map_address->majorVersion = majorVersion;
+            map_address->minorVersion = minorVersion;
+
+            map_address->generation = 0;
+            map_address->backup_epoch = 0;
+
+            map_address->reset_locks();
+            map_address->next_arena = 0;
+            map_address->heap_flags = flags & (lock_free|preallocate|huge_pages|transactions|relocatable);
+            map_address->growth_mode = grow_geometric;
+            map_address->growth_amount = 50;
+            map_address->extra.mapFlags = mapFlags;
+
+            // This is not needed
+            map_address->clear_free_lists();
+
+            if(transactional && pwrite(fd, map_address, header_length, 0) != (ssize_t)header_length)
+                close();
+        }
+    }
+
+    if(map_address && alone) flock(fd, LOCK_SH);
+
+    if(map_address)
+    {
+        if(map_address->heap_flags & huge_pages)
+        {
+            mapping->huge = true;
+            madvise(map_address, mapping->mapped, MADV_HUGEPAGE);
+        }
+
+        // Growing beyond the reservation is still possible if the addresses happen to be free
+        reserve(map_address, *mapping, map_address->max_size);
+
+        // Changes to a private map are never written
+        if(transactional)
+            start_transactions(map_address, *mapping, log_fd);
+        else if((flags & track_changes) && !(mapFlags & MAP_PRIVATE))
+            start_tracking(map_address, *mapping, map_address->max_size);
+
+        if((flags & working_set) && !(flags & temp_heap))
+        {
+            mapping->pages_file = std::string(filename) + ".pages";
+            mapping->stop_prefetch = false;
+            mapping->prefetcher = std::thread(prefetch_working_set, mapping, (char*)map_address, mapping->mapped);
+        }
+    }
+
+    if(log_fd != -1 && !(map_address && mapping->log_fd == log_fd))
+        ::close(log_fd);
+
+    // Report on where it ended up
+    // std::cout << "Mapped to " << map_address << std::endl;
+}
+
+
+
+map_file::~map_file()
+{
+    close();
+}
+
+
+void map_file::close()
+{
+    if(map_address)
+    {
+        auto m = mapping_of(map_address);
+        int fd = m->fd;
+
+        if(m->prefetcher.joinable())
+        {
+            m->stop_prefetch = true;
+            m->prefetcher.join();
+        }
+
+        if(m->log_fd != -1 && m->tx_active && pthread_equal(m->tx_thread, pthread_self())) map_address->abort();
+        if(m->snapshotter.joinable()) m->snapshotter.join();
+
+        // The writes made outside transactions are committed with the cached blocks
+        bool transaction = map_address->begin();
+        map_address->drain_caches(true);
+        if(transaction) map_address->commit();
+        if(m->log_fd != -1) stop_transactions(map_address, *m);
+        if(!m->pages_file.empty()) record_working_set(map_address, *m);
+        int log_fd = m->log_fd;
+        map_address->unmap();
+        ::close(fd);
+        if(log_fd != -1) ::close(log_fd);
+        map_address = nullptr;
+    }
+}
+
+
+// shared_memory::unmap
+//
+// Unmaps the heap and its reservation.
+
+void shared_memory::unmap()
+{
+    auto m = mapping_of(this);
+    size_t reserved = m->reserved;
+    m->heap = nullptr;
+    munmap((char*)this, reserved);
+}
+
+
+// shared_memory::refresh
+//
+// Maps the pages that other processes have added to the heap.
+// The generation of the heap changes whenever it grows, so this is cheap if it has not.
+
+bool shared_memory::refresh()
+{
+    auto m = mapping_of(this);
+    if(!m) return false;
+
+    // The header of a transactional heap is private, so the file has the latest size
+    unsigned g = generation.load(std::memory_order_acquire);
+    size_t length = current_size;
+    if(m->log_fd != -1 &&
+       (pread(m->fd, &g, sizeof g, (char*)&generation - (char*)this) != sizeof g ||
+        pread(m->fd, &length, sizeof length, (char*)&current_size - (char*)this) != sizeof length))
+        return false;
+    if(m->generation == g) return false;
+
+    m->acquire();
+    bool grown = m->generation != g && map_to(this, *m, length);
+    if(grown) m->generation = g;
+    m->release();
+
+    return grown;
+}
+
+
+// shared_memory::warmup
+//
+// The pages are prefaulted by reading a byte from each, which maps them without
+// making them dirty.  Each thread takes every n-th stripe of the heap, so that
+// the threads read different parts of the file at the same time.
+
+double shared_memory::warmup(int how, int threads, size_type length)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    char *begin = (char*)this;
+    size_t used = std::min<size_t>(round_to_page(top), current_size);
+    if(length == 0 || length > used) length = used;
+
+    if(how & warm_willneed)
+        madvise(begin, length, MADV_WILLNEED);
+
+    if(how & warm_prefault)
+    {
+        const size_t stripe = 1<<20;
+
+        if(threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        threads = std::min<size_t>(threads, (length + stripe - 1) / stripe);
+
+        auto prefault = [=](int thread) {
+            for(size_t s = thread * stripe; s < length; s += threads * stripe)
+                for(size_t p = s; p < s + stripe && p < length; p += page_size())
+                    (void)*(volatile char*)(begin + p);
+        };
+
+        std::vector<std::thread> workers;
+        for(int t=1; t<threads; ++t)
+            workers.emplace_back(prefault, t);
+        prefault(0);
+        for(auto &w : workers)
+            w.join();
+    }
+
+    if((how & warm_lock) && mlock(begin, length) != 0)
+        return -1;
+
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+// shared_memory::resident
+//
+// Uses mincore to count the pages of the heap that are in memory.
+
+shared_memory::size_type shared_memory::resident() const
+{
+    size_type count = 0;
+    for(auto p : resident_pages(this, current_size))
+        count += p & 1;
+    return count * page_size();
+}
+
+
+// shared_memory::checkpoint
+
+// With transactions, the writes made outside a transaction are committed.
+
+bool shared_memory::checkpoint()
+{
+    auto m = mapping_of(this);
+    if(m && m->log_fd != -1) return begin() && commit();
+    if(!m || (m->mapFlags & MAP_PRIVATE)) return false;
+
+    return write_changes(this, m, take_changes(this, *m));
+}
+
+std::future<bool> shared_memory::checkpoint_async()
+{
+    auto m = mapping_of(this);
+    if(m && m->log_fd != -1) return std::async(std::launch::async, &shared_memory::checkpoint, this);
+    if(!m || (m->mapFlags & MAP_PRIVATE))
+    {
+        std::promise<bool> failed;
+        failed.set_value(false);
+        return failed.get_future();
+    }
+
+    return std::async(std::launch::async, write_changes, this, m, take_changes(this, *m));
+}
+
+
+// shared_memory::begin
+//
+// Starts a transaction, after waiting for the transactions of other threads, and for
+// the threads in malloc() and free().  The pages written since the last commit are
+// protected, so that the transaction takes an undo image of each before writing it.
 
-map_file::map_file(const char *filename, int applicationId, short majorVersion, short minorVersion,
-                   size_t length, size_t limit, int flags, size_t base)
+bool shared_memory::begin()
 {
-    map_address = 0;
-    open(filename, applicationId, majorVersion, minorVersion, length, limit, flags, base);
+    auto m = mapping_of(this);
+    if(!m || m->log_fd == -1) return false;
+    if(m->tx_active && pthread_equal(m->tx_thread, pthread_self())) return false;
+
+    m->tx_mutex.lock();
+
+    bool changed = false;
+    {
+        std::lock_guard<std::mutex> lock(m->sync_mutex);
+        if(!m->log_locked && !lock_log(*m, changed))
+        {
+            m->tx_mutex.unlock();
+            return false;
+        }
+        m->executing = true;
+    }
+
+    m->acquire();
+    m->tx_thread = pthread_self();
+    m->tx_active = true;
+    m->release();
+
+    while(m->allocating) std::this_thread::yield();
+
+    m->acquire();
+    protect_unsaved(this, *m);
+
+    // Another process has committed, so the header is read again, apart from the mutexes,
+    // which belong to this process, and the pages that this process has not committed yet
+    if(changed)
+    {
+        if(!m->keep_private) drop_private_pages(this, *m);
+
+        const size_t header_length = header_pages() * page_size();
+        std::vector<char> header(header_length);
+        if(pread(m->fd, header.data(), header_length, 0) == (ssize_t)header_length)
+        {
+            for(size_t page=0; page<header_pages(); ++page)
+                if(m->page_state[page] & page_unsaved)
+                    memcpy(header.data() + page * page_size(), (char*)this + page * page_size(), page_size());
+
+            mprotect(this, header_length, PROT_READ|PROT_WRITE);
+            copy_header(header.data(), header_length);
+            mprotect(this, header_length, PROT_READ);
+            for(size_t page=0; page<header_pages(); ++page)
+                if(!(m->page_state[page] & page_private))
+                {
+                    m->page_state[page] |= page_private;
+                    m->private_pages[m->private_count++] = page;
+                }
+        }
+    }
+    m->release();
+    return true;
 }
 
-void map_file::open(const char *filename,  int applicationId, short majorVersion, short minorVersion, size_t length, size_t limit, int flags, size_t base)
+
+// shared_memory::commit
+//
+// Copies the pages that have been written into the open group, and waits for it to be
+// written.  The next transaction can run while this one is being written.  The mutexes in
+// the header are copied unlocked, because they belong to this process.
+
+bool shared_memory::commit()
 {
-    close();
-    
-    const int persistMagic = 0x99a10f0f;
-    const int hardwareId = 0x00000001;
+    auto m = mapping_of(this);
+    if(!m || m->log_fd == -1 || !m->tx_active || !pthread_equal(m->tx_thread, pthread_self())) return false;
 
-    
-    int mapFlags;
+    std::unique_lock<std::mutex> lock(m->sync_mutex);
+    auto &group = m->group;
+    if(group.empty()) group.resize(sizeof(group_header));
 
-    if(flags & private_map) mapFlags = MAP_PRIVATE|MAP_FIXED;
-    else mapFlags =  MAP_SHARED|MAP_FIXED;
-    
-    int fd = -1;
-    
-    int open_flags = O_RDWR;
-    if(flags & create_new) open_flags |= O_TRUNC;
-    
-    if(flags & temp_heap)
+    m->acquire();
+    for(size_t i=0; i<m->unsaved_count; ++i)
     {
-        char filename[] = "/tmp/persist-XXXXXX";
-        fd = mkstemp(filename);
-        remove(filename);
-        
-        char c=0;
-        lseek(fd, length-1, SEEK_SET);
-        write(fd, &c, 1);
+        size_t page = m->unsaved_pages[i];
+        char *start = (char*)this + page * page_size();
+        if(m->page_state[page] & page_writable) mprotect(start, page_size(), PROT_READ);
+        m->page_state[page] &= ~(page_writable|page_unsaved|page_logged);
+
+        std::uint64_t offset = page * page_size();
+        size_t position = group.size();
+        group.resize(position + record_size());
+        memcpy(&group[position], &offset, sizeof offset);
+        memcpy(&group[position + sizeof offset], start, page_size());
+        if(page < header_pages())
+            clean_locks(&group[position + sizeof offset], offset, page_size());
     }
-    else
+    m->group_pages += m->unsaved_count;
+    m->unsaved_count = 0;
+    end_transaction(*m);
+    m->release();
+
+    m->executing = false;
+    std::uint64_t id = m->group_id;
+    m->tx_mutex.unlock();
+
+    return write_groups(this, *m, lock, id);
+}
+
+
+// shared_memory::abort
+//
+// Copies the undo images back, apart from the mutexes in the header.  Blocks in this
+// thread's caches may have been allocated or freed by the transaction, so its caches
+// are discarded, and the blocks they held before the transaction are lost.
+
+void shared_memory::abort()
+{
+    auto m = mapping_of(this);
+    if(!m || m->log_fd == -1 || !m->tx_active || !pthread_equal(m->tx_thread, pthread_self())) return;
+
+    m->acquire();
+    for(size_t i=0; i<m->tx_count; ++i)
     {
-        fd = ::open(filename, open_flags, S_IRWXU|S_IRGRP|S_IROTH);
-    
-        if(fd == -1)
+        size_t page = m->tx_pages[i] & ~was_unsaved;
+        char *start = (char*)this + page * page_size(), *image = m->undo + i * page_size();
+        mprotect(start, page_size(), PROT_READ|PROT_WRITE);
+        if(page < header_pages())
+            copy_header(image, page_size(), page * page_size());
+        else
+            memcpy(start, image, page_size());
+        mprotect(start, page_size(), PROT_READ);
+
+        auto &state = m->page_state[page];
+        state &= ~(page_writable|page_logged);
+        if(!(m->tx_pages[i] & was_unsaved)) state &= ~page_unsaved;
+    }
+
+    // The pages written outside the transaction are still to be committed
+    size_t kept = 0;
+    for(size_t i=0; i<m->unsaved_count; ++i)
+        if(m->page_state[m->unsaved_pages[i]] & page_unsaved)
+            m->unsaved_pages[kept++] = m->unsaved_pages[i];
+    m->unsaved_count = kept;
+    end_transaction(*m);
+    m->release();
+
+    discard_thread_caches();
+
+    {
+        std::lock_guard<std::mutex> lock(m->sync_mutex);
+        m->executing = false;
+        release_log(this, *m);
+    }
+    m->tx_mutex.unlock();
+}
+
+
+// shared_memory::enter_allocator
+//
+// Called by malloc() and free() on a heap with transactions.  A thread that is not running
+// the transaction waits for it to finish, and a transaction that is starting waits for the
+// threads that are allocating, so that a thread never waits for a transaction while it holds
+// one of the allocator's locks.  A thread in malloc() may write to a protected page while
+// the transaction waits for it, and then capture_write lets the write go ahead.
+
+void shared_memory::enter_allocator()
+{
+    auto m = mapping_of(this);
+    if(!m || m->log_fd == -1 || allocator_depth++) return;
+
+    for(;;)
+    {
+        ++m->allocating;
+        if(!m->tx_active || pthread_equal(m->tx_thread, pthread_self())) return;
+        --m->allocating;
+
+        std::lock_guard<std::mutex> wait(m->tx_mutex);
+    }
+}
+
+void shared_memory::leave_allocator()
+{
+    auto m = mapping_of(this);
+    if(!m || m->log_fd == -1) return;
+    if(--allocator_depth == 0) --m->allocating;
+}
+
+
+// shared_memory::reset_locks
+//
+// Initialises the mutexes in the header, which are not valid in a new heap, or in a snapshot,
+// or when a process died holding one of them.
+
+void shared_memory::reset_locks()
+{
+    new(&extra.mem_mutex) process_mutex();
+    new(&extra.user_mutex) process_mutex();
+    for(auto &a : arenas)
+        new(&a.mutex) process_mutex();
+}
+
+
+// shared_memory::snapshot
+//
+// The heap is protected while holding lock(), and while no transaction is running,
+// so the snapshot is of the heap at that point.  Only the writes of this process are
+// seen, so other processes should not write to the heap until the snapshot is done.
+// The snapshot is written to a temporary file which is renamed when it is complete.
+
+std::future<bool> shared_memory::snapshot(const char *path)
+{
+    return copy_to(path, false);
+}
+
+std::future<bool> shared_memory::backup(const char *path)
+{
+    return copy_to(path, true);
+}
+
+std::future<bool> shared_memory::copy_to(const char *path, bool backup)
+{
+    std::promise<bool> result;
+    auto future = result.get_future();
+
+    auto m = mapping_of(this);
+    if(!m || m->snapshot_fd != -1)
+    {
+        result.set_value(false);
+        return future;
+    }
+
+    if(m->snapshotter.joinable()) m->snapshotter.join();
+
+    std::string temp = std::string(path) + ".tmp";
+    int fd = ::open(temp.c_str(), O_RDWR|O_CREAT|O_TRUNC, S_IRWXU|S_IRGRP|S_IROTH);
+
+    bool transaction = lock_writers(this, *m);
+
+    size_t length = round_to_page(current_size), pages = length / page_size();
+
+    // The heap's header is copied with the number of this backup.  Writing it may fault.
+    if(backup) ++backup_epoch;
+
+    m->acquire();
+    std::vector<std::uint64_t> selected;
+    backup_header header = { backup_magic, (unsigned)page_size(), backup_epoch, length, m->backup_full || !m->changed };
+    if(backup)
+    {
+        selected = select_changes(this, *m, m->changed.get(), header.full, pages);
+        m->backup_full = false;
+    }
+
+    off_t start = backup ? backup_start(pages) : 0;
+    size_t count = 0;
+    for(auto bits : selected)
+        count += __builtin_popcountll(bits);
+
+    bool ok = fd != -1 && ftruncate(fd, backup ? start + count * page_size() : length) == 0;
+    if(ok)
+    {
+        m->snapshot_pages = pages;
+        m->snapshot_claimed.reset(new std::atomic<std::uint64_t>[(pages + 63) / 64]());
+        m->snapshot_copied.reset(new std::atomic<std::uint64_t>[(pages + 63) / 64]());
+        m->snapshot_selected = selected;
+        m->snapshot_start = start;
+
+        // Pages that are not in the backup are already copied
+        std::uint32_t rank = 0;
+        for(auto bits : selected)
         {
-            // File did not exist, so we create it instead
+            size_t w = m->snapshot_rank.size();
+            m->snapshot_claimed[w] = ~bits;
+            m->snapshot_copied[w] = ~bits;
+            m->snapshot_rank.push_back(rank);
+            rank += __builtin_popcountll(bits);
+        }
 
-            fd = ::open(filename, O_CREAT|O_RDWR, S_IRWXU|S_IRGRP|S_IROTH);
+        m->snapshot_fd = fd;
+        mprotect(this, length, PROT_READ);
+    }
+    else if(backup)
+        m->backup_full = true;
+    m->release();
+    unlock_writers(this, transaction);
 
-            if(fd == -1) return;  // Failed to create file
+    if(!ok)
+    {
+        if(fd != -1) ::close(fd);
+        remove(temp.c_str());
+        result.set_value(false);
+        return future;
+    }
 
-            // Fill up the file with zeros
+    m->snapshotter = std::thread([this, m, temp, path = std::string(path), result = std::move(result),
+        backup, header, selected = std::move(selected), start]() mutable {
+        int fd;
+        bool ok = write_snapshot(this, m, fd);
 
-            char c=0;
-            lseek(fd, length-1, SEEK_SET);
-            write(fd, &c, 1);
+        if(backup)
+        {
+            size_t bitmap = selected.size() * sizeof(std::uint64_t);
+            ok = ok && pwrite(fd, &header, sizeof header, 0) == sizeof header &&
+                pwrite(fd, selected.data(), bitmap, sizeof header) == (ssize_t)bitmap;
         }
-        else if(flags & create_new)
+
+        // The mutexes may have been held when the header was copied
+        const size_t header_length = round_to_page(sizeof(shared_memory));
+        std::vector<char> heap_header(header_length);
+        ok = ok && pread(fd, heap_header.data(), header_length, start) == (ssize_t)header_length;
+        if(ok)
         {
-            char c=0;
-            lseek(fd, length-1, SEEK_SET);
-            write(fd, &c, 1);
+            reinterpret_cast<shared_memory*>(heap_header.data())->reset_locks();
+            ok = pwrite(fd, heap_header.data(), header_length, start) == (ssize_t)header_length && fdatasync(fd) == 0;
         }
-    }
+        ok = ::close(fd) == 0 && ok;
 
-    
-    // Seek to the end of the file: we need to ensure enough of the file is allocated
-    if(base == 0) mapFlags -= MAP_FIXED;
+        ok = ok && rename(temp.c_str(), path.c_str()) == 0;
+        if(!ok) remove(temp.c_str());
+
+        // The changes in a failed backup are in the next one
+        if(!ok && backup) m->backup_full = true;
+        result.set_value(ok);
+    });
+    return future;
+}
 
-    char *addr = (char*)mmap((char*)base, length, PROT_WRITE|PROT_READ, mapFlags, fd, 0);
 
-    if(addr == MAP_FAILED)
-        map_address = 0;
-    else
-        map_address = (shared_memory*)addr;
+// shared_memory::restore
+//
+// Copies the pages in the backup over the file, which is extended if the heap has grown.
+
+bool shared_memory::restore(const char *filename, const char *backup)
+{
+    int in = ::open(backup, O_RDONLY);
+    if(in == -1) return false;
+
+    backup_header header;
+    bool ok = pread(in, &header, sizeof header, 0) == sizeof header && header.magic == backup_magic &&
+        header.page_size == page_size();
+
+    size_t pages = ok ? header.length / page_size() : 0;
+    std::vector<std::uint64_t> selected((pages + 63) / 64);
+    size_t bitmap = selected.size() * sizeof(std::uint64_t);
+    ok = ok && pread(in, selected.data(), bitmap, sizeof header) == (ssize_t)bitmap;
+
+    int out = ok ? ::open(filename, O_RDWR | (header.full ? O_CREAT : 0), S_IRWXU|S_IRGRP|S_IROTH) : -1;
+    ok = out != -1;
 
-    if(base == 0)
+    // An incremental backup must follow the last one applied
+    if(ok && !header.full)
     {
-        mapFlags += MAP_FIXED;
+        std::vector<char> heap_header(sizeof(shared_memory));
+        ok = pread(out, heap_header.data(), heap_header.size(), 0) == (ssize_t)heap_header.size() &&
+            reinterpret_cast<shared_memory*>(heap_header.data())->backup_epoch + 1 == header.epoch;
     }
 
-    if(map_address)
+    struct stat st;
+    ok = ok && fstat(out, &st) == 0;
+    if(ok && (header.full || (size_t)st.st_size < header.length))
+        ok = ftruncate(out, header.length) == 0;
+
+    off_t position = backup_start(pages);
+    for(size_t p = 0; ok && p < pages; ++p)
     {
-        // Remap the file according to the specifications in the header file
+        if(!(selected[p/64] >> p%64 & 1)) continue;
 
-        void *previous_address = map_address->address;
-        size_t previous_length = map_address->current_size;
-        
-        if(previous_address && (previous_length != length || previous_address != map_address))
-        {
-             munmap((char*)map_address, length);
-             length = previous_length;
-             auto base_address = previous_address;
+        size_t run = p;
+        while(run+1 < pages && (selected[(run+1)/64] >> (run+1)%64 & 1)) ++run;
+
+        size_t length = (run+1 - p) * page_size();
+        ok = copy_file(in, position, out, p * page_size(), length);
+        position += length;
+        p = run;
+    }
 
-             addr = (char*)mmap((char*)base_address, length, PROT_WRITE|PROT_READ, mapFlags, fd, 0);
+    ok = ok && fdatasync(out) == 0;
+    if(out != -1) ok = ::close(out) == 0 && ok;
+    ::close(in);
+    return ok;
+}
 
-             if(addr == MAP_FAILED)
-                map_address = 0;
-             else
-             {
-                map_address = (shared_memory*)addr;        
-             }
 
-        }
+// shared_memory::ship
+//
+// The pages are selected and protected while holding m.busy, as in take_changes.
+// If the batch is not completely written, the next one is full.
+
+bool shared_memory::ship(int fd, bool full)
+{
+    auto m = mapping_of(this);
+    if(!m) return false;
+
+    bool transaction = lock_writers(this, *m);
+
+    size_t length = round_to_page(current_size), pages = length / page_size();
+    ship_header header = { ship_magic, (unsigned)page_size(), ++m->shipped, length, 0, full || m->ship_full || !m->unshipped };
+
+    std::vector<ship_range> ranges;
+    m->acquire();
+    auto selected = select_changes(this, *m, m->unshipped.get(), header.full, pages);
+    for(size_t p = 0; p < pages; ++p)
+    {
+        if(!(selected[p/64] >> p%64 & 1)) continue;
+
+        size_t run = p;
+        while(run+1 < pages && (selected[(run+1)/64] >> (run+1)%64 & 1)) ++run;
+
+        ranges.push_back({ p * page_size(), (run+1 - p) * page_size() });
+        if(m->dirty) mprotect((char*)this + ranges.back().offset, ranges.back().length, PROT_READ);
+        p = run;
     }
+    m->release();
 
-    if(map_address)
+    header.ranges = ranges.size();
+    bool ok = write_all(fd, &header, sizeof header);
+    for(size_t r = 0; ok && r < ranges.size(); ++r)
+        ok = write_all(fd, &ranges[r], sizeof ranges[r]) && write_all(fd, (char*)this + ranges[r].offset, ranges[r].length);
+
+    m->ship_full = !ok;
+    unlock_writers(this, transaction);
+    return ok;
+}
+
+
+// shared_memory::apply
+//
+// The heap is first extended to the length of the heap it follows.  The pages are read
+// through a buffer, because the heap may be write-protected, and the locks in the
+// header are not copied, because they belong to this heap.
+
+bool shared_memory::apply(int fd)
+{
+    auto m = mapping_of(this);
+    ship_header header;
+    if(!m || !read_all(fd, &header, sizeof header) || header.magic != ship_magic || header.page_size != page_size())
+        return false;
+
+    if(!header.full && header.sequence != m->applied + 1) return false;
+
+    lock();
+    m->acquire();
+    bool ok = size_file(m->fd, header.length, heap_flags & preallocate) && map_to(this, *m, header.length);
+    m->release();
+
+    std::vector<char> buffer(1<<20);
+    for(std::uint64_t r = 0; ok && r < header.ranges; ++r)
     {
-        if(map_address->address)
+        ship_range range;
+        ok = read_all(fd, &range, sizeof range) && range.offset + range.length <= header.length;
+
+        for(size_t done = 0; ok && done < range.length; )
         {
-            // Check the versions
-            if(map_address->magic != persistMagic ||
-               map_address->applicationId != applicationId ||
-               map_address->hardwareId != hardwareId ||
-               map_address->majorVersion != majorVersion ||
-               map_address->minorVersion != minorVersion)
-            {
-                close();
-                throw InvalidVersion();
-            }
-            
-            if(map_address->address != map_address)
-            {
-                // This is a failure!
+            size_t offset = range.offset + done;
+            size_t n = offset < sizeof(shared_memory) ? sizeof(shared_memory) - offset : buffer.size();
+            n = std::min<size_t>(n, range.length - done);
+            ok = read_all(fd, buffer.data(), n);
+            if(!ok) break;
 
-                munmap((char*)map_address, length);
-                map_address = 0;
+            if(offset == 0)
+            {
+                auto primary = reinterpret_cast<shared_memory*>(buffer.data());
+                ok = n == sizeof(shared_memory) && (primary->address == this || (primary->heap_flags & relocatable));
+                if(ok) copy_header(buffer.data(), n);
             }
+            else
+                memcpy((char*)this + offset, buffer.data(), n);
+            done += n;
         }
-        else
-        {
-            // This is a new address
-            map_address->address = map_address;
-            map_address->current_size = length;
-            map_address->max_size = limit;
-            map_address->end = (char*)map_address + length;
-            map_address->top = (char*)map_address->root();
-            map_address->magic = persistMagic;
-            map_address->applicationId = applicationId;
-            map_address->hardwareId = hardwareId;
-            map_address->majorVersion = majorVersion;
-            map_address->minorVersion = minorVersion;
+    }
 
-            new(&map_address->extra.mem_mutex) std::mutex();
-            new(&map_address->extra.user_mutex) std::mutex();
-            map_address->extra.mapFlags = mapFlags;
-            map_address->extra.fd = fd;
+    if(ok)
+    {
+        m->applied = header.sequence;
+        m->generation = generation;
+    }
+    unlock();
+    return ok;
+}
 
-            // This is not needed
-            for(int i=0; i<64; ++i) map_address->free_space[i] = 0;
-        }
+
+// shared_memory::copy_header
+//
+// Copies @length bytes of another heap's header over this one from @offset, apart from
+// the locks.
+
+void shared_memory::copy_header(const char *from, size_t length, size_t offset)
+{
+    std::vector<std::pair<size_t, size_t>> locks = { { (char*)&extra - (char*)this, sizeof extra } };
+    for(auto &a : arenas)
+        locks.push_back({ (char*)&a.mutex - (char*)this, sizeof a.mutex });
+    std::sort(locks.begin(), locks.end());
+
+    size_t start = offset, end = offset + length;
+    for(auto &lock : locks)
+    {
+        size_t before = std::min(lock.first, end);
+        if(before > offset) memcpy((char*)this + offset, from + (offset - start), before - offset);
+        offset = std::max(offset, lock.first + lock.second);
     }
+    if(end > offset) memcpy((char*)this + offset, from + (offset - start), end - offset);
+}
 
-    // Report on where it ended up
-    // std::cout << "Mapped to " << map_address << std::endl;
+
+// shared_memory::clean_locks
+//
+// Replaces the mutexes in @copy, which is a copy of @length bytes of the header from
+// @offset, with unlocked ones.
+
+void shared_memory::clean_locks(char *copy, size_t offset, size_t length) const
+{
+    alignas(process_mutex) char unlocked[sizeof(process_mutex)];
+    new(unlocked) process_mutex();
+
+    std::vector<size_t> mutexes = { size_t((const char*)&extra.mem_mutex - (const char*)this),
+        size_t((const char*)&extra.user_mutex - (const char*)this) };
+    for(auto &a : arenas)
+        mutexes.push_back((const char*)&a.mutex - (const char*)this);
+
+    for(auto m : mutexes)
+    {
+        size_t from = std::max(m, offset), to = std::min(m + sizeof unlocked, offset + length);
+        if(from < to) memcpy(copy + (from - offset), unlocked + (from - m), to - from);
+    }
 }
 
 
+// scan_guard
+//
+// Chunks are released with MADV_COLD, so the kernel reclaims them first, and then
+// MADV_DONTNEED to drop them from this process.  Pages of a private map may have been
+// changed, so they are only made cold.  The range advised MADV_SEQUENTIAL moves with
+// the scan, and is reset to normal as chunks are released, so that the heap's
+// mappings are not left split into many pieces.
 
-map_file::~map_file()
+scan_guard::scan_guard(shared_memory &mem, size_t budget) : mem(mem), current(nullptr)
 {
-    close();
+    chunks.reserve(std::max<size_t>(budget / chunk_size, 2));
+    auto m = mapping_of(&mem);
+    keep_private = !m || (m->mapFlags & MAP_PRIVATE);
 }
 
+scan_guard::~scan_guard()
+{
+    for(auto c : chunks)
+        release(c);
+}
 
-void map_file::close()
+void scan_guard::enter(const char *p)
 {
-    if(map_address)
+    auto m = mapping_of(&mem);
+    const char *begin = (const char*)&mem;
+    if(!m || p < begin || p >= begin + m->mapped) return;
+
+    current = begin + (p - begin) / chunk_size * chunk_size;
+    if(std::find(chunks.begin(), chunks.end(), current) != chunks.end()) return;
+
+    if(chunks.size() == chunks.capacity())
     {
-        int fd = map_address->extra.fd;
-        map_address->unmap();
-        ::close(fd);
+        release(chunks.front());
+        chunks.erase(chunks.begin());
     }
-}
+    chunks.push_back(current);
 
+    size_t ahead = std::min<size_t>(4 * chunk_size, begin + m->mapped - current);
+    madvise((void*)current, ahead, MADV_SEQUENTIAL);
+}
 
-void shared_memory::unmap()
+void scan_guard::release(const char *chunk)
 {
-    munmap((char*)this, current_size);
+    auto m = mapping_of(&mem);
+    if(!m) return;
+    size_t length = std::min<size_t>(chunk_size, (const char*)&mem + m->mapped - chunk);
+
+    // The header is used by every allocation
+    if(chunk == (const char*)&mem) return;
+
+    madvise((void*)chunk, length, MADV_NORMAL);
+#ifdef MADV_COLD
+    madvise((void*)chunk, length, MADV_COLD);
+#endif
+    if(!keep_private) madvise((void*)chunk, length, MADV_DONTNEED);
 }
 
 
-#define MREMAP 0    // 1 on Linux
+// shared_memory::extend_to
+//
+// Grows the heap so that it contains @new_top.  Only the new pages are mapped,
+// over the reserved addresses, so the existing pages are never unmapped.
+// Called with mem_mutex held.
 
 bool shared_memory::extend_to(void * new_top)
 {
     if(current_size == max_size) return false;
     
-    // assert(map_address == base_address);
     size_t old_length = current_size;
-    size_t new_length = old_length + (old_length>>1);
     size_t min_length = (char*)new_top - (char*)this;
-    
-    
-    while(new_length < max_size && new_length < min_length)
-        new_length += (new_length>>1);
+    size_t new_length = old_length, step = std::max<size_t>(growth_amount, 1);
+
+    switch(growth_mode)
+    {
+    case grow_geometric:
+        do new_length += std::max<size_t>(new_length/100 * growth_amount, 4096);
+        while(new_length < max_size && new_length < min_length);
+        break;
+    case grow_fixed:
+        new_length += (min_length - old_length + step - 1) / step * step;
+        break;
+    case grow_exact:
+        new_length = min_length;
+        break;
+    }
 
+    new_length = heap_flags & huge_pages ? round_up(new_length, huge_page_size) : round_to_page(new_length);
     if(new_length > max_size)
         new_length = max_size;
 
     if(new_length < min_length) return false;
 
-    
-    // extend the file a bit
-    // fd==-1 when we use an anomymous/temporary mapping.
-    if(this->extra.fd != -1)
-    {
-        char c=0;
-        lseek(this->extra.fd, new_length-1, SEEK_SET);
-        write(this->extra.fd, &c, 1);
-    }
-#if MREMAP
-    void *new_address = mremap((char*)map_address, old_length, new_length, 0);  // Do NOT relocate it
-
-    if(new_address)
-    {
-        // remap successful
-        length = new_length;
-    }
-#else
-
-    int mapFlags = this->extra.mapFlags;
-    int fd = this->extra.fd;
-    
-    munmap((char*)this, old_length);
+    // The file may already have been extended by another process, see size_file
+    auto m = mapping_of(this);
+    m->acquire();
 
-    char *m = (char*)mmap((char*)this, new_length, PROT_WRITE|PROT_READ, mapFlags, fd, 0);
+    bool mapped = size_file(m->fd, new_length, heap_flags & preallocate) && map_to(this, *m, new_length);
+    m->release();
 
-    if(m == MAP_FAILED)
-    {
-        // Go back to the original map then
-        char *m = (char*)mmap((char*)this, old_length, PROT_WRITE|PROT_READ, mapFlags, fd, 0);
-        assert(m != MAP_FAILED);
-        assert(m == (char*)this);
-        return false;
-    }
-    else
-    {
-        assert(m == (char*)this);
-        current_size = new_length;
-        end = (char*)this + new_length;
-        return true;
-    }
+    if(!mapped) return false;
 
-#endif
+    current_size = new_length;
+    end = new_length;
+    m->generation = ++generation;
+    return true;
 }
 
 
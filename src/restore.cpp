@@ -0,0 +1,26 @@
+// restore.cpp
+// Applies the backups written by shared_memory::backup() to a heap file, in order
+
+#include <iostream>
+#include <persist.h>
+
+
+int main(int argc, char*argv[])
+{
+    if(argc < 3)
+    {
+        std::cout << "Usage: " << argv[0] << " file backup ...\n";
+        return 1;
+    }
+
+    for(int i=2; i<argc; ++i)
+    {
+        if(!persist::shared_memory::restore(argv[1], argv[i]))
+        {
+            std::cout << "Could not apply " << argv[i] << " to " << argv[1] << std::endl;
+            return 2;
+        }
+    }
+
+    return 0;
+}
@@ -1,6 +1,28 @@
 
 #include <../../simpletest/simpletest.hpp>
 #include "persist.h"
+#include "persist_btree.h"
+#include "persist_compact.h"
+#include "persist_hash.h"
+#include "persist_radix.h"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 class TestPersist : public Test::Fixture<TestPersist>
 {
@@ -14,6 +36,33 @@ public:
         AddTest(&TestPersist::TestLimits);
         AddTest(&TestPersist::TestModes);
         AddTest(&TestPersist::TestAllocators);
+        AddTest(&TestPersist::TestStaticAllocators);
+        AddTest(&TestPersist::TestThreadCaches);
+        AddTest(&TestPersist::TestSlabs);
+        AddTest(&TestPersist::TestLargeBlocks);
+        AddTest(&TestPersist::TestCells);
+        AddTest(&TestPersist::TestFastMalloc);
+        AddTest(&TestPersist::TestArenas);
+        AddTest(&TestPersist::TestGrowth);
+        AddTest(&TestPersist::TestCompact);
+        AddTest(&TestPersist::TestFlatHashMap);
+        AddTest(&TestPersist::TestBtree);
+        AddTest(&TestPersist::TestRadix);
+#ifndef _WIN32
+        AddTest(&TestPersist::TestLockFree);
+        AddTest(&TestPersist::TestSharedGrowth);
+        AddTest(&TestPersist::TestGrowthPolicy);
+        AddTest(&TestPersist::TestHugePages);
+        AddTest(&TestPersist::TestWarmup);
+        AddTest(&TestPersist::TestWorkingSet);
+        AddTest(&TestPersist::TestScanGuard);
+        AddTest(&TestPersist::TestCheckpoint);
+        AddTest(&TestPersist::TestTransactions);
+        AddTest(&TestPersist::TestSnapshot);
+        AddTest(&TestPersist::TestBackup);
+        AddTest(&TestPersist::TestReplication);
+        AddTest(&TestPersist::TestRelocatable);
+#endif
     }
 
     void DefaultConstructor()
@@ -54,6 +103,18 @@ public:
         }, __FILE__,__LINE__);
     }
     
+    // A temporary heap whose root has been allocated, so that the blocks a test
+    // allocates are not the root
+    struct temp_file : persist::map_file
+    {
+        temp_file(size_t limit, size_t initial = 16384, int flags = 0) :
+            map_file(nullptr, 0,0,0, initial, limit, persist::temp_heap|flags)
+        {
+            CHECK(*this);
+            data().malloc(100);  // The root
+        }
+    };
+
     typedef std::basic_string<char, std::char_traits<char>, persist::allocator<char>> pstring;
     typedef std::basic_string<char, std::char_traits<char>, persist::fast_allocator<char>> fstring;
 
@@ -188,6 +249,1378 @@ public:
         
         persist::map_data<Demo> data { file.data(), file.data() };
     }
+
+    typedef persist::heap_tag<struct static_heap_tag> static_heap;
+
+    template<class T>
+    using static_allocator = persist::static_allocator<T, static_heap>;
+
+    void TestStaticAllocators()
+    {
+        persist::map_file file(nullptr, 0,0,0,16384, 16<<20, persist::temp_heap);
+        CHECK(file);
+        static_heap::bind(file);
+
+        typedef std::basic_string<char, std::char_traits<char>, static_allocator<char>> string;
+        typedef std::map<string, std::vector<int, static_allocator<int>>, std::less<string>,
+            static_allocator<std::pair<const string, std::vector<int, static_allocator<int>>>>> map;
+
+        // The allocator takes no space in the containers
+        static_assert(std::is_empty<static_allocator<int>>::value);
+        static_assert(sizeof(std::vector<int, static_allocator<int>>) == sizeof(std::vector<int>));
+        static_assert(sizeof(string) == sizeof(std::string));
+        CHECK(static_allocator<int>() == static_allocator<char>());
+
+        size_t before = file.data().size();
+        {
+            map m;
+            for(int i=0; i<1000; ++i)
+                m[string("a key that is too long to be stored in the string itself ") + std::to_string(i).c_str()].push_back(i);
+            EQUALS(1000, m.size());
+            EQUALS(42, m[string("a key that is too long to be stored in the string itself 42")][0]);
+            CHECK(file.data().size() > before);
+        }
+    }
+
+    void TestThreadCaches()
+    {
+        persist::map_file file(nullptr, 0,0,0,16384, 64<<20, persist::temp_heap);
+        CHECK(file);
+        auto &mem = file.data();
+
+        const int threads = 8, blocks = 2000;
+        std::vector<std::thread> workers;
+        std::vector<int> errors(threads);
+
+        for(int t=0; t<threads; ++t)
+        {
+            workers.emplace_back([&mem, &errors, t]() {
+                for(int round=0; round<10; ++round)
+                {
+                    std::vector<int*> ptrs;
+                    for(int i=0; i<blocks; ++i)
+                    {
+                        auto p = (int*)mem.malloc(8 + 8*(i%32));
+                        if(!p) { ++errors[t]; continue; }
+                        *p = t*blocks + i;
+                        ptrs.push_back(p);
+                    }
+                    for(size_t i=0; i<ptrs.size(); ++i)
+                    {
+                        if(*ptrs[i] != t*blocks + int(i)) ++errors[t];
+                        mem.free(ptrs[i], 8 + 8*(i%32));
+                    }
+                }
+            });
+        }
+
+        for(auto &w : workers) w.join();
+
+        for(auto e : errors) EQUALS(0, e);
+
+        // The exited threads have returned their blocks, so they are reused
+        auto size = mem.size();
+        for(int i=0; i<blocks; ++i)
+            CHECK(mem.malloc(8 + 8*(i%32)));
+        EQUALS(size, mem.size());
+    }
+
+    void TestSlabs()
+    {
+        temp_file file(1<<20);
+        auto &mem = file.data();
+
+        // Each thread returns its cached blocks to the slabs when it exits
+        std::vector<char*> blocks;
+        std::thread([&]() {
+            for(int i=0; i<1000; ++i)
+                blocks.push_back((char*)mem.malloc(64, 0));
+        }).join();
+
+        // Blocks are packed in address order
+        for(size_t i=1; i<blocks.size(); ++i)
+            CHECK(blocks[i] > blocks[i-1]);
+        CHECK(blocks.back() - blocks.front() < 1000*64*11/10);
+
+        auto size = mem.size();
+
+        std::thread([&]() {
+            for(auto p : blocks) mem.free(p, 64);
+        }).join();
+
+        // Free slabs are reused for other sizes in the same arena
+        std::thread([&]() {
+            for(int i=0; i<200; ++i)
+                CHECK(mem.malloc(200, 0));
+        }).join();
+
+        EQUALS(size, mem.size());
+    }
+
+    void TestLargeBlocks()
+    {
+        temp_file file(64<<20);
+        auto &mem = file.data();
+
+        // Neighbouring free blocks are merged
+        auto a = mem.malloc(100000), b = mem.malloc(100000), c = mem.malloc(100);
+        auto size = mem.size();
+        mem.free(a, 100000);
+        mem.free(b, 100000);
+        auto d = mem.malloc(200000);
+        CHECK(d == a);
+        CHECK((char*)c >= (char*)d + 200000);
+        ValidateMemory(d, 200000);
+        EQUALS(size, mem.size());
+
+        // Blocks at the end of the heap are given back to the top of the heap
+        auto e = mem.malloc(1000000);
+        CHECK(mem.size() > size + 1000000);
+        mem.free(e, 1000000);
+        CHECK(mem.size() <= size + 8);  // The end of the chunk is left behind
+
+        // A growing and shrinking vector does not grow the heap
+        std::vector<std::pair<void*, size_t>> blocks;
+        for(int i=0; i<2000; ++i)
+        {
+            size_t n = 1000 + (i*7919) % 100000;
+            auto p = mem.malloc(n);
+            CHECK(p);
+            blocks.push_back({p, n});
+            if(blocks.size() > 10)
+            {
+                auto victim = blocks.begin() + (i*31) % blocks.size();
+                mem.free(victim->first, victim->second);
+                blocks.erase(victim);
+            }
+        }
+        CHECK(mem.size() < size + 4000000);
+    }
+
+    void TestCells()
+    {
+        // Every size maps to the smallest cell that holds it
+        for(size_t size=1; size<=persist::max_cell_size; ++size)
+        {
+            int cell = persist::object_cell(size);
+            CHECK(size <= persist::cell_size(cell));
+            CHECK(cell==0 || size > persist::cell_size(cell-1));
+        }
+        static_assert(persist::object_cell(100) == 10, "Cell computed at compile time");
+        EQUALS(112, persist::cell_size(10));
+
+        temp_file file(1<<20);
+        auto &mem = file.data();
+
+        // Blocks from the allocator are interchangeable with malloc() and free()
+        struct node { char data[100]; };
+        persist::allocator<node> alloc(mem);
+        auto p = alloc.allocate(1);
+        mem.free(p, sizeof(node));
+        auto q = (node*)mem.malloc(sizeof(node));
+        CHECK(p == q);
+        alloc.deallocate(q, 1);
+        CHECK(alloc.allocate(1) == p);
+    }
+
+    void TestFastMalloc()
+    {
+        temp_file file(64<<20, 1<<20);
+        auto &mem = file.data();
+
+        const int threads = 4, blocks = 10000;
+        std::vector<std::vector<int*>> ptrs(threads);
+        std::vector<std::thread> workers;
+
+        for(int t=0; t<threads; ++t)
+        {
+            workers.emplace_back([&mem, &ptrs, t]() {
+                for(int i=0; i<blocks; ++i)
+                {
+                    auto p = (int*)mem.fast_malloc(24);
+                    if(p) *p = t*blocks + i;
+                    ptrs[t].push_back(p);
+                }
+            });
+        }
+        for(auto &w : workers) w.join();
+
+        for(int t=0; t<threads; ++t)
+        {
+            for(int i=0; i<blocks; ++i)
+            {
+                CHECK(ptrs[t][i]);
+                EQUALS(t*blocks + i, *ptrs[t][i]);
+            }
+            // Each thread allocates contiguously within its chunk
+            EQUALS((char*)ptrs[t][0] + 24, (char*)ptrs[t][1]);
+        }
+
+        // A thread's unused chunk goes back to the top of the heap when it exits...
+        mem.clear();
+        mem.malloc(100);
+        auto size = mem.size();
+        std::thread([&]() { mem.fast_malloc(24); }).join();
+        EQUALS(size + 24, mem.size());
+
+        // ... or becomes a free block of the thread's arena
+        char *chunk;
+        std::thread([&]() {
+            mem.malloc(16, 3);
+            chunk = (char*)mem.fast_malloc(24);
+            mem.malloc(5000, 3);
+        }).join();
+        auto block = (char*)mem.malloc(30000, 3);
+        CHECK(block > chunk && block < chunk + 65536);
+
+        // Clearing the heap forgets this thread's chunk
+        mem.fast_malloc(8);
+        mem.clear();
+        auto root = mem.malloc(100);
+        CHECK(root == mem.root());
+        CHECK(mem.fast_malloc(8) > root);
+    }
+
+    void TestArenas()
+    {
+        temp_file file(16<<20);
+        auto &mem = file.data();
+
+        // Arenas do not share slabs or large blocks
+        std::vector<void*> small, large;
+        for(int arena=0; arena<persist::arena_count; ++arena)
+        {
+            small.push_back(mem.malloc(64, arena));
+            large.push_back(mem.malloc(10000, arena));
+        }
+        for(int i=1; i<persist::arena_count; ++i)
+        {
+            CHECK(((std::uintptr_t)small[i] ^ (std::uintptr_t)small[0]) >= 4096);
+            CHECK(large[i] != large[0]);
+        }
+
+        // Threads are given different arenas
+        std::vector<void*> first(persist::arena_count);
+        for(int t=0; t<persist::arena_count; ++t)
+            std::thread([&]() { first[t] = mem.malloc(64); mem.free(first[t], 64); }).join();
+        for(int t=1; t<persist::arena_count; ++t)
+            CHECK(((std::uintptr_t)first[t] ^ (std::uintptr_t)first[0]) >= 4096);
+
+        // Blocks freed by another thread go back to the arena that allocated them
+        persist::allocator<std::pair<double,double>> alloc1(mem, 1);
+        auto a = mem.malloc(5000, 2);
+        auto b = alloc1.allocate(1);
+        std::thread([&]() {
+            mem.free(a, 5000);
+            alloc1.deallocate(b, 1);
+        }).join();
+        CHECK(mem.malloc(5000, 2) == a);
+        std::thread([&]() { CHECK(alloc1.allocate(1) == b); }).join();
+    }
+
+    void TestGrowth()
+    {
+        persist::map_file file("file.db", 0,0,0,16384, 256<<20, persist::create_new);
+        CHECK(file);
+        auto &mem = file.data();
+        auto root = (int*)mem.malloc(100);
+        *root = 42;
+
+        // The heap grows in place, while other threads read and write it
+        const int threads = 4;
+        std::vector<std::thread> workers;
+        std::vector<int> errors(threads);
+        for(int t=0; t<threads; ++t)
+        {
+            workers.emplace_back([&mem, &errors, root, t]() {
+                std::vector<std::pair<char*, size_t>> blocks;
+                for(int i=0; i<2000; ++i)
+                {
+                    size_t size = 100 + (i*7919 + t) % 20000;
+                    auto p = (char*)mem.malloc(size);
+                    if(!p) { ++errors[t]; continue; }
+                    memset(p, t, size);
+                    blocks.push_back({p, size});
+                    if(*root != 42) ++errors[t];
+                }
+                for(auto b : blocks)
+                    if(b.first[0] != t || b.first[b.second-1] != t) ++errors[t];
+            });
+        }
+        for(auto &w : workers) w.join();
+
+        for(auto e : errors) EQUALS(0, e);
+        CHECK(mem.capacity() + mem.size() <= 256<<20);
+        CHECK(mem.size() > threads*2000*5000);
+        EQUALS(42, *root);
+    }
+
+    void TestCompact()
+    {
+        temp_file file(256<<20);
+        auto &mem = file.data();
+
+        // A node of a compact map is 24 bytes, instead of 40
+        {
+            typedef std::pair<const int, int> value;
+            std::map<int, int, std::less<int>, persist::allocator<value>> big{std::less<int>(), persist::allocator<value>(mem)};
+            size_t before = mem.size();
+            for(int i=0; i<100000; ++i) big[i] = i;
+            size_t big_size = mem.size() - before;
+
+            persist::compact_map<int, int> small(mem);
+            before = mem.size();
+            for(int i=0; i<100000; ++i) small[i] = i;
+            size_t small_size = mem.size() - before;
+            CHECK(small_size * 10 <= big_size * 7);
+        }
+
+        // The containers behave like the standard ones
+        std::map<int, int> map;
+        std::set<int> set;
+        std::list<int> list;
+        std::unordered_map<int, int> hash;
+        persist::compact_map<int, int> cmap(mem);
+        persist::compact_set<int> cset(mem);
+        persist::compact_list<int> clist(mem);
+        persist::compact_hash_map<int, int> chash(mem);
+
+        unsigned r = 1;
+        for(int i=0; i<200000; ++i)
+        {
+            r = r * 1103515245 + 12345;
+            int key = (r >> 8) % 5000;
+            if(r & 1)
+            {
+                map[key] = i; cmap[key] = i;
+                set.insert(key); cset.insert(key);
+                hash[key] = i; chash[key] = i;
+                if(r & 2) list.push_back(key), clist.push_back(key);
+                else list.push_front(key), clist.push_front(key);
+            }
+            else
+            {
+                EQUALS(map.erase(key), cmap.erase(key));
+                EQUALS(set.erase(key), cset.erase(key));
+                EQUALS(hash.erase(key), chash.erase(key));
+                if(!list.empty())
+                {
+                    if(r & 2) list.pop_back(), clist.pop_back();
+                    else list.pop_front(), clist.pop_front();
+                }
+            }
+        }
+
+        EQUALS(map.size(), cmap.size());
+        CHECK(std::equal(map.begin(), map.end(), cmap.begin(), cmap.end()));
+        CHECK(std::equal(map.rbegin(), map.rend(), std::reverse_iterator<persist::compact_map<int, int>::iterator>(cmap.end()),
+            std::reverse_iterator<persist::compact_map<int, int>::iterator>(cmap.begin())));
+        CHECK(std::equal(set.begin(), set.end(), cset.begin(), cset.end()));
+        CHECK(std::equal(list.begin(), list.end(), clist.begin(), clist.end()));
+        EQUALS(hash.size(), chash.size());
+        EQUALS(hash.size(), (size_t)std::distance(chash.begin(), chash.end()));
+        for(auto &p : chash) EQUALS(hash[p.first], p.second);
+
+        EQUALS(map.lower_bound(2500)->first, cmap.lower_bound(2500)->first);
+        EQUALS(map.upper_bound(2500)->first, cmap.upper_bound(2500)->first);
+        CHECK(cmap.find(5000) == cmap.end());
+        CHECK(chash.find(5000) == chash.end());
+
+        // Erasing while iterating
+        for(auto i = cmap.begin(); i != cmap.end(); )
+            i = i->first % 2 ? cmap.erase(i) : std::next(i);
+        for(auto i = chash.begin(); i != chash.end(); )
+            i = i->first % 2 ? chash.erase(i) : std::next(i);
+        for(auto &p : cmap) EQUALS(0, p.first % 2);
+        for(auto &p : chash) EQUALS(0, p.first % 2);
+        EQUALS(cmap.size(), chash.size());
+
+        cmap.clear(); cset.clear(); clist.clear(); chash.clear();
+        CHECK(cmap.empty() && cset.empty() && clist.empty() && chash.empty());
+        CHECK(cmap.begin() == cmap.end());
+
+        // A block beyond the first 32GB cannot be linked
+        bool thrown = false;
+        try { persist::compact_ptr<int>(mem, (const int*)((const char*)&mem + (std::size_t(32) << 30))); }
+        catch(std::length_error &) { thrown = true; }
+        CHECK(thrown);
+    }
+
+    // Puts every key into the same group, with the same control byte
+    struct collide
+    {
+        size_t operator()(int) const { return 42; }
+    };
+
+    void TestFlatHashMap()
+    {
+        temp_file file(64<<20);
+        auto &mem = file.data();
+
+        CHECK(persist::hash_bytes("abc", 3) != persist::hash_bytes("abd", 3));
+        CHECK(persist::hash_bytes("a string longer than 48 bytes, which is hashed in parts", 55) !=
+            persist::hash_bytes("a string longer than 48 bytes, which is hashed in part!", 55));
+        EQUALS(persist::hash<std::string>()("key"), persist::hash_bytes("key", 3));
+
+        persist::flat_hash_map<int, std::string> map(mem);
+        std::unordered_map<int, std::string> expected;
+        CHECK(map.find(1) == map.end());
+
+        unsigned r = 1;
+        for(int i=0; i<200000; ++i)
+        {
+            r = r * 1103515245 + 12345;
+            int key = (r >> 8) % 20000;
+            if(r & 1)
+                map[key] = expected[key] = std::to_string(i);
+            else
+                EQUALS(expected.erase(key), map.erase(key));
+        }
+
+        EQUALS(expected.size(), map.size());
+        EQUALS(expected.size(), (size_t)std::distance(map.begin(), map.end()));
+        for(auto &p : map) CHECK(expected[p.first] == p.second);
+        for(auto &p : expected) CHECK(map.find(p.first)->second == p.second);
+
+        for(auto i = map.begin(); i != map.end(); )
+            i = i->first % 2 ? map.erase(i) : std::next(i);
+        for(auto &p : map) EQUALS(0, p.first % 2);
+        EQUALS(expected.count(2) == 0, map.insert({ 2, "two" }).second);
+
+        // Long probes, and deleted slots in full groups
+        persist::flat_hash_map<int, int, collide> collisions(mem);
+        for(int i=0; i<1000; ++i) collisions[i] = i;
+        for(int i=0; i<1000; i+=3) collisions.erase(i);
+        for(int i=0; i<1000; ++i) EQUALS(i%3 ? 1 : 0, collisions.count(i));
+        for(int i=0; i<1000; i+=3) collisions[i] = -i;
+        EQUALS(1000, collisions.size());
+        EQUALS(-999, collisions[999]);
+
+        map.clear();
+        CHECK(map.empty() && map.begin() == map.end());
+    }
+
+    template<class Map, class Key>
+    void CheckBtree(persist::shared_memory &mem, Key key)
+    {
+        Map map(mem);
+        std::map<decltype(key(0)), int> expected;
+        CHECK(map.begin() == map.end());
+        CHECK(map.find(key(1)) == map.end());
+
+        unsigned r = 1;
+        for(int i=0; i<100000; ++i)
+        {
+            r = r * 1103515245 + 12345;
+            auto k = key((r >> 8) % 5000);
+            if(r & 3)
+                map[k] = expected[k] = i;
+            else
+                EQUALS(expected.erase(k), map.erase(k));
+        }
+
+        EQUALS(expected.size(), map.size());
+        CHECK(std::equal(expected.begin(), expected.end(), map.begin(), map.end()));
+        CHECK(std::equal(expected.rbegin(), expected.rend(), map.rbegin(), map.rend()));
+        for(int i=0; i<5000; i+=7)
+        {
+            CHECK(expected.lower_bound(key(i)) == expected.end() ? map.lower_bound(key(i)) == map.end() : map.lower_bound(key(i))->first == expected.lower_bound(key(i))->first);
+            CHECK(expected.upper_bound(key(i)) == expected.end() ? map.upper_bound(key(i)) == map.end() : map.upper_bound(key(i))->first == expected.upper_bound(key(i))->first);
+            EQUALS(expected.count(key(i)), map.count(key(i)));
+        }
+
+        // Erasing a range, which empties and removes leaves
+        auto from = map.lower_bound(key(1000));
+        while(from != map.end() && from->first < key(4000)) from = map.erase(from);
+        expected.erase(expected.lower_bound(key(1000)), expected.lower_bound(key(4000)));
+        CHECK(std::equal(expected.begin(), expected.end(), map.begin(), map.end()));
+
+        for(auto i = map.begin(); i != map.end(); ) i = map.erase(i);
+        CHECK(map.empty() && map.begin() == map.end());
+        map[key(1)] = 1;
+        EQUALS(1, map.size());
+    }
+
+    void TestBtree()
+    {
+        temp_file file(64<<20);
+        auto &mem = file.data();
+
+        // Small nodes make deep trees
+        CheckBtree<persist::btree_map<int, int, std::less<int>, 128>>(mem, [](int i) { return i; });
+        CheckBtree<persist::btree_map<int, int>>(mem, [](int i) { return i; });
+        CheckBtree<persist::btree_map<std::string, int, std::less<std::string>, 256>>(mem, [](int i) { return "key " + std::to_string(i); });
+
+        // Keys inserted in order, forwards or backwards, fill their leaves
+        typedef persist::btree_map<int, int, std::less<int>, 128> small_map;
+        for(int step : { 1, -1 })
+        {
+            temp_file ordered(16<<20, 16384, persist::relocatable);  // Mapped away from the other heap
+            size_t before = ordered.data().size();
+            small_map map(ordered.data());
+            for(int i=0; i<20000; ++i) map[step * i] = i;
+            EQUALS(20000, map.size());
+            CHECK(std::is_sorted(map.begin(), map.end()));
+            CHECK(ordered.data().size() - before < 20000 / small_map::leaf_capacity * 128 * 3 / 2);
+        }
+    }
+
+    void TestRadix()
+    {
+        temp_file file(64<<20);
+        auto &mem = file.data();
+
+        persist::radix_map<std::string, int> map(mem);
+        std::map<std::string, int> expected;
+        CHECK(map.begin() == map.end());
+        CHECK(map.find("a") == map.end());
+
+        // Keys that are prefixes of each other, and with shared prefixes longer than a node keeps
+        const char *stems[] = { "", "a", "ab", "Person #", "a long shared prefix of many bytes ", "a long shared prefix of other bytes " };
+        unsigned r = 1;
+        auto key = [&]() {
+            r = r * 1103515245 + 12345;
+            std::string k = stems[(r >> 8) % 6];
+            int n = (r >> 12) % 3000;
+            return n % 10 ? k + std::to_string(n) : k.substr(0, n % (k.size() + 1));
+        };
+
+        for(int i=0; i<100000; ++i)
+        {
+            auto k = key();
+            if(r & 0x10000)
+                map[k] = expected[k] = i;
+            else
+                EQUALS(expected.erase(k), map.erase(k));
+        }
+
+        EQUALS(expected.size(), map.size());
+        CHECK(std::equal(expected.begin(), expected.end(), map.begin(), map.end()));
+        CHECK(std::equal(expected.rbegin(), expected.rend(), std::reverse_iterator<decltype(map.end())>(map.end()),
+            std::reverse_iterator<decltype(map.begin())>(map.begin())));
+
+        // Prefix scans
+        for(auto prefix : { "", "a", "ab", "Person #1", "Person #12", "Person #9999", "a long", "a long shared prefix of m", "b" })
+        {
+            auto range = map.prefix_range(prefix);
+            auto from = expected.lower_bound(prefix), to = from;
+            while(to != expected.end() && to->first.compare(0, strlen(prefix), prefix) == 0) ++to;
+            CHECK(std::equal(from, to, range.first, range.second));
+        }
+
+        for(auto i = map.begin(); i != map.end(); )
+            i = i->second % 2 ? map.erase(i) : std::next(i);
+        for(auto &p : map) EQUALS(0, p.second % 2);
+        for(auto &p : expected) EQUALS(p.second % 2 == 0, map.count(p.first) == 1);
+
+        map.clear();
+        CHECK(map.empty() && map.begin() == map.end());
+        map["x"] = 1;
+        EQUALS(1, map["x"]);
+
+        // Nodes of every size, which shrink again
+        persist::radix_map<std::string, int> wide(mem);
+        std::map<std::string, int> wide_expected;
+        for(int i=0; i<256*20; ++i)
+        {
+            std::string k { char(i % 256), char(i / 256) };
+            wide[k] = wide_expected[k] = i;
+        }
+        CHECK(std::equal(wide_expected.begin(), wide_expected.end(), wide.begin(), wide.end()));
+
+        for(int i=0; i<256*20; ++i)
+        {
+            if(i % 256 < 3 && i / 256 < 2) continue;
+            std::string k { char(i % 256), char(i / 256) };
+            EQUALS(1, wide.erase(k));
+            wide_expected.erase(k);
+            if(i % 997 == 0) CHECK(std::equal(wide_expected.begin(), wide_expected.end(), wide.begin(), wide.end()));
+        }
+        EQUALS(6, wide.size());
+        CHECK(std::equal(wide_expected.begin(), wide_expected.end(), wide.begin(), wide.end()));
+        for(auto &p : wide_expected) EQUALS(p.second, wide.find(p.first)->second);
+    }
+
+#ifndef _WIN32
+    void TestLockFree()
+    {
+        // Large enough not to grow while the processes are running
+        temp_file file(64<<20, 32<<20, persist::lock_free);
+        auto &mem = file.data();
+
+        // Blocks are reused most recently freed first
+        auto a = mem.malloc(40), b = mem.malloc(40);
+        mem.free(a, 40);
+        mem.free(b, 40);
+        CHECK(mem.malloc(40) == b);
+        CHECK(mem.malloc(40) == a);
+
+        // Processes allocate and free the same sizes at the same time, and check
+        // that no one else has been given their blocks
+        const int processes = 4, rounds = 20000, live = 64;
+        std::vector<pid_t> children;
+
+        for(int p=0; p<processes; ++p)
+        {
+            pid_t pid = fork();
+            if(pid == 0)
+            {
+                int *blocks[live] = {};
+                size_t sizes[live] = {};
+                unsigned seed = p+1, errors = 0;
+
+                for(int i=0; i<rounds; ++i)
+                {
+                    int slot = (seed = seed*1103515245 + 12345) % live;
+                    if(blocks[slot])
+                    {
+                        for(size_t j=0; j<sizes[slot]/sizeof(int); ++j)
+                            if(blocks[slot][j] != p*live + slot) ++errors;
+                        mem.free(blocks[slot], sizes[slot]);
+                    }
+
+                    sizes[slot] = 8 + (seed>>8) % 200;
+                    blocks[slot] = (int*)mem.malloc(sizes[slot]);
+                    if(!blocks[slot]) { ++errors; continue; }
+                    for(size_t j=0; j<sizes[slot]/sizeof(int); ++j)
+                        blocks[slot][j] = p*live + slot;
+                }
+                _exit(errors ? 1 : 0);
+            }
+            children.push_back(pid);
+        }
+
+        for(auto pid : children)
+        {
+            int status = -1;
+            waitpid(pid, &status, 0);
+            CHECK(WIFEXITED(status));
+            EQUALS(0, WEXITSTATUS(status));
+        }
+
+        // Freed blocks were reused: there are never more than processes*live blocks of any cell
+        CHECK(mem.size() < 2<<20);
+    }
+
+    void TestSharedGrowth()
+    {
+        persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::create_new);
+        CHECK(file);
+        auto &mem = file.data();
+        mem.malloc(100);  // The root
+
+        int to_child[2], to_parent[2];
+        CHECK(pipe(to_child) == 0 && pipe(to_parent) == 0);
+
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            // The child reads pages that the parent has added, which it maps when they are accessed
+            char *p;
+            int errors = 0;
+            if(read(to_child[0], &p, sizeof p) != sizeof p) _exit(2);
+            for(int i=0; i<(4<<20); i+=1000)
+                if(p[i] != 7) ++errors;
+
+            // The child grows the heap further
+            char *q = (char*)mem.malloc(8<<20);
+            if(!q) _exit(3);
+            memset(q, 9, 8<<20);
+            if(write(to_parent[1], &q, sizeof q) != sizeof q) _exit(4);
+            _exit(errors ? 1 : 0);
+        }
+
+        char *p = (char*)mem.malloc(4<<20);
+        CHECK(p);
+        memset(p, 7, 4<<20);
+        EQUALS(sizeof p, write(to_child[1], &p, sizeof p));
+
+        char *q;
+        EQUALS(sizeof q, read(to_parent[0], &q, sizeof q));
+        CHECK(mem.refresh());
+        CHECK(!mem.refresh());
+        for(int i=0; i<(8<<20); i+=1000)
+            EQUALS(9, q[i]);
+
+        int status = -1;
+        waitpid(pid, &status, 0);
+        CHECK(WIFEXITED(status));
+        EQUALS(0, WEXITSTATUS(status));
+
+        for(int fd : { to_child[0], to_child[1], to_parent[0], to_parent[1] })
+            close(fd);
+    }
+
+    static struct stat file_stat(const char *filename)
+    {
+        struct stat st = {};
+        stat(filename, &st);
+        return st;
+    }
+
+    void TestGrowthPolicy()
+    {
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::create_new|persist::preallocate);
+            CHECK(file);
+            auto &mem = file.data();
+            mem.malloc(100);  // The root
+
+            // The whole file is allocated on disk
+            auto st = file_stat("file.db");
+            EQUALS(16384, st.st_size);
+            CHECK(st.st_blocks*512 >= st.st_size);
+
+            // Fixed growth
+            mem.growth(persist::grow_fixed, 1<<20);
+            mem.malloc(100000);
+            st = file_stat("file.db");
+            EQUALS(16384 + (1<<20), st.st_size);
+            CHECK(st.st_blocks*512 >= st.st_size);
+
+            mem.malloc(2<<20);
+            EQUALS(0, (file_stat("file.db").st_size - 16384) % (1<<20));
+        }
+
+        {
+            // Exact growth, to the next page
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::create_new);
+            auto &mem = file.data();
+            mem.malloc(100);
+            mem.growth(persist::grow_exact, 0);
+            auto p = (char*)mem.malloc(100000);
+            auto size = file_stat("file.db").st_size;
+            CHECK(size >= p + 100000 - (char*)&mem);
+            CHECK(size < p + 100000 - (char*)&mem + 4096*2);
+
+            // Geometric growth, by 100%
+            mem.growth(persist::grow_geometric, 100);
+            mem.malloc(100000);
+            auto new_size = file_stat("file.db").st_size;
+            CHECK(new_size >= 2*size && new_size < 2*size + 4096);
+        }
+    }
+
+    void TestHugePages()
+    {
+        const size_t huge_page = 2<<20;
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::create_new|persist::huge_pages);
+            CHECK(file);
+            auto &mem = file.data();
+            EQUALS(huge_page, file_stat("file.db").st_size);
+
+            mem.growth(persist::grow_exact, 0);
+            auto p = (char*)mem.malloc(3<<20);
+            CHECK(p);
+            memset(p, 1, 3<<20);
+            EQUALS(0, file_stat("file.db").st_size % huge_page);
+        }
+
+        {
+            // The flag is kept in the heap
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20);
+            auto &mem = file.data();
+            CHECK(mem.malloc(3<<20));
+            EQUALS(0, file_stat("file.db").st_size % huge_page);
+        }
+
+        {
+            // Uses hugetlbfs if the system has huge pages
+            persist::map_file file(nullptr, 0,0,0,16384, 64<<20, persist::temp_heap|persist::huge_pages);
+            CHECK(file);
+            auto &mem = file.data();
+            for(int i=0; i<100; ++i)
+            {
+                auto p = mem.malloc(100000);
+                CHECK(p);
+                memset(p, 1, 100000);
+            }
+        }
+    }
+
+    void TestWarmup()
+    {
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::create_new);
+            auto &mem = file.data();
+            mem.malloc(100);
+            memset(mem.malloc(8<<20), 1, 8<<20);
+        }
+
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20);
+            auto &mem = file.data();
+            CHECK(mem.warmup(persist::warm_willneed|persist::warm_prefault, 3) >= 0);
+            CHECK(mem.resident() >= mem.size());
+
+            // Only the first 64KB
+            CHECK(mem.warmup(persist::warm_prefault, 1, 65536) >= 0);
+
+            // Locking may be limited by RLIMIT_MEMLOCK
+            auto t = mem.warmup(persist::warm_lock, 0, 65536);
+            CHECK(t >= 0 || t == -1);
+        }
+
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::populate);
+            auto &mem = file.data();
+            CHECK(mem.resident() >= mem.size());
+
+            // New pages are populated too
+            memset(mem.malloc(8<<20), 1, 8<<20);
+            CHECK(mem.resident() >= mem.size());
+        }
+    }
+
+    void TestWorkingSet()
+    {
+        remove("file.db.pages");
+
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::create_new|persist::working_set);
+            auto &mem = file.data();
+            mem.malloc(100);
+            memset(mem.malloc(4<<20), 1, 4<<20);
+        }
+
+        // One bit per page, after a small header
+        auto st = file_stat("file.db.pages");
+        CHECK(st.st_size > (4<<20)/4096/8);
+
+        for(int i=0; i<3; ++i)
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::working_set);
+            auto &mem = file.data();
+            CHECK(mem.size() > (4<<20));
+            if(i==1) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        EQUALS(st.st_size, file_stat("file.db.pages").st_size);
+
+        // Without the flag, nothing is recorded
+        remove("file.db.pages");
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20);
+        }
+        EQUALS(0, file_stat("file.db.pages").st_size);
+    }
+
+    static size_t resident_set()
+    {
+        size_t size=0, resident=0;
+        std::ifstream("/proc/self/statm") >> size >> resident;
+        return resident * sysconf(_SC_PAGESIZE);
+    }
+
+    void TestScanGuard()
+    {
+        const int count = 32<<20;
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::create_new);
+            auto &mem = file.data();
+            auto root = (char**)mem.malloc(100);
+            *root = (char*)mem.malloc(count);
+            memset(*root, 1, count);
+        }
+
+        for(int guarded=0; guarded<2; ++guarded)
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20);
+            auto &mem = file.data();
+            auto data = *(char**)mem.root();
+
+            size_t before = resident_set();
+            int sum = 0;
+            {
+                persist::scan_guard guard(mem, guarded ? 4<<20 : 1<<30);
+                for(int i=0; i<count; i+=512)
+                {
+                    guard.visit(data+i);
+                    sum += data[i];
+                }
+
+                if(guarded)
+                    CHECK(resident_set() < before + (8<<20));
+                else
+                    CHECK(resident_set() > before + (24<<20));
+            }
+            EQUALS(count/512, sum);
+        }
+    }
+
+    void TestCheckpoint()
+    {
+        const int count = 1000;
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::create_new|persist::track_changes);
+            auto &mem = file.data();
+            auto root = (int**)mem.malloc(count * sizeof(int*));
+            for(int i=0; i<count; ++i)
+            {
+                root[i] = (int*)mem.malloc(10000);
+                *root[i] = i;
+            }
+            CHECK(mem.checkpoint());
+
+            // Changes after a checkpoint are tracked again
+            *root[10] = -10;
+            CHECK(mem.checkpoint());
+            CHECK(mem.checkpoint());
+
+            // Writes continue during an asynchronous checkpoint
+            auto done = mem.checkpoint_async();
+            std::thread writer([&] {
+                for(int i=0; i<count; ++i) *root[i] += count;
+            });
+            for(int i=0; i<count; ++i) root[i][1] = i;
+            writer.join();
+            CHECK(done.get());
+            CHECK(mem.checkpoint_async().get());
+        }
+
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::track_changes);
+            auto &mem = file.data();
+            auto root = (int**)mem.root();
+            EQUALS(count-10, *root[10]);
+            EQUALS(count+500, *root[500]);
+            EQUALS(500, root[500][1]);
+            CHECK(mem.checkpoint());
+        }
+
+        {
+            // A private map is never written
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::private_map);
+            CHECK(!file.data().checkpoint());
+        }
+    }
+
+    void TestTransactions()
+    {
+        struct root_type { int values[2000]; int *list[100]; };
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::create_new|persist::transactions);
+            auto &mem = file.data();
+            auto root = (root_type*)mem.malloc(sizeof(root_type));
+            memset(root, 0, sizeof(root_type));
+
+            {
+                persist::transaction tx(mem);
+                for(int i=0; i<2000; ++i) root->values[i] = i;
+                root->list[0] = (int*)mem.malloc(100000);
+                *root->list[0] = 42;
+                CHECK(tx.commit());
+            }
+
+            // Aborted, including the allocations
+            auto size = mem.size();
+            {
+                persist::transaction tx(mem);
+                for(int i=0; i<2000; ++i) root->values[i] = -1;
+                for(int i=1; i<100; ++i) root->list[i] = (int*)mem.malloc(1000 * i);
+                mem.free(root->list[0], 100000);
+                root->list[0] = nullptr;
+            }
+            EQUALS(1000, root->values[1000]);
+            EQUALS(42, *root->list[0]);
+            CHECK(!root->list[1]);
+            EQUALS(size, mem.size());
+
+            // Writes outside a transaction are allowed while none is running
+            root->values[0] = 100;
+
+            // Commits from several threads
+            std::vector<std::thread> threads;
+            for(int t=0; t<4; ++t)
+                threads.emplace_back([&, t] {
+                    for(int i=0; i<50; ++i)
+                    {
+                        persist::transaction tx(mem);
+                        root->values[t] += 1;
+                        CHECK(tx.commit());
+                    }
+                });
+            for(auto &t : threads) t.join();
+            EQUALS(150, root->values[0]);
+            EQUALS(51, root->values[1]);
+
+            // Another thread's transaction waits for this one, and is not rolled back with it
+            std::thread other;
+            {
+                persist::transaction tx(mem);
+                root->values[2] = -1;
+                other = std::thread([&] {
+                    persist::transaction tx(mem);
+                    root->values[3] = -1;
+                    root->list[3] = (int*)mem.malloc(100000);
+                    CHECK(tx.commit());
+                });
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                EQUALS(53, root->values[3]);
+            }
+            other.join();
+            EQUALS(52, root->values[2]);
+            EQUALS(-1, root->values[3]);
+            CHECK(root->list[3]);
+
+            // A thread that is not running the transaction waits for it to write, or to allocate
+            {
+                persist::transaction tx(mem);
+                root->values[4] = -1;
+                other = std::thread([&] {
+                    root->list[3][20000] = -1;
+                    root->list[4] = (int*)mem.malloc(100);
+                });
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                EQUALS(0, root->list[3][20000]);
+                CHECK(!root->list[4]);
+            }
+            other.join();
+            EQUALS(4, root->values[4]);
+            EQUALS(-1, root->list[3][20000]);
+            CHECK(root->list[4]);
+
+            // The tables of pages grow with the heap
+            mem.limit(256<<20);
+            {
+                persist::transaction tx(mem);
+                root->list[5] = (int*)mem.malloc(100<<20);
+                root->list[5][(100<<20)/sizeof(int) - 1] = 5;
+                CHECK(tx.commit());
+            }
+        }
+
+        // A process that dies in a transaction
+        int status;
+        int pid = fork();
+        if(pid == 0)
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20);
+            auto &mem = file.data();
+            auto root = (root_type*)mem.root();
+            mem.begin();
+            for(int i=0; i<2000; ++i) root->values[i] = -1;
+            root->list[1] = (int*)mem.malloc(200000);
+            _exit(0);
+        }
+        waitpid(pid, &status, 0);
+
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20);
+            auto &mem = file.data();
+            auto root = (root_type*)mem.root();
+            EQUALS(1000, root->values[1000]);
+            EQUALS(150, root->values[0]);
+            EQUALS(51, root->values[1]);
+            CHECK(!root->list[1]);
+            EQUALS(-1, root->list[3][20000]);
+            EQUALS(5, root->list[5][(100<<20)/sizeof(int) - 1]);
+
+            persist::transaction tx(mem);
+            root->list[1] = (int*)mem.malloc(200000);
+            CHECK(tx.commit());
+        }
+
+        // A process that dies in malloc, holding mem_mutex, outside a transaction.  The file
+        // cannot grow beyond its size, so growing the heap raises SIGXFSZ in extend_to.
+        pid = fork();
+        if(pid == 0)
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20);
+            auto &mem = file.data();
+            auto root = (root_type*)mem.root();
+            struct stat st;
+            if(stat("file.db", &st) != 0) _exit(1);
+            struct rlimit limit = { (rlim_t)st.st_size, (rlim_t)st.st_size }, no_core = { 0, 0 };
+            setrlimit(RLIMIT_FSIZE, &limit);
+            setrlimit(RLIMIT_CORE, &no_core);
+            root->list[2] = (int*)mem.malloc(32<<20);
+            _exit(0);
+        }
+        waitpid(pid, &status, 0);
+        CHECK(WIFSIGNALED(status));
+        EQUALS(SIGXFSZ, WTERMSIG(status));
+
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20);
+            auto &mem = file.data();
+            auto root = (root_type*)mem.root();
+            CHECK(!root->list[2]);
+
+            persist::transaction tx(mem);
+            root->list[2] = (int*)mem.malloc(32<<20);
+            CHECK(root->list[2]);
+            CHECK(tx.commit());
+        }
+
+        // The system crashes after a commit, before the heap file is written.  The transaction
+        // is in the log, so it is written when the heap is next opened.
+        off_t offset;
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20);
+            auto root = (root_type*)file.data().root();
+            offset = (char*)&root->values[5] - (char*)&file.data();
+            persist::transaction tx(file.data());
+            root->values[5] = -1;
+            CHECK(tx.commit());
+        }
+        {
+            int value = 5, fd = open("file.db", O_RDWR);
+            CHECK(pwrite(fd, &value, sizeof value, offset) == sizeof value);
+            close(fd);
+
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20);
+            auto root = (root_type*)file.data().root();
+            EQUALS(-1, root->values[5]);
+            CHECK(root->list[2]);
+        }
+
+        // The system crashes while the last group is written to the log.  The group fails its
+        // check, so it is not written to the heap file.  The log's header says where it ends.
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20);
+            auto root = (root_type*)file.data().root();
+            persist::transaction tx(file.data());
+            root->values[6] = -1;
+            CHECK(tx.commit());
+        }
+        {
+            std::uint64_t end;
+            int value = 6, fd = open("file.db.log", O_RDWR);
+            CHECK(pread(fd, &end, sizeof end, 16) == sizeof end);
+            CHECK(pwrite(fd, &value, 1, end - 1) == 1);
+            close(fd);
+            fd = open("file.db", O_RDWR);
+            CHECK(pwrite(fd, &value, sizeof value, offset + sizeof value) == sizeof value);
+            close(fd);
+
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20);
+            auto root = (root_type*)file.data().root();
+            EQUALS(-1, root->values[5]);
+            EQUALS(6, root->values[6]);
+        }
+
+        // A heap without transactions
+        {
+            persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::create_new);
+            CHECK(!file.data().begin());
+        }
+        remove("file.db.log");
+    }
+
+    void TestSnapshot()
+    {
+        const int count = 4<<20;
+        for(int flags : { 0, (int)persist::track_changes, (int)persist::transactions })
+        {
+            {
+                persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::create_new|flags);
+                auto &mem = file.data();
+                auto root = (int**)mem.malloc(sizeof(int*));
+                *root = (int*)mem.malloc(count * sizeof(int));
+                for(int i=0; i<count; ++i) (*root)[i] = i;
+
+                auto done = mem.snapshot("snapshot.db");
+
+                // Changes after the snapshot are not in it
+                for(int i=0; i<count; i+=100) (*root)[i] = -1;
+                for(int i=0; i<100; ++i) mem.malloc(1000);
+                CHECK(done.get());
+                EQUALS(-1, (*root)[1000]);
+
+                CHECK(mem.snapshot("snapshot2.db").get());
+            }
+
+            {
+                persist::map_file file("snapshot.db", 0,0,0,16384, 64<<20);
+                CHECK(file);
+                auto &mem = file.data();
+                auto data = *(int**)mem.root();
+                int wrong = 0;
+                for(int i=0; i<count; ++i) wrong += data[i] != i;
+                EQUALS(0, wrong);
+                CHECK(mem.malloc(1000));
+            }
+
+            {
+                persist::map_file file("snapshot2.db", 0,0,0,16384, 64<<20);
+                EQUALS(-1, (*(int**)file.data().root())[1000]);
+            }
+        }
+        remove("snapshot.db");
+        remove("snapshot2.db");
+        remove("snapshot.db.log");
+        remove("snapshot2.db.log");
+        remove("file.db.log");
+    }
+
+    void TestBackup()
+    {
+        const int count = 4<<20;
+        struct stat st;
+        for(int flags : { 0, (int)persist::track_changes })
+        {
+            {
+                persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::create_new|flags);
+                auto &mem = file.data();
+                auto root = (int**)mem.malloc(sizeof(int*));
+                *root = (int*)mem.malloc(count * sizeof(int));
+                for(int i=0; i<count; ++i) (*root)[i] = i;
+                CHECK(mem.backup("backup1.db").get());
+
+                (*root)[1000] = -1;
+                CHECK(mem.backup("backup2.db").get());
+
+                // Only the changes are in an incremental backup
+                (*root)[2000] = -1;
+                CHECK(mem.backup("backup3.db").get());
+                CHECK(stat("backup3.db", &st) == 0);
+                if(flags) CHECK(st.st_size < 1<<20);
+                else CHECK((size_t)st.st_size > count * sizeof(int));
+            }
+
+            remove("restored.db");
+            CHECK(persist::shared_memory::restore("restored.db", "backup1.db"));
+            CHECK(persist::shared_memory::restore("restored.db", "backup2.db"));
+            CHECK(persist::shared_memory::restore("restored.db", "backup3.db"));
+
+            // Backups must be applied in order
+            CHECK(flags == 0 || !persist::shared_memory::restore("restored.db", "backup2.db"));
+
+            {
+                persist::map_file file("restored.db", 0,0,0,16384, 64<<20);
+                CHECK(file);
+                auto data = *(int**)file.data().root();
+                int wrong = 0;
+                for(int i=0; i<count; ++i) wrong += data[i] != (i == 1000 || i == 2000 ? -1 : i);
+                EQUALS(0, wrong);
+            }
+        }
+        remove("backup1.db");
+        remove("backup2.db");
+        remove("backup3.db");
+        remove("restored.db");
+        remove("restored.db.log");
+        remove("file.db.log");
+    }
+
+    void TestReplication()
+    {
+        const int count = 4<<20;
+        for(int flags : { 0, (int)persist::track_changes })
+        {
+            int link[2];
+            CHECK(pipe(link) == 0);
+
+            pid_t pid = fork();
+            if(pid == 0)
+            {
+                // The replica is mapped at the same address as the primary
+                ::close(link[1]);
+                persist::map_file file("replica.db", 0,0,0,16384, 64<<20, persist::create_new);
+                auto &mem = file.data();
+                int batches = 0, errors = 0;
+                while(mem.apply(link[0]))
+                {
+                    mem.lock();
+                    auto data = *(int**)mem.root();
+                    if(data[0] != batches) ++errors;
+                    mem.unlock();
+                    ++batches;
+                }
+                auto data = *(int**)mem.root();
+                for(int i=1; i<count; ++i)
+                    if(data[i] != (i%1000 == 0 ? -i : i)) ++errors;
+                _exit(batches == 3 && errors == 0 ? 0 : 1);
+            }
+            ::close(link[0]);
+
+            {
+                persist::map_file file("file.db", 0,0,0,16384, 64<<20, persist::create_new|flags);
+                auto &mem = file.data();
+                auto root = (int**)mem.malloc(sizeof(int*));
+                *root = (int*)mem.malloc(count * sizeof(int));
+                for(int i=0; i<count; ++i) (*root)[i] = i;
+                CHECK(mem.ship(link[1]));
+
+                for(int i=1000; i<count; i+=2000) (*root)[i] = -i;
+                (*root)[0] = 1;
+                CHECK(mem.ship(link[1]));
+
+                for(int i=2000; i<count; i+=2000) (*root)[i] = -i;
+                (*root)[0] = 2;
+                CHECK(mem.ship(link[1]));
+            }
+            ::close(link[1]);
+
+            int status;
+            waitpid(pid, &status, 0);
+            CHECK(WIFEXITED(status));
+            EQUALS(0, WEXITSTATUS(status));
+        }
+        remove("replica.db");
+        remove("replica.db.log");
+        remove("file.db.log");
+    }
+
+    struct Tenant
+    {
+        std::vector<int, persist::allocator<int>> numbers;
+        pstring name;
+
+        Tenant(persist::shared_memory &mem) : numbers(persist::allocator<int>(mem)), name(mem) { }
+    };
+
+    void TestRelocatable()
+    {
+        const char *names[] = { "file.db", "file2.db" };
+        void *created[2];
+
+        // Heaps created at the same base are open together
+        {
+            persist::map_file a(names[0], 0,0,0,16384, 16<<20, persist::create_new|persist::relocatable);
+            persist::map_file b(names[1], 0,0,0,16384, 16<<20, persist::create_new|persist::relocatable);
+            CHECK(a && b);
+            CHECK(&a.data() != &b.data());
+
+            int id = 0;
+            for(auto file : { &a, &b })
+            {
+                persist::map_data<Tenant> tenant(file->data(), file->data());
+                for(int i=0; i<100000; ++i) tenant->numbers.push_back(i + id);
+                tenant->name = "a tenant with a name too long to be stored in the string";
+                created[id++] = &file->data();
+            }
+        }
+
+        // Opened in the other order, each is mapped somewhere else
+        {
+            persist::map_file b(names[1], 0,0,0);
+            persist::map_file a(names[0], 0,0,0);
+            CHECK(a && b);
+            CHECK(&a.data() != created[0]);
+
+            int id = 0;
+            for(auto file : { &a, &b })
+            {
+                auto tenant = (Tenant*)file->data().root();
+                EQUALS(100000, tenant->numbers.size());
+                int wrong = 0;
+                for(int i=0; i<100000; ++i) wrong += tenant->numbers[i] != i + id;
+                EQUALS(0, wrong);
+                CHECK(tenant->name == "a tenant with a name too long to be stored in the string");
+
+                // The heap grows in place
+                tenant->numbers.resize(1000000);
+                ++id;
+            }
+        }
+
+        remove("file2.db");
+        remove("file2.db.log");
+        remove("file.db.log");
+    }
+#endif
 } tp;
 
 int main()